@@ -1,6 +1,6 @@
 #!/bin/bash
 
-../src/build/coordinator > coordinator.txt 2> err_coordinator.txt < /dev/null &
+../src/build/coordinator config.json > coordinator.txt 2> err_coordinator.txt < /dev/null &
 
 # Waiting for coordinator
 sleep 0.1s
@@ -20,5 +20,6 @@ while read line; do
     out="./script/server_${server[1]}.txt"
     err="./script/err_server_${server[1]}.txt"
     in="/dev/null"
-    ssh root@${server[0]} "cd ${dir}; nohup ${bin} ${server[1]} ${coord_addr} > ${out} 2> ${err} < ${in} &" < /dev/null
+    conf="./script/config.json"
+    ssh root@${server[0]} "cd ${dir}; nohup ${bin} ${server[1]} ${coord_addr} - ${conf} > ${out} 2> ${err} < ${in} &" < /dev/null
 done < servers.txt
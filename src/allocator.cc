@@ -4,29 +4,240 @@
 
 namespace nvds {
 
-void Allocator::Format() {
+thread_local ModificationList* Allocator::modifications_ = nullptr;
+thread_local const Allocator::UndoHook* Allocator::undo_ = nullptr;
+thread_local uint32_t Allocator::fresh_begin_ = 0;
+thread_local uint32_t Allocator::fresh_end_ = 0;
+thread_local std::set<uint32_t> Allocator::freed_;
+
+void Allocator::Format(Engine engine) {
+  memset(flm_, 0, size_);
+  engine_ = engine;
+  *OffsetToPtr<Engine>(0) = engine;
+  if (engine == Engine::SLAB) {
+    LoadSlabs();
+    return;
+  } else if (engine == Engine::LOG) {
+    LoadSegments([](uint32_t) { return true; });
+    return;
+  }
+
+  heads_.fill(0);
+  // Formatting is not replicated, nor undone
+  auto saved_modifications = modifications_;
+  auto saved_undo = undo_;
   ModificationList modifications;
   set_modifications(&modifications);
+  set_undo(nullptr);
 
-  memset(flm_, 0, kSize);
   uint32_t blk = sizeof(FreeListManager);
-  Write(GetLastFreeList(), blk);
+  WriteHead(GetLastFreeList(), blk);
 
   // 'The block before first block' is not free
   // The last 4 bytes is kept for the free tag
-  uint32_t blk_size = (kSize - blk - sizeof(uint32_t)) &
+  uint32_t blk_size = (size_ - blk - sizeof(uint32_t)) &
                       ~static_cast<uint32_t>(0x0f);
   Write(blk, blk_size & ~BlockHeader::kFreeMask);
-  Write(blk + blk_size - sizeof(uint32_t), blk_size);
+  WriteLink(blk + blk_size - sizeof(uint32_t), blk_size);
   SetTheFreeTag(blk, blk_size);
+  free_bytes_ = blk_size;
   // TODO(wgtdkp): setting `next` and `prev` nullptr.(unnecessary if called `memset`)
+  set_modifications(saved_modifications);
+  set_undo(saved_undo);
+}
+
+bool Allocator::Recover(const std::function<bool(uint32_t)>& is_live,
+                        uint32_t* num_leaked) {
+  if (engine_ == Engine::SLAB) {
+    return RecoverSlabs(is_live, num_leaked);
+  } else if (engine_ == Engine::LOG) {
+    // Dead blocks are versions replaced or erased, not leaked
+    *num_leaked = 0;
+    LoadSegments(is_live);
+    return true;
+  }
+  auto end = GetEndOfBlocks();
+  // Sizes of the blocks must chain up to the end
+  for (uint32_t blk = sizeof(FreeListManager), size; blk < end; blk += size) {
+    size = ReadTheSizeTag(blk);
+    if (size < kMinBlockSize || size % 16 != 0 || size > end - blk) {
+      return false;
+    }
+  }
+
+  // The first free list is never used
+  for (uint32_t i = 1; i < kNumFreeLists; ++i) {
+    if (ReadHead(i * sizeof(uint32_t)) != 0) {
+      WriteHead(i * sizeof(uint32_t), 0);
+    }
+  }
+  *num_leaked = 0;
+  free_bytes_ = 0;
+  bool prev_free = false;
+  uint32_t blk = sizeof(FreeListManager);
+  while (blk < end) {
+    auto size = ReadTheSizeTag(blk);
+    if (is_live(blk + sizeof(uint32_t))) {
+      uint32_t header = (prev_free ? BlockHeader::kFreeMask : 0) | size;
+      if (Read<uint32_t>(blk) != header) {
+        Write(blk, header);
+      }
+      prev_free = false;
+      blk += size;
+      continue;
+    }
+    // Coalesce the run of blocks that are not live
+    auto run = blk;
+    while (blk < end && !is_live(blk + sizeof(uint32_t))) {
+      size = ReadTheSizeTag(blk);
+      *num_leaked += ReadTheFreeTag(blk, size) == 0;
+      blk += size;
+    }
+    size = blk - run;
+    Write(run, size);
+    PushBlock(run, size);
+    prev_free = true;
+  }
+  Write(end, prev_free ? BlockHeader::kFreeMask : 0);
+  return true;
+}
+
+void Allocator::PushBlock(uint32_t blk, uint32_t blk_size) {
+  free_bytes_ += blk_size;
+  WriteLink(blk + blk_size - sizeof(uint32_t), blk_size);
+  auto free_list = GetFreeListByBlockSize(blk_size);
+  auto head = ReadHead(free_list);
+  WriteHead(free_list, blk);
+  WriteLink(blk + offsetof(BlockHeader, prev), 0);
+  WriteLink(blk + offsetof(BlockHeader, next), head);
+  if (head != 0) {
+    WriteLink(head + offsetof(BlockHeader, prev), blk);
+  }
+}
+
+void Allocator::LoadFreeLists() {
+  heads_.fill(0);
+  free_bytes_ = 0;
+  auto end = GetEndOfBlocks();
+  for (uint32_t blk = sizeof(FreeListManager), size; blk < end; blk += size) {
+    size = ReadTheSizeTag(blk);
+    if (size < kMinBlockSize || size % 16 != 0 || size > end - blk) {
+      // Not formatted yet
+      return;
+    }
+    if (ReadTheFreeTag(blk, size) != 0) {
+      PushBlock(blk, size);
+    }
+  }
+}
+
+Allocator::Stats Allocator::GetStats() {
+  std::lock_guard<Spinlock> _(spinlock_);
+  Stats stats {0, 0, 0};
+  if (engine_ == Engine::SLAB) {
+    for (uint32_t page = GetNumMetaPages(); page < GetNumPages(); ++page) {
+      uint32_t cls = Read<uint16_t>(GetClassOffset(page));
+      if (cls == 0) {
+        stats.free_bytes += kPageSize;
+        ++stats.num_free_blocks;
+        stats.largest_free_block = kPageSize;
+        continue;
+      }
+      auto num_free = GetNumSlots(cls - 1) - num_used_[page];
+      stats.free_bytes += num_free * GetSlotSize(cls - 1);
+      stats.num_free_blocks += num_free;
+      if (num_free > 0) {
+        stats.largest_free_block = std::max(stats.largest_free_block,
+                                            GetSlotSize(cls - 1));
+      }
+    }
+    return stats;
+  } else if (engine_ == Engine::LOG) {
+    // Free segments and the room of the head make up one free block,
+    // as blocks are appended across segments.
+    uint32_t room = 0;
+    if (head_seg_ != GetNumSegments()) {
+      room = GetSegmentEnd(head_seg_) - head_;
+    }
+    for (uint32_t seg = 0; seg < GetNumSegments(); ++seg) {
+      uint32_t dead = GetSegmentEnd(seg) - GetSegmentBegin(seg) -
+                      live_bytes_[seg];
+      if (seg == head_seg_) {
+        dead -= room;
+      } else if (live_bytes_[seg] == 0) {
+        room += dead;
+        continue;
+      }
+      stats.free_bytes += dead;
+      // Dead bytes of a segment in use are scattered
+      stats.num_free_blocks += dead != 0;
+    }
+    stats.free_bytes += room;
+    stats.num_free_blocks += room != 0;
+    stats.largest_free_block = room;
+    return stats;
+  }
+  auto end = GetEndOfBlocks();
+  for (uint32_t blk = sizeof(FreeListManager), size; blk < end; blk += size) {
+    size = ReadTheSizeTag(blk);
+    if (ReadTheFreeTag(blk, size) != 0) {
+      stats.free_bytes += size;
+      ++stats.num_free_blocks;
+      stats.largest_free_block = std::max(stats.largest_free_block, size);
+    }
+  }
+  return stats;
+}
+
+bool Allocator::Fragmented() {
+  std::lock_guard<Spinlock> _(spinlock_);
+  if (free_bytes_ < GetFragmentedFreeBytes()) {
+    return false;
+  }
+  if (engine_ == Engine::SLAB) {
+    return FindFirst(free_pages_, 0, GetNumPages()) == GetNumPages();
+  } else if (engine_ == Engine::LOG) {
+    return num_free_segments_ < GetNumSegments() / 8;
+  }
+  return GetBlockSizeByFreeList(GetLastFreeList()) < GetFragmentedFreeBytes();
+}
+
+bool Allocator::ShouldMove(uint32_t ptr, uint32_t size) {
+  std::lock_guard<Spinlock> _(spinlock_);
+  if (engine_ == Engine::SLAB) {
+    auto page = ptr / kPageSize;
+    uint32_t cls = Read<uint16_t>(GetClassOffset(page)) - 1;
+    return FindFirst(class_pages_[cls], 0, GetNumPages()) < page;
+  } else if (engine_ == Engine::LOG) {
+    auto seg = ptr / kSegmentSize;
+    return seg != head_seg_ && live_bytes_[seg] < kCleanLiveBytes;
+  }
+  auto blk = ptr - sizeof(uint32_t);
+  auto next_blk = blk + ReadTheSizeTag(blk);
+  uint32_t prev_free = 0;
+  if (ReadThePrevFreeTag(blk)) {
+    prev_free = blk - Read<uint32_t>(blk - sizeof(uint32_t));
+  }
+  uint32_t next_free = 0;
+  if (next_blk < GetEndOfBlocks() &&
+      ReadTheFreeTag(next_blk, ReadTheSizeTag(next_blk))) {
+    next_free = next_blk;
+  }
+  if (prev_free == 0 || next_free == 0) {
+    // Moving into a free neighbor only shifts the hole
+    auto head = ReadHead(GetFreeListByBlockSize(
+        RoundupBlockSize(size + sizeof(uint32_t))));
+    return (prev_free | next_free) != 0 && head != 0 &&
+           head != prev_free && head != next_free;
+  }
+  return true;
 }
 
 uint32_t Allocator::AllocBlock(uint32_t blk_size) {
   auto free_list = GetFreeListByBlockSize(blk_size);
   uint32_t head;
   while (free_list < kNumFreeLists * sizeof(uint32_t) &&
-         (head = Read<uint32_t>(free_list)) == 0) {
+         (head = ReadHead(free_list)) == 0) {
     free_list += sizeof(uint32_t);
   }
   if (head == 0) {
@@ -35,12 +246,15 @@ uint32_t Allocator::AllocBlock(uint32_t blk_size) {
   auto head_size = ReadTheSizeTag(head);
   assert(ReadTheFreeTag(head, head_size) != 0);
   assert(head_size >= blk_size);
-  if (head_size == blk_size) {
+  // The rest piece is too small to be a block, hand out the whole block.
+  if (head_size - blk_size < kMinBlockSize) {
     auto next_blk = Read<uint32_t>(head + offsetof(BlockHeader, next));
     ResetTheFreeTag(head, head_size);
-    Write(free_list, next_blk);
-    Write(next_blk + offsetof(BlockHeader, prev),
-          static_cast<uint32_t>(0));
+    WriteHead(free_list, next_blk);
+    if (next_blk != 0) {
+      WriteLink(next_blk + offsetof(BlockHeader, prev),
+            static_cast<uint32_t>(0));
+    }
     return head;
   }
   return SplitBlock(head, head_size, blk_size);
@@ -54,16 +268,13 @@ void Allocator::FreeBlock(uint32_t blk) {
   auto next_blk      = blk + blk_size;
   auto next_blk_size = ReadTheSizeTag(next_blk);
 
-  if (ReadThePrevFreeTag(blk) &&
-      blk_size <= kMaxBlockSize &&
-      prev_blk_size <= kMaxBlockSize) {
+  if (ReadThePrevFreeTag(blk)) {
     RemoveBlock(prev_blk, prev_blk_size);
     blk = prev_blk;
     blk_size += prev_blk_size;
   }
-  if (ReadTheFreeTag(next_blk, next_blk_size) &&
-      blk_size <= kMaxBlockSize &&
-      next_blk_size <= kMaxBlockSize) {
+  if (next_blk < GetEndOfBlocks() &&
+      ReadTheFreeTag(next_blk, next_blk_size)) {
     RemoveBlock(next_blk, next_blk_size);
     blk_size += next_blk_size;
   }
@@ -71,17 +282,18 @@ void Allocator::FreeBlock(uint32_t blk) {
   // If the blk_size changed, write it.
   if (blk_size != blk_size_old) {
     Write(blk, ReadThePrevFreeTag(blk) | blk_size);
-    Write(blk + blk_size - sizeof(uint32_t), blk_size);
   }
+  // The footer may have been overwritten by an object that fills the block
+  WriteLink(blk + blk_size - sizeof(uint32_t), blk_size);
   SetTheFreeTag(blk, blk_size);
 
   auto free_list = GetFreeListByBlockSize(blk_size);
-  auto head = Read<uint32_t>(free_list);
-  Write(free_list, blk);
-  Write(blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
-  Write(blk + offsetof(BlockHeader, next), head);
+  auto head = ReadHead(free_list);
+  WriteHead(free_list, blk);
+  WriteLink(blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
+  WriteLink(blk + offsetof(BlockHeader, next), head);
   if (head != 0) {
-    Write(head + offsetof(BlockHeader, prev), blk);
+    WriteLink(head + offsetof(BlockHeader, prev), blk);
   }
 }
 
@@ -90,14 +302,14 @@ void Allocator::RemoveBlock(uint32_t blk, uint32_t blk_size) {
   auto prev_blk = Read<uint32_t>(blk + offsetof(BlockHeader, prev));
   auto next_blk = Read<uint32_t>(blk + offsetof(BlockHeader, next));
   if (prev_blk != 0) {
-    Write(prev_blk + offsetof(BlockHeader, next),
+    WriteLink(prev_blk + offsetof(BlockHeader, next),
           Read<uint32_t>(blk + offsetof(BlockHeader, next)));
   } else {
     auto free_list = GetFreeListByBlockSize(blk_size);
-    Write(free_list, Read<uint32_t>(blk + offsetof(BlockHeader, next)));
+    WriteHead(free_list, Read<uint32_t>(blk + offsetof(BlockHeader, next)));
   }
   if (next_blk != 0) {
-    Write(next_blk + offsetof(BlockHeader, prev),
+    WriteLink(next_blk + offsetof(BlockHeader, prev),
           Read<uint32_t>(blk + offsetof(BlockHeader, prev)));
   }
 }
@@ -109,31 +321,243 @@ uint32_t Allocator::SplitBlock(uint32_t blk, uint32_t blk_size,
   assert(blk_size > needed_size);
   auto new_size  = blk_size - needed_size;
 
-  Write(free_list, next_blk);
+  WriteHead(free_list, next_blk);
   if (next_blk != 0) {
-    Write(next_blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
+    WriteLink(next_blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
   }
 
   // Update size
   Write(blk, ReadThePrevFreeTag(blk) | new_size);
-  Write(blk + new_size - sizeof(uint32_t), new_size);
+  WriteLink(blk + new_size - sizeof(uint32_t), new_size);
 
   free_list = GetFreeListByBlockSize(new_size);
-  auto head = Read<uint32_t>(free_list);
-  Write(blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
-  Write(blk + offsetof(BlockHeader, next), head);
-  Write(free_list, blk);
+  auto head = ReadHead(free_list);
+  WriteLink(blk + offsetof(BlockHeader, prev), static_cast<uint32_t>(0));
+  WriteLink(blk + offsetof(BlockHeader, next), head);
+  WriteHead(free_list, blk);
   if (head != 0) {
-    Write(head + offsetof(BlockHeader, prev), blk);
+    WriteLink(head + offsetof(BlockHeader, prev), blk);
   }
 
   // The rest smaller block is still free
   Write(blk + new_size, BlockHeader::kFreeMask | needed_size);
-  Write(blk + blk_size - sizeof(uint32_t), needed_size);
+  WriteLink(blk + blk_size - sizeof(uint32_t), needed_size);
 
   // Piece splitted is not free now.
   ResetTheFreeTag(blk + new_size, needed_size);
   return blk + new_size;
 }
 
+void Allocator::LoadSlabs() {
+  class_pages_.assign(kNumClasses,
+                      std::vector<uint64_t>((GetNumPages() + 63) / 64, 0));
+  free_pages_.assign((GetNumPages() + 63) / 64, 0);
+  nonempty_classes_.fill(0);
+  num_used_.assign(GetNumPages(), 0);
+  free_bytes_ = 0;
+  for (uint32_t page = GetNumMetaPages(); page < GetNumPages(); ++page) {
+    auto cls = Read<uint16_t>(GetClassOffset(page));
+    if (cls == 0 || cls > kNumClasses) {
+      SetBit(free_pages_, page, true);
+      free_bytes_ += kPageSize;
+      continue;
+    }
+    uint32_t num_used = 0;
+    for (uint32_t w = 0; w < kNumBitmapWords; ++w) {
+      num_used += __builtin_popcountll(Read<uint64_t>(GetBitmapOffset(page, w)));
+    }
+    UpdatePage(page, cls - 1, num_used);
+    free_bytes_ += (GetNumSlots(cls - 1) - num_used) * GetSlotSize(cls - 1);
+  }
+}
+
+void Allocator::UpdatePage(uint32_t page, uint32_t cls, uint32_t num_used) {
+  num_used_[page] = num_used;
+  auto& pages = class_pages_[cls];
+  SetBit(pages, page, num_used < GetNumSlots(cls));
+  SetBit(nonempty_classes_, cls,
+         FindFirst(pages, 0, GetNumPages()) < GetNumPages());
+}
+
+/*
+ * A slot of the class is allocated from a page that has free slots. If
+ * there is none, a free page is taken for the class; if there is no free
+ * page either, the slot is taken from the smallest larger class.
+ */
+uint32_t Allocator::AllocSlot(uint32_t size) {
+  uint32_t cls = (std::max(size, static_cast<uint32_t>(1)) + 15) / 16 - 1;
+  assert(cls < kNumClasses);
+  uint32_t page;
+  if (FindFirst(nonempty_classes_, cls, kNumClasses) != cls) {
+    page = FindFirst(free_pages_, 0, GetNumPages());
+    if (page != GetNumPages()) {
+      Write(GetClassOffset(page), static_cast<uint16_t>(cls + 1));
+      SetBit(free_pages_, page, false);
+      UpdatePage(page, cls, 0);
+      free_bytes_ -= kPageSize - GetNumSlots(cls) * GetSlotSize(cls);
+    } else if ((cls = FindFirst(nonempty_classes_, cls, kNumClasses)) ==
+               kNumClasses) {
+      return 0;
+    }
+  }
+  page = FindFirst(class_pages_[cls], 0, GetNumPages());
+  assert(page < GetNumPages());
+
+  auto n = GetNumSlots(cls);
+  for (uint32_t w = 0; w * 64 < n; ++w) {
+    auto word = Read<uint64_t>(GetBitmapOffset(page, w));
+    auto free = ~word;
+    if (free == 0 || w * 64 + __builtin_ctzll(free) >= n) {
+      continue;
+    }
+    auto i = __builtin_ctzll(free);
+    Write(GetBitmapOffset(page, w), word | static_cast<uint64_t>(1) << i);
+    UpdatePage(page, cls, num_used_[page] + 1);
+    free_bytes_ -= GetSlotSize(cls);
+    return page * kPageSize + (w * 64 + i) * GetSlotSize(cls);
+  }
+  assert(false);
+  return 0;
+}
+
+void Allocator::FreeSlot(uint32_t ptr) {
+  auto page = ptr / kPageSize;
+  uint32_t cls = Read<uint16_t>(GetClassOffset(page)) - 1;
+  assert(page >= GetNumMetaPages() && cls < kNumClasses);
+  auto i = (ptr % kPageSize) / GetSlotSize(cls);
+  auto word = Read<uint64_t>(GetBitmapOffset(page, i / 64));
+  assert(word & static_cast<uint64_t>(1) << (i % 64));
+  Write(GetBitmapOffset(page, i / 64),
+        word & ~(static_cast<uint64_t>(1) << (i % 64)));
+  UpdatePage(page, cls, num_used_[page] - 1);
+  free_bytes_ += GetSlotSize(cls);
+  if (num_used_[page] == 0) {
+    free_bytes_ += kPageSize - GetNumSlots(cls) * GetSlotSize(cls);
+    // The empty page is handed back to all classes
+    Write(GetClassOffset(page), static_cast<uint16_t>(0));
+    SetBit(class_pages_[cls], page, false);
+    SetBit(nonempty_classes_, cls,
+           FindFirst(class_pages_[cls], 0, GetNumPages()) < GetNumPages());
+    SetBit(free_pages_, page, true);
+  }
+}
+
+bool Allocator::RecoverSlabs(const std::function<bool(uint32_t)>& is_live,
+                             uint32_t* num_leaked) {
+  *num_leaked = 0;
+  for (uint32_t page = GetNumMetaPages(); page < GetNumPages(); ++page) {
+    auto cls = Read<uint16_t>(GetClassOffset(page));
+    if (cls == 0) {
+      continue;
+    }
+    if (cls > kNumClasses) {
+      return false;
+    }
+    bool empty = true;
+    for (uint32_t w = 0; w < kNumBitmapWords; ++w) {
+      auto word = Read<uint64_t>(GetBitmapOffset(page, w));
+      auto used = word;
+      while (used != 0) {
+        auto i = w * 64 + __builtin_ctzll(used);
+        used &= used - 1;
+        if (i >= GetNumSlots(cls - 1) ||
+            !is_live(page * kPageSize + i * GetSlotSize(cls - 1))) {
+          word &= ~(static_cast<uint64_t>(1) << (i % 64));
+          ++*num_leaked;
+        }
+      }
+      if (word != Read<uint64_t>(GetBitmapOffset(page, w))) {
+        Write(GetBitmapOffset(page, w), word);
+      }
+      empty = empty && word == 0;
+    }
+    if (empty) {
+      Write(GetClassOffset(page), static_cast<uint16_t>(0));
+    }
+  }
+  LoadSlabs();
+  return true;
+}
+
+/*
+ * Segments are walked from their beginnings by the size headers, until
+ * the 0 header after the last block. A header torn by a crash, which
+ * belongs to an allocation that is not committed, ends the walk as well.
+ * Appending starts over from a free segment; if there is none, from the
+ * segment with the most room after its last block.
+ */
+void Allocator::LoadSegments(const std::function<bool(uint32_t)>& is_live) {
+  live_bytes_.assign(GetNumSegments(), 0);
+  free_segments_.assign((GetNumSegments() + 63) / 64, 0);
+  num_free_segments_ = 0;
+  free_bytes_ = 0;
+  head_seg_ = GetNumSegments();
+  uint32_t room = 0;
+  for (uint32_t seg = 0; seg < GetNumSegments(); ++seg) {
+    auto end = GetSegmentEnd(seg);
+    auto blk = GetSegmentBegin(seg);
+    for (uint32_t size; blk + sizeof(uint32_t) <= end; blk += size) {
+      size = ReadTheSizeTag(blk);
+      if (size < kMinBlockSize || size % 16 != 0 || size > end - blk) {
+        break;
+      }
+      if (is_live(blk + sizeof(uint32_t))) {
+        live_bytes_[seg] += size;
+      }
+    }
+    free_bytes_ += end - GetSegmentBegin(seg) - live_bytes_[seg];
+    if (live_bytes_[seg] == 0) {
+      FreeSegment(seg);
+    } else if (end - blk > room) {
+      head_seg_ = seg;
+      head_ = blk;
+      room = end - blk;
+    }
+  }
+  auto seg = FindFirst(free_segments_, 0, GetNumSegments());
+  if (seg != GetNumSegments()) {
+    SetBit(free_segments_, seg, false);
+    --num_free_segments_;
+    head_seg_ = seg;
+    head_ = GetSegmentBegin(seg);
+  }
+}
+
+uint32_t Allocator::AppendBlock(uint32_t blk_size, bool relocation) {
+  if (head_seg_ == GetNumSegments() ||
+      head_ + blk_size > GetSegmentEnd(head_seg_)) {
+    if (num_free_segments_ <= (relocation ? 0 : kNumReservedSegments)) {
+      return 0;
+    }
+    // The room left in the head segment is dead
+    if (head_seg_ != GetNumSegments() && live_bytes_[head_seg_] == 0) {
+      FreeSegment(head_seg_);
+    }
+    head_seg_ = FindFirst(free_segments_, 0, GetNumSegments());
+    SetBit(free_segments_, head_seg_, false);
+    --num_free_segments_;
+    head_ = GetSegmentBegin(head_seg_);
+  }
+  auto blk = head_;
+  Write(blk, blk_size);
+  head_ += blk_size;
+  if (head_ + sizeof(uint32_t) <= GetSegmentEnd(head_seg_)) {
+    Write(head_, static_cast<uint32_t>(0));
+  }
+  live_bytes_[head_seg_] += blk_size;
+  free_bytes_ -= blk_size;
+  return blk;
+}
+
+void Allocator::FreeLogBlock(uint32_t blk) {
+  auto size = ReadTheSizeTag(blk);
+  auto seg = blk / kSegmentSize;
+  assert(live_bytes_[seg] >= size);
+  live_bytes_[seg] -= size;
+  free_bytes_ += size;
+  if (live_bytes_[seg] == 0 && seg != head_seg_) {
+    FreeSegment(seg);
+  }
+}
+
 } // namespace nvds
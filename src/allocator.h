@@ -1,6 +1,26 @@
 /*
  * This allocator is a simplified version of `Doug Lea's Malloc`.
  * Reference: http://g.oswego.edu/dl/html/malloc.html
+ *
+ * Free lists could be kept in DRAM instead (`Engine::DRAM_FREE_LIST`),
+ * of which the heads, links and footers are neither persisted nor
+ * replicated. Only headers of blocks, i.e. sizes and free tags, are
+ * persistent; free lists are rebuilt from them when reattached.
+ *
+ * An arena could be formatted with the slab engine instead, which
+ * carves pages into slots of fixed size classes. Occupancy of slots is
+ * kept in a bitmap of each page, so that allocating or freeing a slot
+ * writes a single word to NVM, instead of the tags, footers and links of
+ * free lists. Pages with free slots of each class are found by `ctz` on
+ * bitmaps in DRAM, which are rebuilt from the arena when reattached.
+ *
+ * The log engine appends blocks to the head segment of the arena, as
+ * RAMCloud does. A block is a size header followed by the object, and the
+ * header after the last block of a segment is 0, so that each allocation
+ * is a single contiguous write. Freeing a block writes nothing; the live
+ * bytes of segments are counted in DRAM, and a segment is reused once
+ * none is live. Live blocks of sparse segments are relocated to the head
+ * by the tablet's compaction, which acts as the cleaner.
  */
 
 #ifndef _NVDS_ALLOCATOR_H_
@@ -8,26 +28,101 @@
 
 #include "common.h"
 #include "modification.h"
+#include "spinlock.h"
 
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <memory.h>
+#include <mutex>
+#include <set>
+#include <vector>
 
 namespace nvds {
 
+/*
+ * `Alloc` and `Free` are thread safe. NVM writes are recorded to the
+ * modification list set by the calling thread, and the bytes before each
+ * write are saved by the undo hook set by it, if any.
+ */
 class Allocator {
  public:
+  // Saves the `len` bytes at `offset` before they are written
+  using UndoHook = std::function<void(uint32_t offset, uint32_t len)>;
   static const uint32_t kMaxBlockSize = 1024 + 128;
+  // Default size of the arena, tablets take `Config::tablet_size`
   static const uint32_t kSize = 64 * 1024 * 1024;
+  // Persisted in the arena, 0 for arenas formatted before engines
+  enum class Engine : uint32_t {
+    FREE_LIST = 0,
+    SLAB = 1,
+    DRAM_FREE_LIST = 2,
+    LOG = 3,
+  };
 
-  Allocator(void* base) : Allocator(reinterpret_cast<uintptr_t>(base)) {
-    Format();
+  // The arena of `size` bytes, a multiple of `kSegmentSize`
+  Allocator(void* base, Engine engine=Engine::FREE_LIST, uint32_t size=kSize)
+      : base_(reinterpret_cast<uintptr_t>(base)), size_(size), cnt_writes_(0) {
+    assert(size_ % kSegmentSize == 0);
+    flm_ = OffsetToPtr<FreeListManager>(0);
+    Format(engine);
   }
-  Allocator(uintptr_t base)
-      : base_(base), cnt_writes_(0), modifications_(nullptr) {
+  Allocator(uintptr_t base, uint32_t size=kSize)
+      : base_(base), size_(size), cnt_writes_(0) {
+    assert(size_ % kSegmentSize == 0);
     flm_ = OffsetToPtr<FreeListManager>(0);
+    engine_ = *OffsetToPtr<Engine>(0);
+    if (engine_ == Engine::SLAB) {
+      LoadSlabs();
+    } else if (engine_ == Engine::DRAM_FREE_LIST) {
+      LoadFreeLists();
+    } else if (engine_ == Engine::LOG) {
+      // Dead blocks are not known until `Recover`
+      LoadSegments([](uint32_t) { return true; });
+    }
   }
   ~Allocator() {}
   DISALLOW_COPY_AND_ASSIGN(Allocator);
 
+  Engine engine() const { return engine_; }
+  uint32_t size() const { return size_; }
+  // Free all blocks. An allocator constructed with `uintptr_t` base
+  // reattaches to the formatted arena, without formatting it.
+  void Format(Engine engine=Engine::FREE_LIST);
+  // Rebuild the free lists after restart. Blocks that are not live,
+  // i.e. free or leaked by a crash, are coalesced and freed; the number
+  // of leaked blocks is returned by `num_leaked`. Return false, leaving
+  // the arena untouched, if sizes of the blocks are corrupted.
+  bool Recover(const std::function<bool(uint32_t ptr)>& is_live,
+               uint32_t* num_leaked);
+
+  // Fragmentation metrics, collected by walking the arena
+  struct Stats {
+    uint32_t free_bytes;
+    // Free blocks; or free slots and pages, for the slab engine; or
+    // segments with dead bytes, for the log engine
+    uint32_t num_free_blocks;
+    uint32_t largest_free_block;
+    // 0 if the free space is one block, close to 1 if it is scattered
+    double fragmentation() const {
+      return free_bytes == 0 ? 0 :
+          1 - static_cast<double>(largest_free_block) / free_bytes;
+    }
+  };
+  Stats GetStats();
+  uint32_t free_bytes() const { return free_bytes_; }
+  // If a fair share of the arena is free, but large blocks (free pages
+  // for the slab engine) are used up. The head of the last free list
+  // stands for the large blocks. For the log engine, if free segments
+  // are running out.
+  bool Fragmented();
+  // If relocating the object of `size` bytes at `ptr` reduces the free
+  // blocks: both neighbors of its block are free, or one is and there is
+  // another free block that fits exactly; for the slab engine, a page of
+  // the same class with free slots comes before its page; for the log
+  // engine, its segment is not the head and is mostly dead.
+  bool ShouldMove(uint32_t ptr, uint32_t size);
+
   // Return offset to the object
   uint32_t Alloc(uint32_t size) {
     auto blk_size = RoundupBlockSize(size + sizeof(uint32_t));
@@ -35,13 +130,46 @@ class Allocator {
     // The client side should refuse too big kv item.  
     assert(blk_size <= kMaxBlockSize);
 
+    std::lock_guard<Spinlock> _(spinlock_);
+    if (engine_ == Engine::SLAB) {
+      return Fresh(AllocSlot(size), size);
+    } else if (engine_ == Engine::LOG) {
+      auto blk = AppendBlock(blk_size, false);
+      return Fresh(blk == 0 ? 0 : blk + sizeof(uint32_t), size);
+    }
     auto blk = AllocBlock(blk_size);
-    return blk == 0 ? 0 : blk + sizeof(uint32_t);
+    if (blk == 0) {
+      return 0;
+    }
+    free_bytes_ -= ReadTheSizeTag(blk);
+    return Fresh(blk + sizeof(uint32_t), size);
+  }
+  // Allocate for an object to be relocated; the log engine may take the
+  // segment reserved for the cleaner.
+  uint32_t AllocForRelocation(uint32_t size) {
+    if (engine_ != Engine::LOG) {
+      return Alloc(size);
+    }
+    auto blk_size = RoundupBlockSize(size + sizeof(uint32_t));
+    std::lock_guard<Spinlock> _(spinlock_);
+    auto blk = AppendBlock(blk_size, true);
+    return Fresh(blk == 0 ? 0 : blk + sizeof(uint32_t), size);
   }
   void Free(uint32_t ptr) {
     // TODO(wgtdkp): checking if ptr is actually in this Allocator zone.
-    assert(ptr > sizeof(uint32_t) && ptr <= kSize);
-    FreeBlock(ptr - sizeof(uint32_t));
+    assert(ptr > sizeof(uint32_t) && ptr <= size_);
+    if (undo_ != nullptr) {
+      freed_.insert(ptr);
+    }
+    std::lock_guard<Spinlock> _(spinlock_);
+    if (engine_ == Engine::SLAB) {
+      FreeSlot(ptr);
+    } else if (engine_ == Engine::LOG) {
+      FreeLogBlock(ptr - sizeof(uint32_t));
+    } else {
+      free_bytes_ += ReadTheSizeTag(ptr - sizeof(uint32_t));
+      FreeBlock(ptr - sizeof(uint32_t));
+    }
   }
     template<typename T>
   T* OffsetToPtr(uint32_t offset) const {
@@ -51,6 +179,7 @@ class Allocator {
   void Write(uint32_t offset, const T& val) {
     assert(offset != 0);
     auto ptr = OffsetToPtr<T>(offset);
+    Save(offset, sizeof(T));
     *ptr = val;
     modifications_->emplace_back(offset,
         base_ + offset, static_cast<uint32_t>(sizeof(T)));
@@ -72,10 +201,12 @@ class Allocator {
     return memcmp(lhs, OffsetToPtr<char>(rhs), len);
   }
   void Memcpy(uint32_t des, uint32_t src, uint32_t len) {
+    Save(des, len);
     memcpy(OffsetToPtr<char>(des), OffsetToPtr<char>(src), len);
     modifications_->emplace_back(des, base_ + des, len);
   }
   void Memcpy(uint32_t des, const char* src, uint32_t len) {
+    Save(des, len);
     memcpy(OffsetToPtr<char>(des), src, len);
     modifications_->emplace_back(des, base_ + des, len);
   }
@@ -85,13 +216,46 @@ class Allocator {
   }
   uintptr_t base() const { return base_; }
   uint64_t cnt_writes() const { return cnt_writes_; }
-  void set_modifications(ModificationList* modifications) {
+  // Set the modification list of the calling thread.
+  static void set_modifications(ModificationList* modifications) {
     modifications_ = modifications;
   }
+  // Set the undo hook of the calling thread, nullptr for none. Writes to
+  // blocks allocated since `ForgetBlocks` are not saved, as the blocks
+  // were free before, unless they may overlap blocks freed since then.
+  static void set_undo(const UndoHook* undo) { undo_ = undo; }
+  static void ForgetBlocks() {
+    fresh_begin_ = fresh_end_ = 0;
+    freed_.clear();
+  }
 
  private:
   static const uint32_t kNumFreeLists = kMaxBlockSize / 16 + 1;
-  void Format();
+  // The first free list, which is at offset 0, is never used;
+  // since offset 0 denotes null.
+  static const uint32_t kMinBlockSize = 32;
+  // Free bytes beyond which the arena may be `Fragmented`
+  uint32_t GetFragmentedFreeBytes() const { return size_ / 16; }
+
+  void Save(uint32_t offset, uint32_t len) {
+    if (undo_ != nullptr &&
+        (offset < fresh_begin_ || offset + len > fresh_end_)) {
+      (*undo_)(offset, len);
+    }
+  }
+  // The object of `size` bytes allocated at `ptr`, which is not fresh if
+  // it may overlap a block freed, of `kMaxBlockSize` bytes at most.
+  uint32_t Fresh(uint32_t ptr, uint32_t size) {
+    if (undo_ == nullptr || ptr == 0) {
+      return ptr;
+    }
+    auto it = freed_.lower_bound(ptr + size);
+    if (it == freed_.begin() || *std::prev(it) + kMaxBlockSize <= ptr) {
+      fresh_begin_ = ptr;
+      fresh_end_ = ptr + size;
+    }
+    return ptr;
+  }
 
   PACKED(
   struct BlockHeader {
@@ -137,7 +301,7 @@ class Allocator {
       return (free_list + 1) * 16;
     }
     assert(free_list == kNumFreeLists - 1);
-    auto head = Read<uint32_t>(free_list * sizeof(uint32_t));
+    auto head = ReadHead(free_list * sizeof(uint32_t));
     return head == 0 ? 0 : ReadTheSizeTag(head);
   }
   uint32_t GetFreeListByBlockOffset(uint32_t blk) {
@@ -153,7 +317,8 @@ class Allocator {
   }
   static uint32_t RoundupBlockSize(uint32_t blk_size) {
     if (blk_size <= kMaxBlockSize) {
-      return (blk_size + 16 - 1) / 16 * 16;
+      blk_size = (blk_size + 16 - 1) / 16 * 16;
+      return blk_size < kMinBlockSize ? kMinBlockSize : blk_size;
     }
     assert(false);
     return 0;
@@ -185,6 +350,38 @@ class Allocator {
     return Read<uint32_t>(blk) & ~BlockHeader::kFreeMask;
   }
 
+  // The word after the last block, which holds its free tag
+  uint32_t GetEndOfBlocks() const {
+    return sizeof(FreeListManager) +
+        ((size_ - sizeof(FreeListManager) - sizeof(uint32_t)) &
+         ~static_cast<uint32_t>(0x0f));
+  }
+
+  uint32_t ReadHead(uint32_t free_list) {
+    return engine_ == Engine::DRAM_FREE_LIST ?
+        heads_[free_list / sizeof(uint32_t)] : Read<uint32_t>(free_list);
+  }
+  void WriteHead(uint32_t free_list, uint32_t blk) {
+    if (engine_ == Engine::DRAM_FREE_LIST) {
+      heads_[free_list / sizeof(uint32_t)] = blk;
+    } else {
+      Write(free_list, blk);
+    }
+  }
+  // Write a link or footer of a block, which is not recorded
+  // for `Engine::DRAM_FREE_LIST`.
+  void WriteLink(uint32_t offset, uint32_t val) {
+    if (engine_ == Engine::DRAM_FREE_LIST) {
+      *OffsetToPtr<uint32_t>(offset) = val;
+    } else {
+      Write(offset, val);
+    }
+  }
+  // Push the free block to the head of its free list.
+  void PushBlock(uint32_t blk, uint32_t blk_size);
+  // Rebuild free lists of `Engine::DRAM_FREE_LIST` from the free tags,
+  // without writing to NVM.
+  void LoadFreeLists();
   uint32_t AllocBlock(uint32_t size);
   void FreeBlock(uint32_t blk);
   
@@ -192,11 +389,124 @@ class Allocator {
   void RemoveBlock(uint32_t blk, uint32_t blk_size);
   uint32_t SplitBlock(uint32_t blk, uint32_t blk_size, uint32_t needed_size);
 
+  // Slab engine
+  static const uint32_t kPageSize = 64 * 1024;
+  // Slots of class `c` are `(c + 1) * 16` bytes
+  static const uint32_t kNumClasses = kMaxBlockSize / 16;
+  static const uint32_t kMaxSlotsPerPage = kPageSize / 16;
+  static const uint32_t kNumBitmapWords = kMaxSlotsPerPage / 64;
+
+  // The slab manager at the beginning of the arena is:
+  //   Engine engine, uint32_t reserved: shared with the first free list,
+  //     which is never used;
+  //   uint16_t classes[num_pages]: class of each page plus 1, 0 if the
+  //     page is free;
+  //   uint64_t bitmaps[num_pages][kNumBitmapWords]: occupancy of slots
+  //     of each page.
+  static const uint32_t kClassesOffset = 2 * sizeof(uint32_t);
+  uint32_t GetNumPages() const { return size_ / kPageSize; }
+  // Pages holding the slab manager
+  uint32_t GetNumMetaPages() const {
+    return (GetBitmapOffset(GetNumPages(), 0) + kPageSize - 1) / kPageSize;
+  }
+
+  static uint32_t GetSlotSize(uint32_t cls) { return (cls + 1) * 16; }
+  static uint32_t GetNumSlots(uint32_t cls) {
+    return kPageSize / GetSlotSize(cls);
+  }
+  static uint32_t GetClassOffset(uint32_t page) {
+    return kClassesOffset + page * sizeof(uint16_t);
+  }
+  uint32_t GetBitmapOffset(uint32_t page, uint32_t word) const {
+    auto bitmaps = (kClassesOffset + GetNumPages() * sizeof(uint16_t) +
+                    sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+    return bitmaps + (page * kNumBitmapWords + word) * sizeof(uint64_t);
+  }
+  // Index of the first set bit of the bitmap, not less than `from`;
+  // `n` if there is none.
+  template<typename Bitmap>
+  static uint32_t FindFirst(const Bitmap& bitmap, uint32_t from, uint32_t n) {
+    for (uint32_t w = from / 64; w < bitmap.size(); ++w) {
+      auto word = bitmap[w];
+      if (w == from / 64) {
+        word &= ~static_cast<uint64_t>(0) << (from % 64);
+      }
+      if (word != 0) {
+        return std::min(w * 64 + __builtin_ctzll(word), n);
+      }
+    }
+    return n;
+  }
+  template<typename Bitmap>
+  static void SetBit(Bitmap& bitmap, uint32_t i, bool val) {
+    auto mask = static_cast<uint64_t>(1) << (i % 64);
+    bitmap[i / 64] = val ? bitmap[i / 64] | mask : bitmap[i / 64] & ~mask;
+  }
+  // Rebuild the DRAM bitmaps from pages of the arena.
+  void LoadSlabs();
+  uint32_t AllocSlot(uint32_t size);
+  void FreeSlot(uint32_t ptr);
+  // Update the DRAM bitmaps with the number of used slots of the page.
+  void UpdatePage(uint32_t page, uint32_t cls, uint32_t num_used);
+  bool RecoverSlabs(const std::function<bool(uint32_t ptr)>& is_live,
+                    uint32_t* num_leaked);
+
+  // Log engine
+  static const uint32_t kSegmentSize = 1024 * 1024;
+  uint32_t GetNumSegments() const { return size_ / kSegmentSize; }
+  // Free segments kept for the cleaner, which allocates to free others
+  static const uint32_t kNumReservedSegments = 1;
+  // Segments with fewer live bytes are cleaned
+  static const uint32_t kCleanLiveBytes = kSegmentSize / 2;
+  // Objects are 16-byte aligned, after the 4-byte headers of blocks
+  static uint32_t GetSegmentBegin(uint32_t seg) {
+    return seg * kSegmentSize + 16 - sizeof(uint32_t);
+  }
+  static uint32_t GetSegmentEnd(uint32_t seg) {
+    return (seg + 1) * kSegmentSize;
+  }
+  // Count the live bytes of segments by walking them, and start
+  // appending to a free segment, without writing to NVM.
+  void LoadSegments(const std::function<bool(uint32_t ptr)>& is_live);
+  uint32_t AppendBlock(uint32_t blk_size, bool relocation);
+  void FreeLogBlock(uint32_t blk);
+  void FreeSegment(uint32_t seg) {
+    SetBit(free_segments_, seg, true);
+    ++num_free_segments_;
+  }
+
  private:
   uintptr_t base_;
+  uint32_t size_;
   FreeListManager* flm_;
+  Engine engine_;
+  // Heads of free lists of `Engine::DRAM_FREE_LIST`
+  std::array<uint32_t, kNumFreeLists> heads_ {};
+  // Slab engine, in DRAM
+  // Pages with free slots of each class, bit `p` for page `p`
+  std::vector<std::vector<uint64_t>> class_pages_;
+  std::vector<uint64_t> free_pages_;
+  // Classes with pages that have free slots
+  std::array<uint64_t, (kNumClasses + 63) / 64> nonempty_classes_;
+  std::vector<uint16_t> num_used_;
+  // Log engine, in DRAM
+  std::vector<uint32_t> live_bytes_;
+  std::vector<uint64_t> free_segments_;
+  uint32_t num_free_segments_ {0};
+  // Segment of the head, `GetNumSegments()` if there is none
+  uint32_t head_seg_ {0};
+  // Where the next block is appended
+  uint32_t head_ {0};
+  // Free bytes of blocks, or slots and pages, in DRAM
+  uint32_t free_bytes_ {0};
   uint64_t cnt_writes_;
-  ModificationList* modifications_;
+  Spinlock spinlock_;
+  static thread_local ModificationList* modifications_;
+  static thread_local const UndoHook* undo_;
+  // The last object allocated, and those freed, since `ForgetBlocks`
+  static thread_local uint32_t fresh_begin_;
+  static thread_local uint32_t fresh_end_;
+  static thread_local std::set<uint32_t> freed_;
 };
 
 } // namespace nvds
@@ -3,6 +3,9 @@
 #include "request.h"
 #include "response.h"
 
+#include <algorithm>
+#include <map>
+
 namespace nvds {
 
 using json = nlohmann::json;
@@ -35,6 +38,7 @@ void Client::Join() {
 
   auto j_body = json::parse(msg.body());
   index_manager_ = j_body["index_manager"];
+  written_lsns_.assign(index_manager_.num_tablets(), 0);
 }
 
 tcp::socket Client::Connect(const std::string& coord_addr) {
@@ -47,29 +51,324 @@ tcp::socket Client::Connect(const std::string& coord_addr) {
 }
 
 Client::Buffer* Client::RequestAndWait(const char* key, size_t key_len,
-    const char* val, size_t val_len, Request::Type type) {
-  assert(key_len + val_len <= kMaxItemSize);
+    const char* val, size_t val_len, Request::Type type, uint32_t ttl,
+    const ServerInfo* server) {
+  assert(key_len <= kMaxItemSize && val_len <= kMaxValueSize);
   // 0. compute key hash
   auto hash = Hash(key, key_len);
   
   // 1. get tablet and server info
-  //auto& tablet = index_manager_.GetTablet(hash);
-  auto& server = index_manager_.GetServer(hash);
-  // 2. post ib send and recv
-  auto sb = send_bufs_.Alloc();
-  assert(sb != nullptr);
-  auto r = Request::New(sb, type, key, key_len, val, val_len, hash);
-  auto rb = recv_bufs_.Alloc();
-  assert(rb != nullptr);
-  ib_.PostReceive(qp_, rb);
-  ib_.PostSendAndWait(qp_, sb, r->Len(), &server.ib_addr);
-  Request::Del(r);
-  send_bufs_.Free(sb);
-  assert(rb == ib_.Receive(qp_));
+  auto& tablet = index_manager_.GetTablet(hash);
+  if (server == nullptr) {
+    server = &index_manager_.GetServer(tablet.server_id);
+  }
+  Buffer* rb;
+  if (sizeof(Request) + key_len + val_len > kMaxUDMessageSize) {
+    std::vector<char> req(sizeof(Request) + key_len + val_len);
+    Request::New(req.data(), type, key, key_len, val, val_len, hash, ttl);
+    rb = PushRequest(req, hash, *server);
+  } else {
+    // 2. post ib send and recv
+    auto sb = send_bufs_.Alloc();
+    assert(sb != nullptr);
+    auto r = Request::New(sb, type, key, key_len, val, val_len, hash, ttl);
+    rb = recv_bufs_.Alloc();
+    assert(rb != nullptr);
+    ib_.PostReceive(qp_, rb);
+    ib_.PostSendAndWait(qp_, sb, r->Len(), &server->ib_addr);
+    Request::Del(r);
+    send_bufs_.Free(sb);
+    assert(rb == ib_.Receive(qp_));
+  }
+  if (type != Request::Type::GET) {
+    Written(tablet.id, rb->MakeResponse()->lsn);
+  }
   return rb;
-  //std::string ans(resp->val, resp->val_len);
-  //recv_bufs_.Free(rb);
-  //return ans;
+}
+
+std::string Client::Gets(const char* key, size_t key_len, uint32_t* version) {
+  uint64_t lsn;
+  if (read_from_backups_) {
+    // Replicas of the tablet are taken in turn
+    auto& tablet = index_manager_.GetTablet(Hash(key, key_len));
+    auto i = num_gets_++ % (1 + tablet.backups.size());
+    if (i > 0) {
+      auto& backup = index_manager_.GetTablet(tablet.backups[i - 1]);
+      auto ans = GetFrom(&index_manager_.GetServer(backup.server_id),
+                         key, key_len, version, &lsn);
+      if (lsn >= written_lsns_[tablet.id]) {
+        return ans;
+      }
+    }
+  }
+  return GetFrom(nullptr, key, key_len, version, &lsn);
+}
+
+std::string Client::GetFrom(const ServerInfo* server, const char* key,
+                            size_t key_len, uint32_t* version, uint64_t* lsn) {
+  if (server == nullptr) {
+    server = &index_manager_.GetServer(Hash(key, key_len));
+  }
+  auto rb = RequestAndWait(key, key_len, nullptr, 0, Request::Type::GET,
+                           0, server);
+  auto resp = rb->MakeResponse();
+  if (resp->type == Request::Type::FRAG_READ) {
+    // The value does not fit into one message
+    return PullValue(rb, *server, version, lsn);
+  }
+  std::string ans {resp->val, resp->val_len};
+  if (version != nullptr) {
+    *version = resp->status == Status::OK ? resp->version : 0;
+  }
+  *lsn = resp->lsn;
+  recv_bufs_.Free(rb);
+  return ans;
+}
+
+/*
+ * Keys are grouped by tablet, and modifications also by the worker of the
+ * tablet that serves their key; each group is packed into as few batches
+ * as the message size allows. A batch is served by one worker in one
+ * pass, with modifications synced to backups once. All batches of a round
+ * are in flight at the same time; requests left unanswered by a batch
+ * (values that do not fit into the response), or modifications responded
+ * Status::RETRY as they are of another worker of the tablet, are sent
+ * again in the next round.
+ */
+void Client::MultiRequestAndWait(Request::Type type,
+                                 const std::vector<std::string>& keys,
+                                 const std::vector<std::string>* vals,
+                                 const ResponseHandler& handle) {
+  std::vector<KeyHash> hashes(keys.size());
+  // A batch is dispatched to the worker of its first key
+  using Group = std::pair<TabletId, uint32_t>;
+  auto group_of = [this, type, &hashes](size_t i) -> Group {
+    return {index_manager_.GetTabletId(hashes[i]),
+            type == Request::Type::MGET ? 0 :
+                hashes[i] % index_manager_.num_workers_per_tablet()};
+  };
+  std::map<Group, std::vector<size_t>> pending;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto val_len = vals ? (*vals)[i].size() : 0;
+    if (sizeof(BatchRequest) + sizeof(Request) + keys[i].size() + val_len >
+        kMaxUDMessageSize) {
+      // Only a PUT could be too long to fit into a batch
+      assert(type == Request::Type::MPUT);
+      auto rb = RequestAndWait(keys[i].c_str(), keys[i].size(),
+          (*vals)[i].c_str(), val_len, Request::Type::PUT);
+      handle(i, rb->MakeResponse());
+      recv_bufs_.Free(rb);
+      continue;
+    }
+    hashes[i] = Hash(keys[i].c_str(), keys[i].size());
+    pending[group_of(i)].push_back(i);
+  }
+
+  struct Batch {
+    const ServerInfo* server;
+    std::vector<size_t> keys;
+  };
+  std::vector<Batch> batches;
+  while (!pending.empty()) {
+    // 1. pack and send batches of this round
+    batches.clear();
+    for (auto it = pending.begin();
+         it != pending.end() && batches.size() < kMaxIBQueueDepth;) {
+      auto& group = it->second;
+      auto& server = index_manager_.GetServer(hashes[group[0]]);
+      auto sb = send_bufs_.Alloc();
+      assert(sb != nullptr);
+      auto br = BatchRequest::New(sb, type, batches.size());
+      size_t n = 0;
+      for (; n < group.size(); ++n) {
+        auto i = group[n];
+        auto val = vals ? (*vals)[i].c_str() : nullptr;
+        auto val_len = vals ? (*vals)[i].size() : 0;
+        if (br->Append(keys[i].c_str(), keys[i].size(),
+                       val, val_len, hashes[i]) == nullptr) {
+          break;
+        }
+      }
+      assert(n > 0);
+      batches.push_back({&server, {group.begin(), group.begin() + n}});
+      group.erase(group.begin(), group.begin() + n);
+      if (group.empty()) {
+        it = pending.erase(it);
+      }
+
+      auto rb = recv_bufs_.Alloc();
+      assert(rb != nullptr);
+      ib_.PostReceive(qp_, rb);
+      ib_.PostSend(qp_, sb, br->Len(), &server.ib_addr);
+      ++num_send_;
+    }
+    WaitForSends(batches.size());
+
+    // 2. wait for responses, in any order
+    for (size_t k = 0; k < batches.size(); ++k) {
+      auto rb = ib_.Receive(qp_);
+      auto resp = rb->MakeBatchResponse();
+      assert(resp->type == type && resp->id < batches.size());
+      const auto& batch = batches[resp->id];
+      std::vector<size_t> left;
+      auto r = resp->First();
+      for (uint16_t i = 0; i < resp->num; ++i, r = resp->Next(r)) {
+        if (r->status == Status::RETRY) {
+          left.push_back(batch.keys[i]);
+          continue;
+        }
+        handle(batch.keys[i], r);
+        if (type != Request::Type::MGET) {
+          Written(index_manager_.GetTabletId(hashes[batch.keys[i]]), r->lsn);
+        }
+      }
+      left.insert(left.end(), batch.keys.begin() + resp->num,
+                  batch.keys.end());
+      if (!left.empty()) {
+        auto& group = pending[group_of(batch.keys[0])];
+        group.insert(group.end(), left.begin(), left.end());
+      }
+      recv_bufs_.Free(rb);
+    }
+  }
+}
+
+void Client::WaitForSends(size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    Buffer* sb;
+    while ((sb = ib_.TrySend(qp_)) == nullptr) {}
+    send_bufs_.Free(sb);
+  }
+}
+
+/*
+ * Fragments are sent in windows of `kMaxFragmentsInFlight`, each fragment
+ * is responded, so that the receive queue of the server is not overrun.
+ */
+Client::Buffer* Client::PushRequest(const std::vector<char>& req,
+                                    KeyHash key_hash,
+                                    const ServerInfo& server) {
+  auto id = num_transfers_++;
+  Buffer* ans = nullptr;
+  for (uint32_t offset = 0; offset < req.size() && ans == nullptr;) {
+    size_t n = 0;
+    for (; n < kMaxFragmentsInFlight && offset < req.size(); ++n) {
+      uint32_t len = std::min(kMaxFragmentLen,
+                              static_cast<uint32_t>(req.size()) - offset);
+      auto rb = recv_bufs_.Alloc();
+      assert(rb != nullptr);
+      ib_.PostReceive(qp_, rb);
+      auto sb = send_bufs_.Alloc();
+      assert(sb != nullptr);
+      auto f = Fragment::New(sb, Request::Type::FRAG_WRITE, key_hash, id,
+                             req.size(), offset, req.data() + offset, len);
+      ib_.PostSend(qp_, sb, f->Len(), &server.ib_addr);
+      ++num_send_;
+      offset += len;
+    }
+    WaitForSends(n);
+
+    // The response to the request, or the first failed fragment
+    for (size_t i = 0; i < n; ++i) {
+      auto rb = ib_.Receive(qp_);
+      auto resp = rb->MakeResponse();
+      if (ans == nullptr && (resp->type != Request::Type::FRAG_WRITE ||
+                             resp->status != Status::OK)) {
+        ans = rb;
+      } else {
+        recv_bufs_.Free(rb);
+      }
+    }
+  }
+  assert(ans != nullptr);
+  return ans;
+}
+
+std::string Client::PullValue(Buffer* rb, const ServerInfo& server,
+                              uint32_t* version, uint64_t* lsn) {
+  auto first = rb->MakeFragment();
+  auto key_hash = first->key_hash;
+  auto id = first->id;
+  std::vector<char> resp(first->total);
+  uint32_t offset = std::min(static_cast<uint32_t>(first->len), first->total);
+  memcpy(resp.data(), first->data, offset);
+  recv_bufs_.Free(rb);
+
+  bool failed = resp.size() < sizeof(Response);
+  while (offset < resp.size() && !failed) {
+    size_t n = 0;
+    for (; n < kMaxFragmentsInFlight && offset < resp.size(); ++n) {
+      uint32_t len = std::min(kMaxFragmentLen,
+                              static_cast<uint32_t>(resp.size()) - offset);
+      auto rb = recv_bufs_.Alloc();
+      assert(rb != nullptr);
+      ib_.PostReceive(qp_, rb);
+      auto sb = send_bufs_.Alloc();
+      assert(sb != nullptr);
+      // It asks for `len` bytes, without payload
+      Fragment::New(sb, Request::Type::FRAG_READ, key_hash, id,
+                    resp.size(), offset, nullptr, len);
+      ib_.PostSend(qp_, sb, sizeof(Fragment), &server.ib_addr);
+      ++num_send_;
+      offset += len;
+    }
+    WaitForSends(n);
+
+    // Fragments may arrive in any order
+    for (size_t i = 0; i < n; ++i) {
+      auto rb = ib_.Receive(qp_);
+      auto f = rb->MakeFragment();
+      if (f->len == 0 || f->offset + f->len > resp.size()) {
+        // The server has given up the transfer
+        failed = true;
+      } else {
+        memcpy(resp.data() + f->offset, f->data, f->len);
+      }
+      recv_bufs_.Free(rb);
+    }
+  }
+
+  auto r = reinterpret_cast<const Response*>(resp.data());
+  if (failed || r->status != Status::OK ||
+      sizeof(Response) + r->val_len != resp.size()) {
+    if (version != nullptr) {
+      *version = 0;
+    }
+    // Taken as stale
+    *lsn = 0;
+    return "";
+  }
+  if (version != nullptr) {
+    *version = r->version;
+  }
+  *lsn = r->lsn;
+  return std::string(r->val, r->val_len);
+}
+
+bool Client::Incr(const std::string& key, uint64_t delta,
+                  uint64_t* val, Request::Type type) {
+  auto rb = RequestAndWait(key.c_str(), key.size(),
+      reinterpret_cast<const char*>(&delta), sizeof(delta), type);
+  auto resp = rb->MakeResponse();
+  bool ans = resp->status == Status::OK;
+  if (ans && val != nullptr) {
+    *val = std::stoull(std::string(resp->val, resp->val_len));
+  }
+  recv_bufs_.Free(rb);
+  return ans;
+}
+
+bool Client::Cas(const std::string& key, const std::string& val,
+                 uint32_t version) {
+  // The expected version is followed by the new value
+  std::string operand(reinterpret_cast<const char*>(&version),
+                      sizeof(version));
+  operand += val;
+  auto rb = RequestAndWait(key.c_str(), key.size(),
+      operand.c_str(), operand.size(), Request::Type::CAS);
+  bool ans = rb->MakeResponse()->status == Status::OK;
+  recv_bufs_.Free(rb);
+  return ans;
 }
 
 } // namespace nvds
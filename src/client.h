@@ -8,6 +8,10 @@
 #include "response.h"
 #include "session.h"
 
+#include <algorithm>
+#include <functional>
+#include <vector>
+
 namespace nvds {
 
 class Client {
@@ -23,20 +27,27 @@ class Client {
     return Get(key.c_str(), key.size());
   }
   std::string Get(const char* key, size_t key_len) {
-    auto rb = RequestAndWait(key, key_len, nullptr, 0, Request::Type::GET);
-    auto resp = rb->MakeResponse();
-    std::string ans {resp->val, resp->val_len};
-    recv_bufs_.Free(rb);
-    return ans;
+    return Gets(key, key_len, nullptr);
   }
 
+  // Get value and its version by the key, for a later `Cas`.
+  // The version is 0 if error occurs.
+  // Throw: TransportException
+  std::string Gets(const std::string& key, uint32_t* version) {
+    return Gets(key.c_str(), key.size(), version);
+  }
+  std::string Gets(const char* key, size_t key_len, uint32_t* version);
+
   // Insert key/value pair to the cluster, return if operation succeed.
+  // The item expires after `ttl` seconds, if `ttl` is not 0.
   // Throw: TransportException
-  bool Put(const std::string& key, const std::string& val) {
-    return Put(key.c_str(), key.size(), val.c_str(), val.size());
+  bool Put(const std::string& key, const std::string& val, uint32_t ttl=0) {
+    return Put(key.c_str(), key.size(), val.c_str(), val.size(), ttl);
   }
-  bool Put(const char* key, size_t key_len, const char* val, size_t val_len) {
-    auto rb = RequestAndWait(key, key_len, val, val_len, Request::Type::PUT);
+  bool Put(const char* key, size_t key_len,
+           const char* val, size_t val_len, uint32_t ttl=0) {
+    auto rb = RequestAndWait(key, key_len, val, val_len,
+                             Request::Type::PUT, ttl);
     bool ans = rb->MakeResponse()->status == Status::OK;
     recv_bufs_.Free(rb);
     return ans;
@@ -44,12 +55,15 @@ class Client {
 
   // Add key/value pair to the cluster,
   // return false if there is already the same key;
+  // The item expires after `ttl` seconds, if `ttl` is not 0.
   // Throw: TransportException
-  bool Add(const std::string& key, const std::string& val) {
-    return Add(key.c_str(), key.size(), val.c_str(), val.size());
+  bool Add(const std::string& key, const std::string& val, uint32_t ttl=0) {
+    return Add(key.c_str(), key.size(), val.c_str(), val.size(), ttl);
   }
-  bool Add(const char* key, size_t key_len, const char* val, size_t val_len) {
-    auto rb = RequestAndWait(key, key_len, val, val_len, Request::Type::ADD);
+  bool Add(const char* key, size_t key_len,
+           const char* val, size_t val_len, uint32_t ttl=0) {
+    auto rb = RequestAndWait(key, key_len, val, val_len,
+                             Request::Type::ADD, ttl);
     // FIXME(wgtdkp): what about Status::NO_MEM?
     bool ans = rb->MakeResponse()->status == Status::OK;
     recv_bufs_.Free(rb);
@@ -68,19 +82,130 @@ class Client {
     return ans;
   }
 
+  // Add `delta` to the value, which is a decimal number, atomically.
+  // A key not found is taken as value 0. The new value is returned by
+  // `val`, if it is not nullptr. Return if operation succeed.
+  // Throw: TransportException
+  bool Incr(const std::string& key, uint64_t delta, uint64_t* val=nullptr) {
+    return Incr(key, delta, val, Request::Type::INCR);
+  }
+  // Like `Incr`, but the value does not go below 0.
+  // Throw: TransportException
+  bool Decr(const std::string& key, uint64_t delta, uint64_t* val=nullptr) {
+    return Incr(key, delta, val, Request::Type::DECR);
+  }
+
+  // Replace the value, only if it is not modified since `Gets`
+  // returned `version`. Return if operation succeed.
+  // Throw: TransportException
+  bool Cas(const std::string& key, const std::string& val, uint32_t version);
+
+  // Append to the value atomically, a key not found
+  // is taken as an empty value. Return if operation succeed.
+  // Throw: TransportException
+  bool Append(const std::string& key, const std::string& val) {
+    auto rb = RequestAndWait(key.c_str(), key.size(), val.c_str(), val.size(),
+                             Request::Type::APPEND);
+    bool ans = rb->MakeResponse()->status == Status::OK;
+    recv_bufs_.Free(rb);
+    return ans;
+  }
+
+  // Get values of the keys, in batches of requests to each tablet.
+  // The value is empty string if the key is not found.
+  // Throw: TransportException
+  std::vector<std::string> MultiGet(const std::vector<std::string>& keys) {
+    std::vector<std::string> vals(keys.size());
+    std::vector<size_t> large;
+    MultiRequestAndWait(Request::Type::MGET, keys, nullptr,
+        [&vals, &large](size_t i, const Response* resp) {
+          if (resp->status == Status::TOO_LARGE) {
+            large.push_back(i);
+          } else {
+            vals[i].assign(resp->val, resp->val_len);
+          }
+        });
+    for (auto i : large) {
+      vals[i] = Get(keys[i]);
+    }
+    return vals;
+  }
+
+  // Insert key/value pairs in batches of requests to each tablet,
+  // return if each operation succeed.
+  // Throw: TransportException
+  std::vector<bool> MultiPut(const std::vector<std::string>& keys,
+                             const std::vector<std::string>& vals) {
+    assert(keys.size() == vals.size());
+    std::vector<bool> ans(keys.size());
+    MultiRequestAndWait(Request::Type::MPUT, keys, &vals,
+        [&ans](size_t i, const Response* resp) {
+          ans[i] = resp->status == Status::OK;
+        });
+    return ans;
+  }
+
+  // Delete items in batches of requests to each tablet,
+  // return if each operation succeed.
+  // Throw: TransportException
+  std::vector<bool> MultiDel(const std::vector<std::string>& keys) {
+    std::vector<bool> ans(keys.size());
+    MultiRequestAndWait(Request::Type::MDEL, keys, nullptr,
+        [&ans](size_t i, const Response* resp) {
+          ans[i] = resp->status == Status::OK;
+        });
+    return ans;
+  }
+
+  // GETs are spread over the master and backups of a tablet, instead of
+  // the master only. A backup serves a GET only if it has applied the
+  // writes made by this client, otherwise the GET is sent to the master.
+  // MGETs are always sent to the master.
+  void set_read_from_backups(bool read_from_backups) {
+    read_from_backups_ = read_from_backups;
+  }
+
   // Statistic
   size_t num_send() const { return num_send_; }
 
  private:
   static const uint32_t kMaxIBQueueDepth = 128;
   static const uint32_t kSendBufSize = 1024 * 2 + 128;
-  static const uint32_t kRecvBufSize = 1024 + 128;
+  static const uint32_t kRecvBufSize = 1024 * 2 + 128;
+  // Fragments of a long message sent before waiting for responses
+  static const uint32_t kMaxFragmentsInFlight = 32;
   // May throw exception `boost::system::system_error`
   tcp::socket Connect(const std::string& coord_addr);
   void Close() {}
   void Join();
+  // The request is sent to `server`, or the master of the key if it is
+  // nullptr.
   Buffer* RequestAndWait(const char* key, size_t key_len,
-      const char* val, size_t val_len, Request::Type type);
+      const char* val, size_t val_len, Request::Type type, uint32_t ttl=0,
+      const ServerInfo* server=nullptr);
+  // GET from `server`, `lsn` is set to the log position of the response.
+  std::string GetFrom(const ServerInfo* server, const char* key,
+                      size_t key_len, uint32_t* version, uint64_t* lsn);
+  // Writes of this client to the tablet are committed before `lsn`.
+  void Written(TabletId id, uint64_t lsn) {
+    written_lsns_[id] = std::max(written_lsns_[id], lsn);
+  }
+  // Called with index of the key and its response
+  using ResponseHandler = std::function<void(size_t, const Response*)>;
+  void MultiRequestAndWait(Request::Type type,
+                           const std::vector<std::string>& keys,
+                           const std::vector<std::string>* vals,
+                           const ResponseHandler& handle);
+  // Push the long request by fragments, return buffer of the response.
+  Buffer* PushRequest(const std::vector<char>& req, KeyHash key_hash,
+                      const ServerInfo& server);
+  // Pull the rest of the response from `server`,
+  // of which `rb` is the first fragment.
+  std::string PullValue(Buffer* rb, const ServerInfo& server,
+                        uint32_t* version, uint64_t* lsn);
+  bool Incr(const std::string& key, uint64_t delta,
+            uint64_t* val, Request::Type type);
+  void WaitForSends(size_t n);
 
   boost::asio::io_service tcp_service_;
   Session session_;
@@ -92,6 +217,15 @@ class Client {
   Infiniband::RegisteredBuffers recv_bufs_;
   Infiniband::QueuePair* qp_;
 
+  // Id of the next long message
+  uint32_t num_transfers_ {0};
+
+  bool read_from_backups_ {false};
+  // GETs sent, replicas are taken in turn
+  uint64_t num_gets_ {0};
+  // Log positions of the last writes to master tablets, indexed by id
+  std::vector<uint64_t> written_lsns_;
+
   // Statistic 
   size_t num_send_ {0};
 };
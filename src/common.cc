@@ -1,11 +1,147 @@
 #include "common.h"
 
+#include "json.hpp"
+
 #include <boost/asio.hpp>
 #include <cstdarg>
 #include <cxxabi.h>
+#include <fstream>
 
 namespace nvds {
 
+Config config;
+
+// Enums are represented by names in json
+template<typename Enum, size_t N>
+static void EnumFromJson(const nlohmann::json& j, Enum& e,
+                         const char* const (&names)[N]) {
+  std::string name = j;
+  for (size_t i = 0; i < N; ++i) {
+    if (name == names[i]) {
+      e = static_cast<Enum>(i);
+      return;
+    }
+  }
+  throw std::invalid_argument("unknown name: " + name);
+}
+
+static const char* const kTopologyNames[] = {"fan-out", "chain", "tree"};
+static const char* const kDurabilityNames[] = {"all", "one", "local"};
+
+void to_json(nlohmann::json& j, const Topology& t) {
+  j = kTopologyNames[static_cast<uint8_t>(t)];
+}
+
+void from_json(const nlohmann::json& j, Topology& t) {
+  EnumFromJson(j, t, kTopologyNames);
+}
+
+void to_json(nlohmann::json& j, const Durability& d) {
+  j = kDurabilityNames[static_cast<uint8_t>(d)];
+}
+
+void from_json(const nlohmann::json& j, Durability& d) {
+  EnumFromJson(j, d, kDurabilityNames);
+}
+
+void to_json(nlohmann::json& j, const Config& c) {
+  j = {
+    {"num_replicas", c.num_replicas},
+    {"num_servers", c.num_servers},
+    {"num_tablets_per_server", c.num_tablets_per_server},
+    {"num_workers_per_tablet", c.num_workers_per_tablet},
+    {"tablet_size", c.tablet_size},
+    {"topology", c.topology},
+    {"tablet_topologies", c.tablet_topologies},
+    {"durability", c.durability},
+    {"tablet_durabilities", c.tablet_durabilities},
+    {"max_replication_lag", c.max_replication_lag}
+  };
+}
+
+void from_json(const nlohmann::json& j, Config& c) {
+  auto load = [&j](const char* name, uint32_t& val) {
+    auto it = j.find(name);
+    if (it != j.end()) {
+      val = *it;
+    }
+  };
+  load("num_replicas", c.num_replicas);
+  load("num_servers", c.num_servers);
+  load("num_tablets_per_server", c.num_tablets_per_server);
+  load("num_workers_per_tablet", c.num_workers_per_tablet);
+  load("tablet_size", c.tablet_size);
+  load("max_replication_lag", c.max_replication_lag);
+  auto it = j.find("topology");
+  if (it != j.end()) {
+    c.topology = *it;
+  }
+  it = j.find("tablet_topologies");
+  if (it != j.end()) {
+    c.tablet_topologies = it->get<std::vector<Topology>>();
+  }
+  it = j.find("durability");
+  if (it != j.end()) {
+    c.durability = *it;
+  }
+  it = j.find("tablet_durabilities");
+  if (it != j.end()) {
+    c.tablet_durabilities = it->get<std::vector<Durability>>();
+  }
+}
+
+bool Config::Load(const std::string& path, std::string* err) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    *err = "cannot open config file: " + path;
+    return false;
+  }
+  try {
+    from_json(nlohmann::json::parse(ifs), *this);
+  } catch (std::exception& e) {
+    *err = "invalid config file: " + path + ": " + e.what();
+    return false;
+  }
+  *err = Validate();
+  return err->empty();
+}
+
+std::string Config::Validate() const {
+  if (num_replicas == 0 || num_servers == 0 ||
+      num_tablets_per_server == 0 || num_workers_per_tablet == 0) {
+    return "the number of replicas, servers, tablets and workers must be positive";
+  }
+  if (tablet_size == 0 || tablet_size % (1024 * 1024) != 0 ||
+      tablet_size > kMaxTabletSize) {
+    return Format("tablet_size must be a multiple of 1MB, and no more "
+                  "than %" PRIu32 "MB", kMaxTabletSize / 1024 / 1024);
+  }
+  // Records that are not replicated are kept by the ring
+  if (max_replication_lag >= kLogSize) {
+    return Format("max_replication_lag must be less than %" PRIu32
+                  " bytes, the size of the log", kLogSize);
+  }
+  if (tablet_topologies.size() > num_tablets() ||
+      tablet_durabilities.size() > num_tablets()) {
+    return "there are more tablet_topologies or tablet_durabilities "
+           "than tablets";
+  }
+  return "";
+}
+
+bool Config::operator==(const Config& other) const {
+  return num_replicas == other.num_replicas &&
+         num_servers == other.num_servers &&
+         num_tablets_per_server == other.num_tablets_per_server &&
+         num_workers_per_tablet == other.num_workers_per_tablet &&
+         tablet_size == other.tablet_size &&
+         topology == other.topology &&
+         tablet_topologies == other.tablet_topologies &&
+         durability == other.durability &&
+         tablet_durabilities == other.tablet_durabilities &&
+         max_replication_lag == other.max_replication_lag;
+}
+
 static std::string VFormat(const char* format, va_list ap);
 
 /// A safe version of sprintf.
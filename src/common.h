@@ -41,24 +41,174 @@ using TabletId = uint32_t;
 /*
  * Cluster configuration
  */
-// Configurable
-static const uint32_t kNumReplicas = 1;
-static const uint32_t kNumServers = 2;
-static const uint32_t kNumTabletsPerServer = 1;
+// How log records of a tablet flow from its master to its backups.
+// Replicas of a tablet are numbered 0 for the master, and `i + 1` for
+// its backup `i`; a replica writes records to those it is the parent
+// of, and acknowledgements flow back the same way.
+enum class Topology : uint8_t {
+  // The master writes to every backup
+  FAN_OUT,
+  // Each replica writes to the next one
+  CHAIN,
+  // Replica `r` writes to replicas `2r + 1` and `2r + 2`
+  TREE,
+};
+// When the response to a write of a tablet is sent
+enum class Durability : uint8_t {
+  // Once its record is replicated to all backups
+  ALL,
+  // Once its record is replicated to one backup at least
+  ONE,
+  // Once its record is committed locally, as long as records that are
+  // not replicated to all backups are `Config::max_replication_lag`
+  // bytes at most; it waits for replication beyond that
+  LOCAL,
+};
+// Replicas a replica writes to in a tree, at most
+static const uint32_t kTreeFanOut = 2;
+
+// Return the replica that replica `r` > 0 receives records from.
+inline uint32_t GetParentReplica(Topology topology, uint32_t r) {
+  switch (topology) {
+  case Topology::CHAIN:
+    return r - 1;
+  case Topology::TREE:
+    return (r - 1) / kTreeFanOut;
+  default:
+    return 0;
+  }
+}
+// Return the replicas that replica `r` writes records to, in order, of
+// `num_replicas` backups and the master (replica 0).
+inline std::vector<uint32_t> GetChildReplicas(Topology topology,
+                                              uint32_t num_replicas,
+                                              uint32_t r) {
+  std::vector<uint32_t> children;
+  for (uint32_t c = 1; c <= num_replicas; ++c) {
+    if (GetParentReplica(topology, c) == r) {
+      children.push_back(c);
+    }
+  }
+  return children;
+}
+// Return the index of replica `r` > 0 among the children of its parent.
+inline uint32_t GetReplicaSlot(Topology topology, uint32_t r) {
+  uint32_t slot = 0;
+  for (uint32_t c = 1; c < r; ++c) {
+    if (GetParentReplica(topology, c) == GetParentReplica(topology, r)) {
+      ++slot;
+    }
+  }
+  return slot;
+}
+
+// The shape of the cluster and size of tablets, loaded at startup from
+// a json config file by the coordinator and servers, which must load
+// the same one. Clients take the shape from the index.
+struct Config {
+  uint32_t num_replicas = 1;
+  uint32_t num_servers = 2;
+  uint32_t num_tablets_per_server = 1;
+  // GETs to a tablet are served by all its workers concurrently
+  uint32_t num_workers_per_tablet = 2;
+  // Bytes of the arena of a tablet, a multiple of 1MB
+  uint32_t tablet_size = 64 * 1024 * 1024;
+  // Topology of tablets, unless overridden by `tablet_topologies`
+  Topology topology = Topology::FAN_OUT;
+  // Topology of tablet `i` in the order of key ranges, for the first ones
+  std::vector<Topology> tablet_topologies;
+  // Durability of tablets, unless overridden by `tablet_durabilities`
+  Durability durability = Durability::ALL;
+  std::vector<Durability> tablet_durabilities;
+  // Bytes of the log, see `Durability::LOCAL`
+  uint32_t max_replication_lag = 1024 * 1024;
+
+  Topology GetTopology(uint32_t tablet) const {
+    return tablet < tablet_topologies.size() ? tablet_topologies[tablet]
+                                             : topology;
+  }
+  Durability GetDurability(uint32_t tablet) const {
+    return tablet < tablet_durabilities.size() ? tablet_durabilities[tablet]
+                                               : durability;
+  }
+
+  uint32_t num_tablet_and_backups_per_server() const {
+    return num_tablets_per_server * (1 + num_replicas);
+  }
+  uint32_t num_tablets() const {
+    return num_tablets_per_server * num_servers;
+  }
+  uint32_t num_tablet_and_backups() const {
+    return num_tablet_and_backups_per_server() * num_servers;
+  }
+  // Load the parameters in the file, those absent keep their values.
+  // Return false, with `err` set, if it is not loaded or not valid.
+  bool Load(const std::string& path, std::string* err);
+  // Return the reason if it is not valid, or an empty string.
+  std::string Validate() const;
+  bool operator==(const Config& other) const;
+  bool operator!=(const Config& other) const { return !(*this == other); }
+};
+// Offsets into a tablet, including its index, log and undo logs, are 32 bits;
+// the index takes half the size of the arena. Hash table slots, chunk links
+// and log entries hold such offsets, a server with more memory takes more
+// tablets instead.
+static const uint32_t kMaxTabletSize = 2560 * 1024U * 1024;
+// Configuration of this process
+extern Config config;
+
+// A full tablet evicts cold items for new ones, instead of responding
+// Status::NO_MEM, so that the cluster serves as a cache.
+#ifndef NVDS_CACHE_MODE
+#define NVDS_CACHE_MODE false
+#endif
+static const bool kCacheMode = NVDS_CACHE_MODE;
+// Engine of the allocator that tablets are formatted with, see
+// `Allocator::Engine`: 0, free lists in NVM; 1, slabs, which write a
+// single word of NVM metadata for each allocation and free; 2, free
+// lists in DRAM, of which only block headers are persistent; 3, a log of
+// segments, each allocation is appended to the head as one contiguous
+// write, and sparse segments are cleaned by the compaction.
+static const uint32_t kAllocatorEngine = 0;
+// Requests queued for a worker are served as a group of at most this
+// many, whose modifications are committed by one log record and whose
+// responses are sent after one completion from each backup; 1 syncs
+// each request on its own.
+static const uint32_t kMaxGroupCommitSize = 16;
+// Backups are sent compact records of operations, the key, value and
+// version that each leaves, instead of the bytes written by the master;
+// a backup stores them into its own tablet in the background. It moves
+// less data, as allocator and index writes are not replicated.
+static const bool kOpLogReplication = false;
+// A backup that stores operations would evict by its own access bits and
+// arena, not those of the master, which sends only its evictions.
+static_assert(!(kOpLogReplication && kCacheMode),
+              "operation records are not replicated by a cache");
+// A batch of records written to a backup is followed by an RDMA read of
+// its end, on the same queue pair, which is responded only after the
+// writes are placed in the backup's memory; records are taken as
+// replicated once the read completes, instead of once the backup's NIC
+// receives them. Persistence on power loss also needs the backup's
+// memory to be in the persistence domain of the platform, e.g. with
+// DDIO off. It costs one read per batch, and reads in flight to a
+// backup are limited by the queue pair.
+static const bool kRemoteFlush = false;
 
 static const uint16_t kCoordPort = 9090;
 static const uint32_t kMaxItemSize = 1024;
-static const uint32_t kNumTabletAndBackupsPerServer = kNumTabletsPerServer * (1 + kNumReplicas);
-static const uint32_t kNumTablets = kNumTabletsPerServer * kNumServers;
-static const uint32_t kNumTabletAndBackups = kNumTabletAndBackupsPerServer * kNumServers;
-static_assert(kNumTablets % kNumServers == 0,
-              "`kNumTablets` cannot be divisible by `kNumServers`");
+// Values longer than `kMaxItemSize` are stored in chunks
+static const uint32_t kMaxValueSize = 8 * 1024 * 1024;
+// Bytes of the ring of a tablet's log, large enough for the records of
+// two requests of the largest value
+static const uint32_t kLogSize = 2 * kMaxValueSize + 1024 * 1024;
 
 /*
  * Infiniband configuration
  */
-static const uint32_t kSendBufSize = 1024 + 128;
-static const uint32_t kRecvBufSize = 1024 * 2 + 128;
+// Max length of a UD message, bounded by the path MTU
+static const uint32_t kMaxUDMessageSize = 1024 * 2;
+static const uint32_t kSendBufSize = kMaxUDMessageSize + 128;
+static const uint32_t kRecvBufSize = kMaxUDMessageSize + 128;
 static const uint32_t kIBUDPadding = 40;
 
 std::string Format(const char* format, ...);
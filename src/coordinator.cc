@@ -9,7 +9,7 @@ namespace nvds {
 using nlohmann::json;
 
 Coordinator::Coordinator()
-    : BasicServer(kCoordPort) {
+    : BasicServer(kCoordPort), index_manager_(config) {
 }
 
 void Coordinator::Run() {
@@ -66,28 +66,45 @@ void Coordinator::HandleServerRequestJoin(std::shared_ptr<Session> session,
   uint64_t nvm_size = body["size"];
 
   NVDS_LOG("join request from server: [%s]", session->GetPeerAddr().c_str());
-  if (num_servers_ >= kNumServers) {
+  if (num_servers_ >= config.num_servers) {
     NVDS_LOG("too much servers, ignored");
     return;
   }
+  // Tablets of the server are arranged by its config
+  Config server_config = config;
+  if (body.count("config") != 0) {
+    server_config = body["config"];
+  }
+  if (server_config != config) {
+    NVDS_LOG("config of the server differs, rejected");
+    json msg_body {
+      {"error", "config differs from the coordinator's: " +
+                json(config).dump()}
+    };
+    session->AsyncSendMessage(std::make_shared<Message>(
+        Message::Header {Message::SenderType::COORDINATOR,
+                         Message::Type::ACK_REJECT},
+        msg_body.dump()));
+    return;
+  }
 
   index_manager_.AddServer(session->GetPeerAddr(), body);
   sessions_.emplace_back(session);
   ++num_servers_;
   total_storage_ += nvm_size;
 
-  assert(num_servers_ <= kNumServers);
-  if (num_servers_ == kNumServers) {
+  assert(num_servers_ <= config.num_servers);
+  if (num_servers_ == config.num_servers) {
     NVDS_LOG("all servers' join request received. [total servers = %d]",
-             kNumServers);
+             config.num_servers);
     ResponseAllJoins();
   } else {
-    NVDS_LOG("[%d/%d] join requests received", num_servers_, kNumServers);
+    NVDS_LOG("[%d/%d] join requests received", num_servers_, config.num_servers);
   }
 }
 
 void Coordinator::ResponseAllJoins() {
-  assert(sessions_.size() == kNumServers);
+  assert(sessions_.size() == config.num_servers);
   for (size_t i = 0; i < sessions_.size(); ++i) {
     json msg_body {
       {"id", i},
@@ -123,7 +140,7 @@ void Coordinator::HandleMessageFromClient(std::shared_ptr<Session> session,
 void Coordinator::HandleClientRequestJoin(std::shared_ptr<Session> session,
                                           std::shared_ptr<Message> msg) {
   // TODO(wgtdkp): handle this error!
-  assert(num_servers_ == kNumServers);
+  assert(num_servers_ == config.num_servers);
   assert(msg->sender_type() == Message::SenderType::CLIENT);
   assert(msg->type() == Message::Type::REQ_JOIN);
   NVDS_LOG("join request from client: [%s]", session->GetPeerAddr().c_str());
@@ -8,12 +8,10 @@
 
 using namespace nvds;
 
-/*
 static void Usage(int argc, const char* argv[]) {
   std::cout << "Usage:" << std::endl
-            << "    " << argv[0] << " <config_file>" << std::endl;
+            << "    " << argv[0] << " [config file]" << std::endl;
 }
-*/
 
 static std::string GetLocalAddr() {
   using boost::asio::ip::tcp;
@@ -31,11 +29,16 @@ static std::string GetLocalAddr() {
 }
 
 int main(int argc, const char* argv[]) {
-  // -1. Argument parsing
-  //if (argc < 2) {
-  //  Usage(argc, argv);
-  //  return -1;
-  //}
+  // -1. Argument parsing, the default config is taken without the file
+  if (argc > 2) {
+    Usage(argc, argv);
+    return -1;
+  }
+  std::string err;
+  if (argc > 1 && !config.Load(argv[1], &err)) {
+    NVDS_ERR(err.c_str());
+    return -1;
+  }
 
   // 1. Self initialization
   Coordinator coordinator;
@@ -43,6 +46,10 @@ int main(int argc, const char* argv[]) {
   // 2. Listening for joining request from nodes and request from clients
   NVDS_LOG("Coordinator at: %s", GetLocalAddr().c_str());
   NVDS_LOG("Listening at: %u", kCoordPort);
+  NVDS_LOG("Cluster of %" PRIu32 " servers, %" PRIu32 " tablets of %" PRIu32
+           "MB each, %" PRIu32 " replicas", config.num_servers,
+           config.num_tablets(), config.tablet_size / 1024 / 1024,
+           config.num_replicas);
   NVDS_LOG("......");
 
   coordinator.Run();
@@ -0,0 +1,299 @@
+#include "hash_table.h"
+
+#include <emmintrin.h>
+
+namespace nvds {
+
+HashTable::HashTable(Allocator& allocator, uint32_t table,
+                     uint32_t max_num_buckets)
+    : allocator_(allocator), table_(table), max_num_buckets_(max_num_buckets),
+      versions_(new std::atomic<uint32_t>[max_num_buckets]) {
+  for (uint32_t i = 0; i < max_num_buckets_; ++i) {
+    versions_[i] = 0;
+  }
+}
+
+void HashTable::Format() {
+  memset(allocator_.OffsetToPtr<char>(table_), 0,
+         offsetof(NVMHashTable, buckets) +
+         sizeof(NVMBucket) * NVMHashTable::kMinNumBuckets);
+  state_ = 0;
+  num_items_ = 0;
+}
+
+void HashTable::Recover() {
+  Reload();
+  Scan(0, num_buckets(), [](uint32_t) {}, [](uint32_t) {});
+}
+
+void HashTable::Reload() {
+  Refresh();
+  auto level = GetLevel(state_);
+  auto split = GetSplit(state_);
+
+  // The bucket split (or merged) the last time may contain
+  // entries that belong to its image.
+  if (split > 0) {
+    Cleanup(split - 1, NVMHashTable::kMinNumBuckets << level);
+  } else if (level > 0) {
+    auto bit = NVMHashTable::kMinNumBuckets << (level - 1);
+    Cleanup(bit - 1, bit);
+  }
+  num_items_ = 0;
+}
+
+uint32_t HashTable::LockBucket(KeyHash key_hash) {
+  while (true) {
+    auto idx = GetBucketIdx(key_hash);
+    LockBucketIdx(idx);
+    // Resizing cannot move the key once its bucket is held
+    if (GetBucketIdx(key_hash) == idx) {
+      return idx;
+    }
+    UnlockBucket(idx);
+  }
+}
+
+uint32_t HashTable::MatchTags(uint32_t bucket, uint16_t tag) const {
+  auto tags = allocator_.OffsetToPtr<const __m128i>(
+      bucket + offsetof(NVMBucket, tags));
+  auto eq = _mm_cmpeq_epi16(_mm_loadu_si128(tags), _mm_set1_epi16(tag));
+  // Each 16-bit lane produces 2 bits, keep the lower one.
+  return static_cast<uint32_t>(_mm_movemask_epi8(eq)) & 0x5555;
+}
+
+bool HashTable::MatchKey(uint32_t obj, KeyHash key_hash,
+                         const char* key, uint16_t key_len) {
+  // `key_hash` and `key_len` share the same cache line, compare them first.
+  return allocator_.Read<KeyHash>(OFFSETOF_NVMOBJECT(obj, key_hash)) == key_hash &&
+         allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(obj, key_len)) == key_len &&
+         allocator_.Memcmp(OFFSETOF_NVMOBJECT(obj, data), key, key_len) == 0;
+}
+
+HashTable::Cursor HashTable::Find(KeyHash key_hash,
+                                  const char* key, uint16_t key_len) {
+  auto tag = GetTag(key_hash);
+  for (auto b = GetBucket(GetBucketIdx(key_hash)); b != 0; b = GetOverflow(b)) {
+    auto mask = MatchTags(b, tag);
+    while (mask != 0) {
+      uint32_t i = __builtin_ctz(mask) / 2;
+      mask &= mask - 1;
+      auto obj = allocator_.Read<uint32_t>(SlotOffset(b, i));
+      if (MatchKey(obj, key_hash, key, key_len)) {
+        return {obj, SlotOffset(b, i), TagOffset(b, i)};
+      }
+    }
+  }
+  return {0, 0, 0};
+}
+
+uint32_t HashTable::FindOptimistic(uint32_t idx, uint32_t version,
+                                   KeyHash key_hash,
+                                   const char* key, uint16_t key_len) {
+  auto tag = GetTag(key_hash);
+  auto b = GetBucket(idx);
+  while (true) {
+    auto mask = MatchTags(b, tag);
+    while (mask != 0) {
+      uint32_t i = __builtin_ctz(mask) / 2;
+      mask &= mask - 1;
+      auto obj = allocator_.Read<uint32_t>(SlotOffset(b, i));
+      // A concurrent writer may leave garbage in a freed slot
+      if (obj != 0 && obj < allocator_.size() - sizeof(NVMObject) &&
+          MatchKey(obj, key_hash, key, key_len)) {
+        return obj;
+      }
+    }
+    b = GetOverflow(b);
+    // Stop following an overflow chain modified concurrently
+    if (b == 0 || b >= allocator_.size() || !Validate(idx, version)) {
+      return 0;
+    }
+  }
+}
+
+bool HashTable::Insert(KeyHash key_hash, uint32_t obj) {
+  if (!Append(GetBucket(GetBucketIdx(key_hash)), GetTag(key_hash), obj)) {
+    return false;
+  }
+  num_items_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void HashTable::Erase(const Cursor& c) {
+  assert(c.obj != 0);
+  allocator_.Write(c.tag, static_cast<uint16_t>(0));
+  num_items_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HashTable::Resize() {
+  std::unique_lock<Spinlock> lock(resize_lock_, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+  for (uint32_t i = 0; i < kMaxResizeSteps; ++i) {
+    if (num_items_ > kMaxLoad * num_buckets()) {
+      if (!Split()) {
+        break;
+      }
+    } else if (num_items_ < kMinLoad * num_buckets()) {
+      if (!Merge()) {
+        break;
+      }
+    } else {
+      break;
+    }
+  }
+}
+
+bool HashTable::Append(uint32_t bucket, uint16_t tag, uint32_t obj) {
+  uint32_t last = bucket;
+  for (auto b = bucket; b != 0; b = GetOverflow(b)) {
+    auto empty = MatchTags(b, 0);
+    if (empty != 0) {
+      uint32_t i = __builtin_ctz(empty) / 2;
+      allocator_.Write(SlotOffset(b, i), obj);
+      // Writing the tag makes the slot visible
+      allocator_.Write(TagOffset(b, i), tag);
+      return true;
+    }
+    last = b;
+  }
+
+  // All slots are occupied, chain a new overflow bucket
+  auto overflow = allocator_.Alloc(sizeof(NVMBucket));
+  if (overflow == 0) {
+    return false;
+  }
+  ClearBucket(overflow);
+  allocator_.Write(SlotOffset(overflow, 0), obj);
+  allocator_.Write(TagOffset(overflow, 0), tag);
+  // Linking the bucket makes it visible
+  allocator_.Write(last + offsetof(NVMBucket, overflow), overflow);
+  return true;
+}
+
+void HashTable::ClearBucket(uint32_t bucket) {
+  static const char zeros[sizeof(NVMBucket)] = {0};
+  allocator_.Memcpy(bucket, zeros, sizeof(NVMBucket));
+}
+
+void HashTable::WriteState(uint32_t level, uint32_t split) {
+  auto state = PackState(level, split);
+  allocator_.Write(table_ + offsetof(NVMHashTable, state), state);
+  state_.store(state, std::memory_order_release);
+}
+
+void HashTable::Cleanup(uint32_t idx, uint32_t bit) {
+  for (auto b = GetBucket(idx); b != 0; b = GetOverflow(b)) {
+    auto occupied = ~MatchTags(b, 0) & 0x5555;
+    while (occupied != 0) {
+      uint32_t i = __builtin_ctz(occupied) / 2;
+      occupied &= occupied - 1;
+      auto obj = allocator_.Read<uint32_t>(SlotOffset(b, i));
+      if (allocator_.Read<KeyHash>(OFFSETOF_NVMOBJECT(obj, key_hash)) & bit) {
+        allocator_.Write(TagOffset(b, i), static_cast<uint16_t>(0));
+      }
+    }
+  }
+}
+
+void HashTable::FreeOverflow(uint32_t bucket) {
+  auto b = GetOverflow(bucket);
+  while (b != 0) {
+    auto next = GetOverflow(b);
+    allocator_.Free(b);
+    b = next;
+  }
+}
+
+/*
+ * Split the next bucket into itself and its image. Entries are copied
+ * to the image before the commit point, and erased from the original
+ * bucket after that. A crash in between leaves stale entries in the
+ * original bucket, which are harmless to lookups and erased by `Recover`.
+ * Both buckets are held until the split is done.
+ */
+bool HashTable::Split() {
+  if (num_buckets() >= max_num_buckets_) {
+    return false;
+  }
+  auto level = GetLevel(state_);
+  uint32_t bit = NVMHashTable::kMinNumBuckets << level;
+  auto idx = GetSplit(state_);
+  LockBucketIdx(idx);
+  LockBucketIdx(idx + bit);
+  auto image = GetBucket(idx + bit);
+  ClearBucket(image);
+  for (auto b = GetBucket(idx); b != 0; b = GetOverflow(b)) {
+    auto occupied = ~MatchTags(b, 0) & 0x5555;
+    while (occupied != 0) {
+      uint32_t i = __builtin_ctz(occupied) / 2;
+      occupied &= occupied - 1;
+      auto obj = allocator_.Read<uint32_t>(SlotOffset(b, i));
+      if ((allocator_.Read<KeyHash>(OFFSETOF_NVMOBJECT(obj, key_hash)) & bit) &&
+          !Append(image, allocator_.Read<uint16_t>(TagOffset(b, i)), obj)) {
+        FreeOverflow(image);
+        UnlockBucket(idx + bit);
+        UnlockBucket(idx);
+        return false;
+      }
+    }
+  }
+
+  if (idx + 1 == bit) {
+    WriteState(level + 1, 0);
+  } else {
+    WriteState(level, idx + 1);
+  }
+  Cleanup(idx, bit);
+  UnlockBucket(idx + bit);
+  UnlockBucket(idx);
+  return true;
+}
+
+/*
+ * Merge the last split bucket with its image. Entries of the image are
+ * copied to the bucket before the commit point. A crash before that leaves
+ * stale entries in the bucket, which are erased by `Recover`.
+ * Both buckets are held until the merge is done.
+ */
+bool HashTable::Merge() {
+  if (num_buckets() <= NVMHashTable::kMinNumBuckets) {
+    return false;
+  }
+  auto level = GetLevel(state_);
+  auto split = GetSplit(state_);
+  if (split == 0) {
+    --level;
+    split = NVMHashTable::kMinNumBuckets << level;
+  }
+  --split;
+  uint32_t bit = NVMHashTable::kMinNumBuckets << level;
+  LockBucketIdx(split);
+  LockBucketIdx(split + bit);
+  auto bucket = GetBucket(split);
+  auto image = GetBucket(split + bit);
+  for (auto b = image; b != 0; b = GetOverflow(b)) {
+    auto occupied = ~MatchTags(b, 0) & 0x5555;
+    while (occupied != 0) {
+      uint32_t i = __builtin_ctz(occupied) / 2;
+      occupied &= occupied - 1;
+      if (!Append(bucket, allocator_.Read<uint16_t>(TagOffset(b, i)),
+                  allocator_.Read<uint32_t>(SlotOffset(b, i)))) {
+        Cleanup(split, bit);
+        UnlockBucket(split + bit);
+        UnlockBucket(split);
+        return false;
+      }
+    }
+  }
+
+  WriteState(level, split);
+  FreeOverflow(image);
+  UnlockBucket(split + bit);
+  UnlockBucket(split);
+  return true;
+}
+
+} // namespace nvds
@@ -0,0 +1,328 @@
+/*
+ * Hash index of a tablet.
+ *
+ * Each bucket occupies exactly one cache line and holds `kNumSlots`
+ * (fingerprint, offset) pairs. A lookup compares the 16-bit fingerprints
+ * of all slots with a single SIMD compare, and only touches the objects
+ * whose fingerprint matches. When all slots of a bucket are occupied,
+ * an overflow bucket allocated in the arena is chained to it.
+ *
+ * The table grows and shrinks online by linear hashing: a single bucket
+ * is split (or merged) at a time, as part of the operations that insert
+ * (or erase) items. The progress of resizing is persisted as one word,
+ * which is the commit point of each split and merge.
+ * Reference: https://en.wikipedia.org/wiki/Linear_hashing
+ *
+ * Readers never take locks. Each bucket (with its overflow buckets) has
+ * a version counter in DRAM, which is odd while a writer holds the bucket.
+ * A reader validates that the version of its bucket, and the bucket the
+ * key maps to, did not change during the lookup; otherwise, it retries.
+ */
+
+#ifndef _NVDS_HASH_TABLE_H_
+#define _NVDS_HASH_TABLE_H_
+
+#include "allocator.h"
+#include "common.h"
+#include "hash.h"
+#include "spinlock.h"
+
+#include <atomic>
+#include <memory>
+
+namespace nvds {
+
+#define OFFSETOF_NVMOBJECT(obj, member) \
+    offsetof(NVMObject, member) + obj
+
+struct NVMObject {
+  // The first chunk of a value longer than `kMaxItemSize`,
+  // see `NVMChunk`. Not used by the index.
+  uint32_t next;
+  uint16_t key_len;
+  uint16_t val_len;
+  KeyHash key_hash;
+  // Bumped by each modification of the object, see `Tablet::Cas`.
+  // Not used by the index.
+  uint32_t version;
+  // Expiration time in seconds since epoch, 0 if it never expires.
+  // Not used by the index.
+  uint32_t expire;
+  char data[0];
+};
+
+struct alignas(64) NVMBucket {
+  static const uint32_t kNumSlots = 8;
+  // Fingerprints of the keys, 0 denotes an empty slot.
+  uint16_t tags[kNumSlots];
+  // Offsets to the objects, relative to the allocator base.
+  uint32_t slots[kNumSlots];
+  // Offset to the overflow bucket, 0 if there is none.
+  uint32_t overflow;
+  uint32_t reserved[3];
+  NVMBucket() = delete;
+};
+static_assert(sizeof(NVMBucket) == 64, "a bucket must fill a cache line");
+
+struct NVMHashTable {
+  static const uint32_t kMinNumBuckets = 1 << 12;
+  // Buckets of a table of the default size, see `HashTable`
+  static const uint32_t kMaxNumBuckets = 1 << 19;
+  // `level` in high 32 bits and `split` in low 32 bits, so that the
+  // resizing progress is updated by a single 8-byte store.
+  // There are `(kMinNumBuckets << level) + split` buckets in use.
+  uint64_t state;
+  NVMBucket buckets[kMaxNumBuckets];
+  NVMHashTable() = delete;
+};
+
+class HashTable {
+ public:
+  // Where an indexed object is referenced from.
+  struct Cursor {
+    // Offset to the object; 0, if the key is not found.
+    uint32_t obj;
+    // Offset to the slot that points to `obj`.
+    uint32_t ref;
+    // Offset to the tag of the slot.
+    uint32_t tag;
+  };
+
+  // Hold the bucket that a key maps to, for modifications.
+  class BucketGuard {
+   public:
+    BucketGuard(HashTable& ht, KeyHash key_hash)
+        : ht_(ht), idx_(ht.LockBucket(key_hash)) {}
+    ~BucketGuard() { ht_.UnlockBucket(idx_); }
+    DISALLOW_COPY_AND_ASSIGN(BucketGuard);
+   private:
+    HashTable& ht_;
+    uint32_t idx_;
+  };
+
+  // `table` is the offset to the `NVMHashTable`,
+  // relative to the allocator base, which holds `max_num_buckets`
+  // buckets at most.
+  HashTable(Allocator& allocator, uint32_t table,
+            uint32_t max_num_buckets=NVMHashTable::kMaxNumBuckets);
+  ~HashTable() {}
+  DISALLOW_COPY_AND_ASSIGN(HashTable);
+
+  uint32_t num_buckets() const { return GetNumBuckets(state_); }
+  uint32_t num_items() const { return num_items_; }
+
+  void Format();
+  // Finish the split or merge interrupted by a crash.
+  void Recover();
+  // `Recover` without counting the items, which are counted by `Scan`.
+  void Reload();
+  // Load the resizing progress written to the table by others, i.e. the
+  // log redone by a backup tablet.
+  void Refresh() {
+    state_ = allocator_.Read<uint64_t>(table_ + offsetof(NVMHashTable, state));
+  }
+  // Call `visit_obj` with each object in the chains of buckets
+  // [begin, end), and `visit_overflow` with each overflow bucket. Items
+  // visited are counted. Buckets are not held, it is called after
+  // `Reload` on disjoint ranges concurrently.
+  template<typename ObjectVisitor, typename OverflowVisitor>
+  void Scan(uint32_t begin, uint32_t end,
+            ObjectVisitor visit_obj, OverflowVisitor visit_overflow);
+  // Lock free lookup. `visit` is called with the object found, and
+  // called again if the lookup is retried. Return if the key is found.
+  template<typename Visitor>
+  bool Lookup(KeyHash key_hash, const char* key, uint16_t key_len,
+              Visitor visit);
+  // The bucket must be held by a `BucketGuard`.
+  Cursor Find(KeyHash key_hash, const char* key, uint16_t key_len);
+  // Index the object `obj`, the key must not be in the table.
+  // The bucket must be held by a `BucketGuard`.
+  // Return false if there is no space for an overflow bucket.
+  bool Insert(KeyHash key_hash, uint32_t obj);
+  // Make the reference found by `c` point to `obj`.
+  void Replace(const Cursor& c, uint32_t obj) {
+    allocator_.Write(c.ref, obj);
+  }
+  // Unlink the object found by `c`, the object is not freed.
+  void Erase(const Cursor& c);
+  // Call `visit` with the cursor of each entry in the chain of bucket
+  // `idx`, holding the bucket. Entries could be erased by `visit`. Return
+  // false, without waiting, if the bucket is held or not in use.
+  template<typename Visitor>
+  bool VisitBucket(uint32_t idx, Visitor visit);
+  // Split or merge a few buckets if the load is out of range. It must not
+  // be called when holding a bucket. It returns immediately if another
+  // thread is resizing the table.
+  void Resize();
+
+ private:
+  // Buckets split (merged) by one call to `Resize` at most
+  static const uint32_t kMaxResizeSteps = 2;
+  // Average number of items per bucket that triggers splitting
+  static const uint32_t kMaxLoad = 6;
+  // Average number of items per bucket that triggers merging
+  static const uint32_t kMinLoad = 2;
+
+  static uint16_t GetTag(KeyHash key_hash) {
+    uint16_t tag = key_hash >> 48;
+    return tag == 0 ? 1 : tag;
+  }
+  static uint64_t PackState(uint32_t level, uint32_t split) {
+    return static_cast<uint64_t>(level) << 32 | split;
+  }
+  static uint32_t GetLevel(uint64_t state) { return state >> 32; }
+  static uint32_t GetSplit(uint64_t state) { return state & 0xffffffff; }
+  static uint32_t GetNumBuckets(uint64_t state) {
+    return (NVMHashTable::kMinNumBuckets << GetLevel(state)) + GetSplit(state);
+  }
+  static uint32_t GetBucketIdx(KeyHash key_hash, uint64_t state) {
+    auto level = GetLevel(state);
+    uint32_t idx = key_hash & ((NVMHashTable::kMinNumBuckets << level) - 1);
+    if (idx < GetSplit(state)) {
+      idx = key_hash & ((NVMHashTable::kMinNumBuckets << (level + 1)) - 1);
+    }
+    return idx;
+  }
+  uint32_t GetBucketIdx(KeyHash key_hash) const {
+    return GetBucketIdx(key_hash, state_);
+  }
+  uint32_t GetBucket(uint32_t idx) const {
+    return table_ + offsetof(NVMHashTable, buckets) + sizeof(NVMBucket) * idx;
+  }
+  static uint32_t SlotOffset(uint32_t bucket, uint32_t i) {
+    return bucket + offsetof(NVMBucket, slots) + sizeof(uint32_t) * i;
+  }
+  static uint32_t TagOffset(uint32_t bucket, uint32_t i) {
+    return bucket + offsetof(NVMBucket, tags) + sizeof(uint16_t) * i;
+  }
+  uint32_t GetOverflow(uint32_t bucket) {
+    return allocator_.Read<uint32_t>(bucket + offsetof(NVMBucket, overflow));
+  }
+  // The caller should not hold any bucket. Return index of the bucket.
+  uint32_t LockBucket(KeyHash key_hash);
+  void LockBucketIdx(uint32_t idx) {
+    auto& version = versions_[idx];
+    while (true) {
+      auto v = version.load(std::memory_order_relaxed);
+      if ((v & 1) == 0 && version.compare_exchange_weak(v, v + 1,
+                              std::memory_order_acquire)) {
+        break;
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  bool TryLockBucketIdx(uint32_t idx) {
+    auto& version = versions_[idx];
+    auto v = version.load(std::memory_order_relaxed);
+    if ((v & 1) != 0 || !version.compare_exchange_strong(v, v + 1,
+                             std::memory_order_acquire)) {
+      return false;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    return true;
+  }
+  void UnlockBucket(uint32_t idx) {
+    versions_[idx].fetch_add(1, std::memory_order_release);
+  }
+  // Wait until the bucket is not held, return the version.
+  uint32_t BeginRead(uint32_t idx) const {
+    uint32_t v;
+    while ((v = versions_[idx].load(std::memory_order_acquire)) & 1) {}
+    return v;
+  }
+  bool Validate(uint32_t idx, uint32_t version) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return versions_[idx].load(std::memory_order_relaxed) == version;
+  }
+  // Find without holding the bucket, the result must be validated.
+  uint32_t FindOptimistic(uint32_t idx, uint32_t version, KeyHash key_hash,
+                          const char* key, uint16_t key_len);
+  // Bit `2 * i` of the returned mask is set if tag of slot `i` equals `tag`.
+  uint32_t MatchTags(uint32_t bucket, uint16_t tag) const;
+  bool MatchKey(uint32_t obj, KeyHash key_hash,
+                const char* key, uint16_t key_len);
+  // Put the entry into an empty slot of the bucket chain,
+  // overflow bucket is allocated if necessary.
+  bool Append(uint32_t bucket, uint16_t tag, uint32_t obj);
+  void ClearBucket(uint32_t bucket);
+  void WriteState(uint32_t level, uint32_t split);
+  // Erase entries in the chain of bucket `idx` whose key hash has `bit` set,
+  // they have been moved to the split image of bucket `idx`.
+  void Cleanup(uint32_t idx, uint32_t bit);
+  void FreeOverflow(uint32_t bucket);
+  bool Split();
+  bool Merge();
+
+  Allocator& allocator_;
+  uint32_t table_;
+  uint32_t max_num_buckets_;
+  // DRAM copy of the persistent state
+  std::atomic<uint64_t> state_ {0};
+  // Rebuilt by scanning the table after restart
+  std::atomic<uint32_t> num_items_ {0};
+  // Version counters of the buckets, indexed by bucket index
+  std::unique_ptr<std::atomic<uint32_t>[]> versions_;
+  Spinlock resize_lock_;
+};
+
+template<typename Visitor>
+bool HashTable::Lookup(KeyHash key_hash, const char* key, uint16_t key_len,
+                       Visitor visit) {
+  while (true) {
+    auto idx = GetBucketIdx(key_hash);
+    auto version = BeginRead(idx);
+    auto obj = FindOptimistic(idx, version, key_hash, key, key_len);
+    if (obj != 0) {
+      visit(obj);
+    }
+    // The key may have been moved to another bucket by resizing
+    if (Validate(idx, version) && GetBucketIdx(key_hash) == idx) {
+      return obj != 0;
+    }
+  }
+}
+
+template<typename Visitor>
+bool HashTable::VisitBucket(uint32_t idx, Visitor visit) {
+  if (!TryLockBucketIdx(idx)) {
+    return false;
+  }
+  // A merged image is not in use, though its entries are left
+  bool in_use = idx < num_buckets();
+  for (auto b = GetBucket(idx); in_use && b != 0; b = GetOverflow(b)) {
+    auto occupied = ~MatchTags(b, 0) & 0x5555;
+    while (occupied != 0) {
+      uint32_t i = __builtin_ctz(occupied) / 2;
+      occupied &= occupied - 1;
+      visit(Cursor {allocator_.Read<uint32_t>(SlotOffset(b, i)),
+                    SlotOffset(b, i), TagOffset(b, i)});
+    }
+  }
+  UnlockBucket(idx);
+  return in_use;
+}
+
+template<typename ObjectVisitor, typename OverflowVisitor>
+void HashTable::Scan(uint32_t begin, uint32_t end,
+                     ObjectVisitor visit_obj, OverflowVisitor visit_overflow) {
+  uint32_t num_items = 0;
+  for (uint32_t idx = begin; idx < end; ++idx) {
+    for (auto b = GetBucket(idx); b != 0; b = GetOverflow(b)) {
+      if (b != GetBucket(idx)) {
+        visit_overflow(b);
+      }
+      auto occupied = ~MatchTags(b, 0) & 0x5555;
+      while (occupied != 0) {
+        uint32_t i = __builtin_ctz(occupied) / 2;
+        occupied &= occupied - 1;
+        visit_obj(allocator_.Read<uint32_t>(SlotOffset(b, i)));
+        ++num_items;
+      }
+    }
+  }
+  num_items_ += num_items;
+}
+
+} // namespace nvds
+
+#endif // _NVDS_HASH_TABLE_H_
@@ -2,34 +2,50 @@
 
 namespace nvds {
 
+IndexManager::IndexManager(const Config& config)
+    : config_(config), key_tablet_map_(config.num_tablets()),
+      tablets_(config.num_tablet_and_backups()),
+      servers_(config.num_servers) {
+}
+
 const ServerInfo& IndexManager::AddServer(const std::string& addr,
                                           nlohmann::json& msg_body) {
   auto id = AllocServerId();
   Infiniband::Address ib_addr = msg_body["ib_addr"];
-  servers_[id] = {id, true, addr, ib_addr};
+  servers_[id] = {id, true, addr, ib_addr,
+      std::vector<TabletId>(config_.num_tablet_and_backups_per_server())};
   std::vector<Infiniband::QueuePairInfo> qpis = msg_body["tablet_qpis"];
   
   auto i = id;
-  for (uint32_t j = 0; j < kNumReplicas + 1; ++j) {
-    for (uint32_t k = 0; k < kNumTabletsPerServer; ++k) {
+  auto num_replicas = config_.num_replicas;
+  auto num_servers = config_.num_servers;
+  for (uint32_t j = 0; j < num_replicas + 1; ++j) {
+    for (uint32_t k = 0; k < config_.num_tablets_per_server; ++k) {
       auto tablet_id = CalcTabletId(i, j, k);
       auto tablet_idx = CalcTabletId(0, j, k);
       tablets_[tablet_id].id = tablet_id;
       tablets_[tablet_id].server_id = i;
       tablets_[tablet_id].is_backup = j > 0;
 
-      copy(qpis.begin() + tablet_idx * kNumReplicas,
-           qpis.begin() + (tablet_idx + 1) * kNumReplicas,
-           tablets_[tablet_id].qpis.begin());
+      tablets_[tablet_id].qpis.assign(
+          qpis.begin() + tablet_idx * num_replicas,
+          qpis.begin() + (tablet_idx + 1) * num_replicas);
 
       if (!tablets_[tablet_id].is_backup) {
         auto idx = CalcTabletId(0, i, k);
         key_tablet_map_[idx] = tablet_id;
+        tablets_[tablet_id].topology = config_.GetTopology(idx);
+        tablets_[tablet_id].durability = config_.GetDurability(idx);
       } else {
         auto backup_id = tablet_id;
-        auto master_id = CalcTabletId((kNumServers + i - j) % kNumServers, 0, k);
+        auto master_server = (num_servers + i - j) % num_servers;
+        auto master_id = CalcTabletId(master_server, 0, k);
+        auto idx = CalcTabletId(0, master_server, k);
+        tablets_[tablet_id].topology = config_.GetTopology(idx);
+        tablets_[tablet_id].durability = config_.GetDurability(idx);
         // It is tricky here
         assert(backup_id != 0);
+        tablets_[master_id].backups.resize(num_replicas);
         tablets_[master_id].backups[j-1] = backup_id;
         tablets_[backup_id].master = master_id;
       }
@@ -22,6 +22,8 @@ class IndexManager {
 
  public:
   IndexManager() {}
+  // Tablets of the cluster of the shape, to which servers are added
+  explicit IndexManager(const Config& config);
   ~IndexManager() {}
 
   const ServerInfo& AddServer(const std::string& addr,
@@ -52,6 +54,13 @@ class IndexManager {
   const TabletInfo& GetTablet(TabletId id) const {
     return tablets_[id];
   }
+  // Masters and backups
+  uint32_t num_tablets() const { return tablets_.size(); }
+  // Modifications of a key are served by worker
+  // `key_hash % num_workers_per_tablet()` of its tablet.
+  uint32_t num_workers_per_tablet() const {
+    return config_.num_workers_per_tablet;
+  }
 
   // DEBUG
   void PrintTablets() const;
@@ -63,13 +72,16 @@ class IndexManager {
   }
 
   // `r_idx`: replication index; `s_idx`: server index; `t_idx`: tablet index;
-  static uint32_t CalcTabletId(uint32_t s_idx, uint32_t r_idx, uint32_t t_idx) {
-    return s_idx * kNumTabletAndBackupsPerServer + r_idx * kNumTabletsPerServer + t_idx;
+  uint32_t CalcTabletId(uint32_t s_idx, uint32_t r_idx, uint32_t t_idx) const {
+    return s_idx * config_.num_tablet_and_backups_per_server() +
+           r_idx * config_.num_tablets_per_server + t_idx;
   }
 
-  std::array<TabletId, kNumTablets> key_tablet_map_;
-  std::array<TabletInfo, kNumTabletAndBackups> tablets_;
-  std::array<ServerInfo, kNumServers> servers_;
+  // Shape of the cluster, known by the coordinator only
+  Config config_;
+  std::vector<TabletId> key_tablet_map_;
+  std::vector<TabletInfo> tablets_;
+  std::vector<ServerInfo> servers_;
 };
 
 } // namespace nvds
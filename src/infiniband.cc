@@ -13,6 +13,11 @@ Infiniband::Infiniband(uint32_t registered_mem_size)
   ctx_ = ibv_open_device(dev_list[0]);
   assert(ctx_ != nullptr);
   ibv_free_device_list(dev_list);
+  // Limits of reads in flight of the queue pairs
+  int err = ibv_query_device(ctx_, &device_attr_);
+  if (err != 0) {
+    throw TransportException(HERE, "ibv_query_device failed", err);
+  }
 
   pd_ = ibv_alloc_pd(ctx_);
   assert(pd_ != nullptr);
@@ -82,6 +87,7 @@ Infiniband::QueuePair::QueuePair(Infiniband& ib, ibv_qp_type type,
   if (qp == nullptr) {
     throw TransportException(HERE, "create queue pair failed", errno);
   }
+  max_inline_data = init_attr.cap.max_inline_data;
 
   ibv_qp_attr attr;
   attr.qp_state = IBV_QPS_INIT;
@@ -160,7 +166,8 @@ void Infiniband::QueuePair::SetStateRTR(const QueuePairInfo& peer_info) {
   attr.path_mtu           = IBV_MTU_4096;
   attr.dest_qp_num        = peer_info.qpn;
   attr.rq_psn             = peer_info.psn;
-  attr.max_dest_rd_atomic = 1;
+  // Reads of the peer in flight, e.g. those that flush records written
+  attr.max_dest_rd_atomic = ib.device_attr().max_qp_rd_atom;
   attr.min_rnr_timer      = 12;
   attr.ah_attr.is_global  = 0;
   attr.ah_attr.dlid       = peer_info.lid;
@@ -191,7 +198,7 @@ void Infiniband::QueuePair::SetStateRTS(const QueuePairInfo& peer_info) {
   attr.retry_cnt  = 7;
   attr.rnr_retry  = 7;
   attr.sq_psn     = psn;
-  attr.max_rd_atomic = 1;
+  attr.max_rd_atomic = ib.device_attr().max_qp_init_rd_atom;
 
   int modify = IBV_QP_STATE            |
                IBV_QP_TIMEOUT          |
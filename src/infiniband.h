@@ -14,6 +14,9 @@ namespace nvds {
 
 struct Request;
 struct Response;
+struct BatchRequest;
+struct BatchResponse;
+struct Fragment;
 
 // Derived from RAMCloud Infiniband.h
 class Infiniband {
@@ -47,6 +50,8 @@ class Infiniband {
     ibv_cq*       scq;
     ibv_cq*       rcq;
     uint32_t      psn;
+    // Granted by the device, which may be more than `kMaxInlineData`
+    uint32_t      max_inline_data;
 
     QueuePair(Infiniband& ib, ibv_qp_type type, 
               uint32_t max_send, uint32_t max_recv);
@@ -96,6 +101,15 @@ class Infiniband {
     Response* MakeResponse() {
       // TODO(wgtdkp): are you sure ?
       return reinterpret_cast<Response*>(buf + kIBUDPadding);
+    }
+    BatchRequest* MakeBatchRequest() {
+      return reinterpret_cast<BatchRequest*>(buf + kIBUDPadding);
+    }
+    BatchResponse* MakeBatchResponse() {
+      return reinterpret_cast<BatchResponse*>(buf + kIBUDPadding);
+    }
+    Fragment* MakeFragment() {
+      return reinterpret_cast<Fragment*>(buf + kIBUDPadding);
     }
 	};
 
@@ -151,9 +165,11 @@ class Infiniband {
   ibv_mr* mr() { return mr_; }
   char* raw_mem() { return raw_mem_; }
   uint32_t raw_mem_size() { return raw_mem_size_; }
+  const ibv_device_attr& device_attr() const { return device_attr_; }
 
  private:
   ibv_context* ctx_;
+  ibv_device_attr device_attr_;
   ibv_pd* pd_;
   ibv_mr* mr_;
   char* raw_mem_;
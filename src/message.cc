@@ -58,6 +58,8 @@ void to_json(nlohmann::json& j, const TabletInfo& ti) {
   j["id"] = ti.id;
   j["server_id"] = ti.server_id;
   j["is_backup"] = ti.is_backup;
+  j["topology"] = ti.topology;
+  j["durability"] = ti.durability;
   j["qpis"] = ti.qpis;
   if (ti.is_backup) {
     j["master"] = ti.master;
@@ -70,11 +72,13 @@ void from_json(const nlohmann::json& j, TabletInfo& ti) {
   ti.id = j["id"];
   ti.server_id = j["server_id"];
   ti.is_backup = j["is_backup"];
-  ti.qpis = j["qpis"];
+  ti.topology = j["topology"];
+  ti.durability = j["durability"];
+  ti.qpis = j["qpis"].get<std::vector<Infiniband::QueuePairInfo>>();
   if (ti.is_backup) {
     ti.master = j["master"];
   } else {
-    ti.backups = j["backups"];
+    ti.backups = j["backups"].get<std::vector<TabletId>>();
   }
 }
 
@@ -94,7 +98,7 @@ void from_json(const nlohmann::json& j, ServerInfo& si) {
     j["active"],
     j["addr"],
     j["ib_addr"],
-    j["tablets"]
+    j["tablets"].get<std::vector<TabletId>>()
   };
 }
 
@@ -102,14 +106,16 @@ void to_json(nlohmann::json& j, const IndexManager& im) {
   j = {
     {"key_tablet_map", im.key_tablet_map_},
     {"tablets", im.tablets_},
-    {"servers", im.servers_}
+    {"servers", im.servers_},
+    {"num_workers_per_tablet", im.config_.num_workers_per_tablet}
   };
 }
 
 void from_json(const nlohmann::json& j, IndexManager& im) {
-  im.key_tablet_map_ = j["key_tablet_map"];
-  im.tablets_ = j["tablets"];
-  im.servers_ = j["servers"];
+  im.key_tablet_map_ = j["key_tablet_map"].get<std::vector<TabletId>>();
+  im.tablets_ = j["tablets"].get<std::vector<TabletInfo>>();
+  im.servers_ = j["servers"].get<std::vector<ServerInfo>>();
+  im.config_.num_workers_per_tablet = j["num_workers_per_tablet"];
 }
 
 } // namespace nvds
@@ -53,14 +53,16 @@ struct TabletInfo {
   TabletId id;
   ServerId server_id;
   bool is_backup;
-  std::array<Infiniband::QueuePairInfo, kNumReplicas> qpis;
-  union {
-    // If `is_backup` == true,
-    // `master` is the master tablet of this backup tablet
-    TabletId master;
-    // Else, `backups` is the backups of this makster tablet
-    std::array<TabletId, kNumReplicas> backups;
-  };
+  // Of the master and its backups
+  Topology topology;
+  Durability durability;
+  // `Config::num_replicas` queue pairs
+  std::vector<Infiniband::QueuePairInfo> qpis;
+  // If `is_backup` == true,
+  // `master` is the master tablet of this backup tablet
+  TabletId master;
+  // Else, `backups` is the backups of this makster tablet
+  std::vector<TabletId> backups;
   bool operator==(const TabletInfo& other) const {
     return id == other.id &&
            server_id == other.server_id &&
@@ -91,7 +93,8 @@ struct ServerInfo {
   bool active;
   std::string addr; // Ip address
   Infiniband::Address ib_addr; // Infiniband address
-  std::array<TabletId, kNumTabletAndBackupsPerServer> tablets;
+  // Masters and backups, `Config::num_tablet_and_backups_per_server`
+  std::vector<TabletId> tablets;
 };
 
 class Message {
@@ -143,6 +146,12 @@ class Message {
   std::string body_;
 };
 
+void to_json(nlohmann::json& j, const Topology& t);
+void from_json(const nlohmann::json& j, Topology& t);
+void to_json(nlohmann::json& j, const Durability& d);
+void from_json(const nlohmann::json& j, Durability& d);
+void to_json(nlohmann::json& j, const Config& c);
+void from_json(const nlohmann::json& j, Config& c);
 void to_json(nlohmann::json& j, const Infiniband::Address& ia);
 void from_json(const nlohmann::json& j, Infiniband::Address& ia);
 void to_json(nlohmann::json& j, const Infiniband::QueuePairInfo& qpi);
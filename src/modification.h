@@ -2,6 +2,7 @@
 #define _NVDS_MODIFICATION_H_
 
 #include "common.h"
+#include "hash.h"
 
 namespace nvds {
 
@@ -25,13 +26,57 @@ struct Modification {
 };
 using ModificationList = std::vector<Modification>;
 
+// An entry of `ModificationLog`: `len` bytes written at `offset` of the
+// tablet, followed by the bytes and padded to `kAlign`.
 struct Position {
+  static const uint32_t kAlign = 8;
   uint32_t offset;
   uint32_t len;
   Position() = delete;
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+  const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+  // Length of the entry, including the header
+  static uint32_t Len(uint32_t len) {
+    return (sizeof(Position) + len + kAlign - 1) / kAlign * kAlign;
+  }
 };
 
+// An entry of an operation record, see `kOpLogReplication`: the state
+// of a key after an operation, which is stored with the value, or erased.
+// It is followed by the key and the value, and padded to `kAlign`.
+struct Operation {
+  static const uint32_t kAlign = 8;
+  enum class Type : uint8_t {
+    SET, DEL
+  };
+  Type type;
+  uint8_t reserved;
+  uint16_t key_len;
+  uint32_t val_len;
+  KeyHash key_hash;
+  uint32_t version;
+  uint32_t expire;
+  Operation() = delete;
+  const char* key() const { return reinterpret_cast<const char*>(this + 1); }
+  const char* val() const { return key() + key_len; }
+  // Length of the entry, including the header
+  static uint32_t Len(uint16_t key_len, uint32_t val_len) {
+    return (sizeof(Operation) + key_len + val_len + kAlign - 1) /
+        kAlign * kAlign;
+  }
+};
+
+// The record of modifications made by an operation. It is redone as a
+// whole, or discarded if it is not completely written. Records shipped
+// to backups by operation-log replication are of `Operation` entries.
 struct ModificationLog {
+  // Hash of the record from `pos`
+  uint64_t checksum;
+  // Position of the record in the log, which only increases
+  uint64_t pos;
+  // Length of the record, including the header
+  uint32_t len;
+  // Number of entries
   uint32_t cnt;
   Position positions[0];
   ModificationLog() = delete;
@@ -1,8 +1,14 @@
 #ifndef _NVDS_NVM_H_
 #define _NVDS_NVM_H_
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <cstdlib>
 #include <cstddef>
+#include <string>
 
 namespace nvds {
 
@@ -57,11 +63,43 @@ class NVMPtr {
 };
 
 /*
- * Get nvm with specified size
+ * Get nvm with specified size, aligned to cache line
  */
 template <typename T>
 NVMPtr<T> AcquireNVM(size_t size) {
-  return NVMPtr<T>(static_cast<T*>(malloc(size)));
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, 64, size) != 0) {
+    return NVMPtr<T>(nullptr);
+  }
+  return NVMPtr<T>(static_cast<T*>(ptr));
+}
+
+/*
+ * Map nvm with specified size from a file, e.g. a file on a DAX file
+ * system or in `/dev/shm`, or a DAX device. Data written to the mapping
+ * survives restart of the process. A file shorter than `size` is extended
+ * with zeros. Return nullptr if failed.
+ */
+template <typename T>
+NVMPtr<T> MapNVM(const std::string& path, size_t size) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return NVMPtr<T>(nullptr);
+  }
+  struct stat st;
+  // The size of a device is not reported, nor could it be changed
+  if (fstat(fd, &st) != 0 || (S_ISREG(st.st_mode) &&
+      static_cast<size_t>(st.st_size) < size && ftruncate(fd, size) != 0)) {
+    close(fd);
+    return NVMPtr<T>(nullptr);
+  }
+  auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  // The mapping keeps the file open
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return NVMPtr<T>(nullptr);
+  }
+  return NVMPtr<T>(static_cast<T*>(ptr));
 }
 
 } // namespace nvds
@@ -0,0 +1,62 @@
+#include "persist.h"
+
+#include <cpuid.h>
+
+namespace nvds {
+
+enum class FlushInstr {
+  CLFLUSH, CLFLUSHOPT, CLWB,
+};
+
+static FlushInstr DetectFlushInstr() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return FlushInstr::CLFLUSH;
+  }
+  if (ebx & (1 << 24)) {
+    return FlushInstr::CLWB;
+  }
+  if (ebx & (1 << 23)) {
+    return FlushInstr::CLFLUSHOPT;
+  }
+  return FlushInstr::CLFLUSH;
+}
+
+static const FlushInstr kFlushInstr = DetectFlushInstr();
+
+// The instructions are encoded by their prefixes, as older
+// assemblers do not know them and no `-m` flag is required.
+static inline void FlushLine(char* line) {
+  switch (kFlushInstr) {
+  case FlushInstr::CLWB:
+    // clwb
+    asm volatile(".byte 0x66; xsaveopt %0" : "+m" (*line));
+    break;
+  case FlushInstr::CLFLUSHOPT:
+    // clflushopt
+    asm volatile(".byte 0x66; clflush %0" : "+m" (*line));
+    break;
+  default:
+    asm volatile("clflush %0" : "+m" (*line));
+  }
+}
+
+void Flush(const void* addr, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  auto begin = reinterpret_cast<uintptr_t>(addr) & ~(kCacheLineSize - 1);
+  auto end = reinterpret_cast<uintptr_t>(addr) + len;
+  for (auto line = begin; line < end; line += kCacheLineSize) {
+    FlushLine(reinterpret_cast<char*>(line));
+  }
+}
+
+void Persist(const ModificationList& modifications) {
+  for (const auto& m : modifications) {
+    Flush(reinterpret_cast<const void*>(m.src), m.len);
+  }
+  Fence();
+}
+
+} // namespace nvds
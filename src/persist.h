@@ -0,0 +1,40 @@
+/*
+ * Persistence of NVM writes.
+ *
+ * Stores to NVM reach the persistence domain only after their cache lines
+ * are written back. Instead of flushing each store, the ranges written by
+ * an operation, which are tracked by its `ModificationList`, are flushed
+ * together at its commit point, followed by a single `sfence`.
+ *
+ * Cache lines are written back by `clwb` if the CPU supports it, which
+ * keeps them in cache; otherwise by `clflushopt` or `clflush`.
+ */
+
+#ifndef _NVDS_PERSIST_H_
+#define _NVDS_PERSIST_H_
+
+#include "common.h"
+#include "modification.h"
+
+namespace nvds {
+
+static const uintptr_t kCacheLineSize = 64;
+
+// Write back cache lines of the range, they are not ordered until `Fence`.
+void Flush(const void* addr, size_t len);
+
+static inline void Fence() {
+  asm volatile("sfence" ::: "memory");
+}
+
+static inline void Persist(const void* addr, size_t len) {
+  Flush(addr, len);
+  Fence();
+}
+
+// Write back the ranges of the modifications, and fence.
+void Persist(const ModificationList& modifications);
+
+} // namespace nvds
+
+#endif // _NVDS_PERSIST_H_
@@ -8,12 +8,23 @@ namespace nvds {
 
 struct Request {
   enum class Type : uint8_t {
-    PUT, ADD, GET, DEL
+    PUT, ADD, GET, DEL,
+    // Batched types, see `BatchRequest`
+    MGET, MPUT, MDEL,
+    // Fragments of long messages, see `Fragment`
+    FRAG_WRITE, FRAG_READ,
+    // Atomic read-modify-write, the operand is carried as the value:
+    // INCR/DECR: the delta, as `uint64_t`;
+    // CAS: the expected version, as `uint32_t`, followed by the new value;
+    // APPEND: the data to append.
+    INCR, DECR, CAS, APPEND,
   };
   Type type;
   uint16_t key_len;
-  uint16_t val_len;
+  uint32_t val_len;
   KeyHash key_hash;
+  // Time to live in seconds of PUT and ADD, 0 if the item never expires
+  uint32_t ttl;
   // TODO(wgtdkp):
   //uint64_t id;
   // Key data followed by value data
@@ -21,14 +32,25 @@ struct Request {
  
   static Request* New(Infiniband::Buffer* b, Type type,
                       const char* key, size_t key_len,
-                      const char* val, size_t val_len, KeyHash key_hash) {
-    return new (b->buf) Request(type, key, key_len, val, val_len, key_hash);
+                      const char* val, size_t val_len, KeyHash key_hash,
+                      uint32_t ttl=0) {
+    return New(b->buf, type, key, key_len, val, val_len, key_hash, ttl);
+  }
+  static Request* New(char* buf, Type type,
+                      const char* key, size_t key_len,
+                      const char* val, size_t val_len, KeyHash key_hash,
+                      uint32_t ttl=0) {
+    return new (buf) Request(type, key, key_len, val, val_len, key_hash, ttl);
   }
   static void Del(const Request* r) {
     // Explicitly call destructor(only when pairing with placement new)
     r->~Request();
   }
   size_t Len() const { return sizeof(Request) + key_len + val_len; }
+  bool IsBatch() const { return IsBatch(type); }
+  static bool IsBatch(Type type) {
+    return type >= Type::MGET && type <= Type::MDEL;
+  }
   char* Key() { return data; }
   const char* Key() const { return data; }
   char* Val() { return data + key_len; }
@@ -50,8 +72,9 @@ struct Request {
 
  private:
   Request(Type type, const char* key, size_t key_len,
-      const char* val, size_t val_len, KeyHash key_hash)
-      : type(type), key_len(key_len), val_len(val_len), key_hash(key_hash) {
+      const char* val, size_t val_len, KeyHash key_hash, uint32_t ttl)
+      : type(type), key_len(key_len), val_len(val_len),
+        key_hash(key_hash), ttl(ttl) {
     memcpy(data, key, key_len);
     if (val != nullptr && val_len > 0) {
       memcpy(data + key_len, val, val_len);
@@ -59,6 +82,132 @@ struct Request {
   }
 };
 
+/*
+ * A batch of requests to the same tablet, sent in one message. The header
+ * is laid out the same as `Request`, so that a batch is dispatched by the
+ * key hash of its first request. Requests of type GET (MGET), PUT (MPUT)
+ * or DEL (MDEL) are packed back to back after the header.
+ */
+struct BatchRequest {
+  Request::Type type;
+  // Number of requests
+  uint16_t num;
+  // Total length of the requests
+  uint16_t len;
+  // Key hash of the first request
+  KeyHash key_hash;
+  // Echoed by the response, to match responses of concurrent batches
+  uint32_t id;
+  char data[0];
+
+  static BatchRequest* New(Infiniband::Buffer* b,
+                           Request::Type type, uint32_t id) {
+    return new (b->buf) BatchRequest(type, id);
+  }
+  static void Del(const BatchRequest* r) {
+    r->~BatchRequest();
+  }
+  // Return nullptr if the request does not fit into one message.
+  Request* Append(const char* key, size_t key_len,
+                  const char* val, size_t val_len, KeyHash key_hash) {
+    if (Len() + sizeof(Request) + key_len + val_len > kMaxUDMessageSize) {
+      return nullptr;
+    }
+    if (num == 0) {
+      this->key_hash = key_hash;
+    }
+    auto r = Request::New(data + len, GetItemType(),
+                          key, key_len, val, val_len, key_hash);
+    ++num;
+    len += r->Len();
+    return r;
+  }
+  size_t Len() const { return sizeof(BatchRequest) + len; }
+  Request::Type GetItemType() const {
+    switch (type) {
+    case Request::Type::MGET: return Request::Type::GET;
+    case Request::Type::MPUT: return Request::Type::PUT;
+    case Request::Type::MDEL: return Request::Type::DEL;
+    default: assert(false);
+    }
+    return type;
+  }
+  const Request* First() const {
+    return reinterpret_cast<const Request*>(data);
+  }
+  const Request* Next(const Request* r) const {
+    return reinterpret_cast<const Request*>(
+        reinterpret_cast<const char*>(r) + r->Len());
+  }
+
+ private:
+  BatchRequest(Request::Type type, uint32_t id)
+      : type(type), num(0), len(0), key_hash(0), id(id) {
+    assert(Request::IsBatch(type));
+  }
+};
+static_assert(offsetof(BatchRequest, key_hash) == offsetof(Request, key_hash),
+              "`BatchRequest` must be dispatched as `Request`");
+
+/*
+ * A fragment of a message longer than `kMaxUDMessageSize`, e.g. a PUT
+ * of a large value or the response to its GET. The header is laid out
+ * the same as `Request`, so that fragments of the same key are dispatched
+ * to the same tablet.
+ *
+ * A long request is pushed to the server by FRAG_WRITE fragments, each
+ * acknowledged by a FRAG_WRITE response, except the one completing the
+ * message, which gets the response of the request. A long response is
+ * staged by the server, which replies the first FRAG_READ fragment of
+ * it; the client pulls the rest by FRAG_READ requests, which carry no
+ * payload and ask for `len` bytes at `offset`.
+ */
+struct Fragment {
+  Request::Type type;
+  // Length of the payload
+  uint16_t len;
+  // Offset of the payload in the message
+  uint32_t offset;
+  KeyHash key_hash;
+  // Length of the message
+  uint32_t total;
+  // Identifies the message among those of the same peer
+  uint32_t id;
+  char data[0];
+
+  static Fragment* New(Infiniband::Buffer* b, Request::Type type,
+                       KeyHash key_hash, uint32_t id, uint32_t total,
+                       uint32_t offset, const char* data, uint16_t len) {
+    return New(b->buf, type, key_hash, id, total, offset, data, len);
+  }
+  static Fragment* New(char* buf, Request::Type type,
+                       KeyHash key_hash, uint32_t id, uint32_t total,
+                       uint32_t offset, const char* data, uint16_t len) {
+    return new (buf) Fragment(type, key_hash, id, total, offset, data, len);
+  }
+  static void Del(const Fragment* f) {
+    f->~Fragment();
+  }
+  // Not for FRAG_READ requests, which carry no payload.
+  size_t Len() const { return sizeof(Fragment) + len; }
+
+ private:
+  Fragment(Request::Type type, KeyHash key_hash, uint32_t id,
+           uint32_t total, uint32_t offset, const char* data, uint16_t len)
+      : type(type), len(len), offset(offset), key_hash(key_hash),
+        total(total), id(id) {
+    assert(type == Request::Type::FRAG_WRITE ||
+           type == Request::Type::FRAG_READ);
+    if (data != nullptr && len > 0) {
+      memcpy(this->data, data, len);
+    }
+  }
+};
+static_assert(offsetof(Fragment, key_hash) == offsetof(Request, key_hash),
+              "`Fragment` must be dispatched as `Request`");
+// Max payload of a fragment
+static const uint32_t kMaxFragmentLen = kMaxUDMessageSize - sizeof(Fragment);
+
 } // namespace nvds
 
-#endif // _NVDS_SERVER_H_
+#endif // _NVDS_REQUEST_H_
@@ -12,17 +12,29 @@ struct Response {
   using Type = Request::Type;
   Type type;
   Status status;
-  uint16_t val_len;
+  uint32_t val_len;
+  // Version of the object, see `Tablet::Cas`
+  uint32_t version;
+  // Position of the tablet's log that the response reflects: writes
+  // committed before it are visible. See `Tablet::lsn`.
+  uint64_t lsn;
   char val[0];
 
   static Response* New(Infiniband::Buffer* b, Type type, Status status) {
-    return new (b->buf) Response(type, status);
+    return New(b->buf, type, status);
+  }
+  static Response* New(char* buf, Type type, Status status) {
+    return new (buf) Response(type, status);
   }
   static void Del(const Response* r) {
     r->~Response();
   }
   uint32_t Len() const {
-    return sizeof(Response) + (type == Type::GET ? val_len : 0);
+    return sizeof(Response) + (HasVal() ? val_len : 0);
+  }
+  // The new value is responded to INCR and DECR
+  bool HasVal() const {
+    return type == Type::GET || type == Type::INCR || type == Type::DECR;
   }
   void Print() const {
     std::cout << "type: " << (type == Type::GET ? "GET" : type == Type::PUT ? "PUT" : "DEL") << std::endl;
@@ -35,7 +47,62 @@ struct Response {
   }
  private:
   Response(Request::Type t, Status s)
-      : type(t), status(s), val_len(0) {
+      : type(t), status(s), val_len(0), version(0), lsn(0) {
+  }
+};
+
+/*
+ * Responses to a `BatchRequest`, packed back to back after the header in
+ * the order of the requests. Values of an MGET may not fit into one
+ * message, in which case `num` is less than that of the request, and the
+ * remaining requests should be sent again.
+ */
+struct BatchResponse {
+  using Type = Request::Type;
+  Type type;
+  Status status;
+  // Number of responses
+  uint16_t num;
+  // Total length of the responses
+  uint16_t len;
+  // Id of the `BatchRequest`
+  uint32_t id;
+  char data[0];
+
+  static BatchResponse* New(Infiniband::Buffer* b, Type type, uint32_t id) {
+    return new (b->buf) BatchResponse(type, id);
+  }
+  static void Del(const BatchResponse* r) {
+    r->~BatchResponse();
+  }
+  uint32_t Len() const { return sizeof(BatchResponse) + len; }
+  // Space for the next response
+  char* End() { return data + len; }
+  // The response should have been written at `End()`.
+  void Append(const Response* r) {
+    assert(reinterpret_cast<const char*>(r) == End());
+    ++num;
+    len += r->Len();
+  }
+  const Response* First() const {
+    return reinterpret_cast<const Response*>(data);
+  }
+  const Response* Next(const Response* r) const {
+    return reinterpret_cast<const Response*>(
+        reinterpret_cast<const char*>(r) + r->Len());
+  }
+  // Set `lsn` of the responses, after the modifications are synced.
+  void SetLsn(uint64_t lsn) {
+    auto r = reinterpret_cast<Response*>(data);
+    for (uint16_t i = 0; i < num; ++i) {
+      r->lsn = lsn;
+      r = reinterpret_cast<Response*>(reinterpret_cast<char*>(r) + r->Len());
+    }
+  }
+
+ private:
+  BatchResponse(Type t, uint32_t id)
+      : type(t), status(Status::OK), num(0), len(0), id(id) {
   }
 };
 
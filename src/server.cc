@@ -3,6 +3,7 @@
 #include "json.hpp"
 #include "request.h"
 
+#include <algorithm>
 #include <chrono>
 #include <thread>
 
@@ -26,31 +27,90 @@ Server::Server(uint16_t port, NVMPtr<NVMDevice> nvm, uint64_t nvm_size)
     qp_->GetLocalQPNum()
   };
 
-  // Tablets
-  for (uint32_t i = 0; i < kNumTabletAndBackupsPerServer; ++i) {
-    auto ptr = reinterpret_cast<char*>(&nvm_->tablets) + i * kNVMTabletSize;
-    bool is_backup = i >= kNumTabletsPerServer;
-    tablets_[i] = new Tablet(index_manager_,
-        NVMPtr<NVMTablet>(reinterpret_cast<NVMTablet*>(ptr)), is_backup);
-    if (i < kNumTabletsPerServer) {
-      workers_[i] = new Worker(this, tablets_[i]);
+  // Tablets are reattached (or formatted) concurrently, and the cores
+  // left are shared by their recovery scans.
+  recovered_ = nvm_->IsValid(nvm_size_);
+  auto begin = std::chrono::steady_clock::now();
+  auto num_tablets = config.num_tablet_and_backups_per_server();
+  uint32_t num_recovery_threads = std::max(1U,
+      std::thread::hardware_concurrency() / num_tablets);
+  tablets_.resize(num_tablets);
+  std::vector<std::thread> loaders;
+  for (uint32_t i = 0; i < num_tablets; ++i) {
+    loaders.emplace_back([this, i, num_recovery_threads]() {
+      auto ptr = reinterpret_cast<char*>(&nvm_->tablets) +
+                 i * NVMTablet::GetSize(config.tablet_size);
+      bool is_backup = i >= config.num_tablets_per_server;
+      tablets_[i] = new Tablet(index_manager_,
+          NVMPtr<NVMTablet>(reinterpret_cast<NVMTablet*>(ptr)),
+          is_backup, recovered_, num_recovery_threads);
+    });
+  }
+  for (auto& loader : loaders) {
+    loader.join();
+  }
+  for (uint32_t i = 0; i < num_tablets; ++i) {
+    for (uint32_t j = 0; j < config.num_workers_per_tablet; ++j) {
+      workers_.push_back(new Worker(this, tablets_[i], j));
+    }
+  }
+
+  if (recovered_) {
+    Tablet::RecoveryStats stats {0, 0, 0, 0, 0};
+    for (auto tablet : tablets_) {
+      stats.num_objects += tablet->recovery_stats().num_objects;
+      stats.num_bytes += tablet->recovery_stats().num_bytes;
+      stats.num_leaked_blocks += tablet->recovery_stats().num_leaked_blocks;
+      stats.num_undone_writes += tablet->recovery_stats().num_undone_writes;
+      stats.num_redone_records += tablet->recovery_stats().num_redone_records;
     }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - begin).count();
+    NVDS_LOG("reattached tablets of server %" PRIu32 " in %" PRId64 " ms: "
+             "%" PRIu32 " objects, %" PRIu64 " bytes, "
+             "%" PRIu32 " leaked blocks freed, %" PRIu32 " records redone, "
+             "%" PRIu32 " writes undone",
+             nvm_->server_id, static_cast<int64_t>(elapsed), stats.num_objects,
+             stats.num_bytes, stats.num_leaked_blocks, stats.num_redone_records,
+             stats.num_undone_writes);
+  } else {
+    nvm_->Format(nvm_size_);
   }
 }
 
+bool NVMDevice::IsValid(uint64_t size) const {
+  return magic == kMagic &&
+         tablet_size == NVMTablet::GetSize(config.tablet_size) &&
+         this->size == size &&
+         tablet_num == config.num_tablet_and_backups_per_server() &&
+         checksum == ComputeChecksum();
+}
+
+void NVMDevice::Format(uint64_t size) {
+  // Formatted tablets are persisted before the header that commits them
+  Persist(tablets, size - offsetof(NVMDevice, tablets));
+  memset(this, 0, offsetof(NVMDevice, tablets));
+  magic = kMagic;
+  tablet_size = NVMTablet::GetSize(config.tablet_size);
+  this->size = size;
+  tablet_num = config.num_tablet_and_backups_per_server();
+  Seal();
+}
+
 Server::~Server() {
   // Destruct elements in reverse order
-  for (int64_t i = kNumTabletAndBackupsPerServer - 1; i >= 0; --i) {
-    delete tablets_[i];
-    if (i < kNumTabletsPerServer) {
-      delete workers_[i];
+  for (int64_t i = tablets_.size() - 1; i >= 0; --i) {
+    for (int64_t j = config.num_workers_per_tablet - 1; j >= 0; --j) {
+      delete workers_[i * config.num_workers_per_tablet + j];
     }
+    delete tablets_[i];
   }
   delete qp_;
 }
 
 void Server::Run() {
   std::thread poller(&Server::Poll, this);
+  std::thread applier(&Server::Apply, this);
   
   Accept(std::bind(&Server::HandleRecvMessage, this,
                    std::placeholders::_1, std::placeholders::_2),
@@ -59,6 +119,7 @@ void Server::Run() {
   RunService();
   
   poller.join();
+  applier.join();
 }
 
 bool Server::Join(const std::string& coord_addr) {
@@ -74,13 +135,14 @@ bool Server::Join(const std::string& coord_addr) {
                             Message::Type::REQ_JOIN, 0};
 
     std::vector<Infiniband::QueuePairInfo> qpis;
-    for (uint32_t i = 0; i < kNumTabletAndBackupsPerServer; ++i) {
-      for (uint32_t j = 0; j < kNumReplicas; ++j) {
-        qpis.emplace_back(tablets_[i]->info().qpis[j]);
+    for (auto tablet : tablets_) {
+      for (const auto& qpi : tablet->info().qpis) {
+        qpis.emplace_back(qpi);
       }
     }
     json body {
       {"size", nvm_size_},
+      {"config", config},
       {"ib_addr", ib_addr_},
       {"tablet_qpis", qpis},
     };
@@ -95,14 +157,29 @@ bool Server::Join(const std::string& coord_addr) {
     try {
       msg = session_join.RecvMessage();
       assert(msg.sender_type() == Message::SenderType::COORDINATOR);
-      assert(msg.type() == Message::Type::RES_JOIN);
       auto j_body = json::parse(msg.body());
+      if (msg.type() == Message::Type::ACK_REJECT) {
+        NVDS_ERR("join rejected by coordinator: %s",
+                 j_body["error"].get<std::string>().c_str());
+        return false;
+      }
+      assert(msg.type() == Message::Type::RES_JOIN);
       id_ = j_body["id"];
       index_manager_ = j_body["index_manager"];
       active_ = true;
+      if (nvm_->server_id != id_) {
+        if (recovered_) {
+          // Tablets are arranged by the server id
+          NVDS_ERR("server id changed from %" PRIu32 " to %" PRIu32
+                   ", data of the reattached tablets is stale",
+                   nvm_->server_id, id_);
+        }
+        nvm_->server_id = id_;
+        nvm_->Seal();
+      }
 
       auto& server_info = index_manager_.GetServer(id_);
-      for (uint32_t i = 0; i < kNumTabletAndBackupsPerServer; ++i) {
+      for (uint32_t i = 0; i < tablets_.size(); ++i) {
         auto tablet_id = server_info.tablets[i];
         // Both master and backup tablets
         tablets_[i]->SettingupQPConnect(tablet_id, index_manager_);
@@ -182,77 +259,408 @@ void Server::Poll() {
   }
 }
 
+void Server::Apply() {
+  while (true) {
+    uint32_t n = 0;
+    for (uint32_t i = config.num_tablets_per_server;
+         i < tablets_.size(); ++i) {
+      n += tablets_[i]->Apply();
+    }
+    if (n == 0) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+void Server::PrintReplicationStats() const {
+  for (uint32_t i = 0; i < config.num_tablets_per_server &&
+                       i < tablets_.size(); ++i) {
+    auto stats = tablets_[i]->replication_stats();
+    NVDS_LOG("replication lag of tablet %" PRIu32 ": %" PRIu64 " bytes, "
+             "%" PRIu64 " bytes at most",
+             tablets_[i]->info().id, stats.lag, stats.max_lag);
+  }
+}
+
 void Server::Dispatch(Work* work) {
   auto r = work->MakeRequest();
   auto id = index_manager_.GetTabletId(r->key_hash);
-  workers_[id % kNumTabletAndBackupsPerServer]->Enqueue(work);
+  const auto& master = index_manager_.GetTablet(id);
+  if (master.server_id != id_) {
+    // A GET to one of the backups of the tablet on this server
+    for (auto backup : master.backups) {
+      if (index_manager_.GetTablet(backup).server_id == id_) {
+        id = backup;
+        break;
+      }
+    }
+  }
+  auto num_workers = config.num_workers_per_tablet;
+  auto first = id % tablets_.size() * num_workers;
+  uint32_t j;
+  if (r->type == Request::Type::GET || r->type == Request::Type::MGET ||
+      r->type == Request::Type::FRAG_READ) {
+    // GETs are lock free, balance them over all workers of the tablet
+    j = num_recv_ % num_workers;
+  } else {
+    // Modifications (and fragments) of the same key keep their order
+    j = r->key_hash % num_workers;
+  }
+  workers_[first + j]->Enqueue(work);
   ++num_recv_;
 }
 
 void Server::Worker::Serve() {
   ModificationList modifications;
+  std::vector<Reply> group;
+  group.reserve(kMaxGroupCommitSize);
+  uint32_t num_unswept = 0;
   while (true) {
-    // Get request
-    auto work = wq_.TryPollWork();
-    Infiniband::Buffer* sb = nullptr;
+    // Get request, without waiting while replies are in flight
+    Release();
+    auto work = replies_.empty() ? wq_.TryPollWork() : wq_.Dequeue();
+    if (work == nullptr && !replies_.empty()) {
+      continue;
+    }
+    if (work == nullptr || num_unswept >= kSweepInterval) {
+      Sweep(modifications);
+      num_unswept = 0;
+    }
     if (work == nullptr) {
       std::unique_lock<std::mutex> lock(mtx_);
-      cond_var_.wait(lock, [&work, &sb, this]() -> bool {
+      cond_var_.wait(lock, [&work, this]() -> bool {
           return (work || (work = wq_.Dequeue()));
         });
     }
     #ifdef ENABLE_MEASUREMENT
       server_->thread_measurement.end();
     #endif
-    sb = server_->send_bufs_.Alloc();
-    assert(work != nullptr && sb != nullptr);
+    Infiniband::Buffer* sb;
+    // Send buffers are held by replies in flight
+    while ((sb = server_->send_bufs_.Alloc()) == nullptr) {
+      Release();
+    }
 
-    // Do the work
-    auto r = work->MakeRequest();
-    auto resp = Response::New(sb, r->type, Status::OK);
+    // Do the work, and those queued behind it, which are committed by
+    // one log record and released by one completion of each backup.
+    group.clear();
     modifications.clear();
-    
     #ifdef ENABLE_MEASUREMENT
       server_->alloc_measurement.begin();
     #endif
-    switch (r->type) {
-    case Request::Type::PUT:
-      resp->status = tablet_->Put(r, modifications);
-      break;
-    case Request::Type::ADD:
-      resp->status = tablet_->Add(r, modifications);
-      break;
-    case Request::Type::DEL:
-      resp->status = tablet_->Del(r, modifications);
-      break;
-    case Request::Type::GET:
-      resp->status = tablet_->Get(resp, r, modifications);
-      break;
+    uint64_t num_bytes = 0;
+    for (size_t i = 0; true; ) {
+      group.push_back({work, sb, 0, nullptr, nullptr, 0});
+      Handle(&group.back(), modifications);
+      for (; i < modifications.size(); ++i) {
+        num_bytes += modifications[i].len;
+      }
+      if (group.size() >= kMaxGroupCommitSize ||
+          num_bytes >= kMaxGroupCommitBytes) {
+        break;
+      }
+      if ((sb = server_->send_bufs_.Alloc()) == nullptr) {
+        break;
+      }
+      if ((work = wq_.Dequeue()) == nullptr) {
+        server_->send_bufs_.Free(sb);
+        break;
+      }
     }
+    num_unswept += group.size();
     #ifdef ENABLE_MEASUREMENT
       server_->alloc_measurement.end();
     #endif
 
+    // The replies wait for the record of the group, or for those of
+    // earlier groups if it modifies nothing, as they may have read the
+    // writes of them. Later groups are served meanwhile.
+    uint64_t lsn = 0;
     try {
       #ifdef ENABLE_MEASUREMENT
         server_->sync_measurement.begin();
       #endif
-      tablet_->Sync(modifications);
+      lsn = tablet_->Post(modifications);
       #ifdef ENABLE_MEASUREMENT
         server_->sync_measurement.end();
       #endif
     } catch (TransportException& e) {
-      r->Print();
+      for (auto& reply : group) {
+        reply.work->MakeRequest()->Print();
+      }
       tablet_->info().Print();
       server_->index_manager_.PrintTablets();
       NVDS_ERR(e.ToString().c_str());
     }
+    for (auto& reply : group) {
+      reply.lsn = lsn;
+      replies_.push_back(reply);
+    }
+  }
+}
 
-    #ifdef ENABLE_MEASUREMENT
+void Server::Worker::Release() {
+  if (replies_.empty()) {
+    return;
+  }
+  uint64_t lsn;
+  try {
+    tablet_->Poll();
+    lsn = tablet_->GetReleasable();
+  } catch (TransportException& e) {
+    tablet_->info().Print();
+    NVDS_ERR(e.ToString().c_str());
+    // The replies are not held forever
+    lsn = UINT64_MAX;
+  }
+  #ifdef ENABLE_MEASUREMENT
+    if (replies_.front().lsn <= lsn) {
       server_->send_measurement.begin();
-    #endif
-    server_->ib_.PostSend(server_->qp_, sb, resp->Len(), &work->peer_addr);
-    server_->recv_bufs_.Free(work);
+    }
+  #endif
+  // Replies are queued in the order of their records
+  while (!replies_.empty() && replies_.front().lsn <= lsn) {
+    auto& reply = replies_.front();
+    if (reply.written != nullptr) {
+      reply.written->lsn = reply.lsn;
+    } else if (reply.written_batch != nullptr) {
+      reply.written_batch->SetLsn(reply.lsn);
+    }
+    server_->ib_.PostSend(server_->qp_, reply.sb, reply.resp_len,
+                          &reply.work->peer_addr);
+    server_->recv_bufs_.Free(reply.work);
+    replies_.pop_front();
+  }
+}
+
+void Server::Worker::Handle(Reply* reply, ModificationList& modifications) {
+  auto work = reply->work;
+  auto sb = reply->sb;
+  auto r = work->MakeRequest();
+  if (r->type == Request::Type::FRAG_WRITE) {
+    reply->resp_len = WriteFragment(work->MakeFragment(), work->peer_addr,
+                                    sb, modifications);
+    reply->written = sb->MakeResponse();
+  } else if (r->type == Request::Type::FRAG_READ) {
+    reply->resp_len = ReadFragment(work->MakeFragment(), work->peer_addr, sb);
+  } else if (r->IsBatch()) {
+    auto br = work->MakeBatchRequest();
+    auto resp = BatchResponse::New(sb, br->type, br->id);
+    ExecuteBatch(br, resp, modifications);
+    reply->resp_len = resp->Len();
+    if (br->type != Request::Type::MGET) {
+      reply->written_batch = resp;
+    }
+  } else {
+    auto resp = Response::New(sb, r->type, Status::OK);
+    Execute(r, resp, modifications);
+    reply->resp_len = resp->Len();
+    if (r->type != Request::Type::GET) {
+      reply->written = resp;
+    } else if (reply->resp_len > kMaxUDMessageSize) {
+      // The value is read again as a whole
+      std::vector<char> whole;
+      if (tablet_->Get(whole, r) == Status::OK) {
+        reply->resp_len = StageResponse(whole, r->key_hash,
+                                        work->peer_addr, sb);
+      } else {
+        reply->resp_len = Response::New(sb, r->type, Status::ERROR)->Len();
+      }
+    }
+  }
+}
+
+void Server::Worker::Sweep(ModificationList& modifications) {
+  // A backup is modified by its master only
+  if (tablet_->info().is_backup) {
+    return;
+  }
+  modifications.clear();
+  auto num_reclaimed = tablet_->Sweep(modifications);
+  if (num_reclaimed + tablet_->Compact(modifications) == 0) {
+    return;
+  }
+  try {
+    tablet_->Sync(modifications);
+  } catch (TransportException& e) {
+    tablet_->info().Print();
+    NVDS_ERR(e.ToString().c_str());
+  }
+}
+
+void Server::Worker::Execute(const Request* r, Response* resp,
+                             ModificationList& modifications) {
+  if (tablet_->info().is_backup && r->type != Request::Type::GET) {
+    resp->status = Status::ERROR;
+    return;
+  }
+  switch (r->type) {
+  case Request::Type::PUT:
+    resp->status = tablet_->Put(r, modifications);
+    break;
+  case Request::Type::ADD:
+    resp->status = tablet_->Add(r, modifications);
+    break;
+  case Request::Type::DEL:
+    resp->status = tablet_->Del(r, modifications);
+    break;
+  case Request::Type::GET:
+    resp->status = tablet_->Get(resp, r, kMaxUDMessageSize - sizeof(Response),
+                                modifications);
+    break;
+  case Request::Type::INCR:
+  case Request::Type::DECR:
+    resp->status = tablet_->Incr(resp, r, modifications);
+    break;
+  case Request::Type::CAS:
+    resp->status = tablet_->Cas(resp, r, modifications);
+    break;
+  case Request::Type::APPEND:
+    resp->status = tablet_->Append(resp, r, modifications);
+    break;
+  default:
+    resp->status = Status::ERROR;
+  }
+}
+
+void Server::Worker::ExecuteBatch(const BatchRequest* br, BatchResponse* resp,
+                                  ModificationList& modifications) {
+  // Longer values never fit, even into a batch response of its own
+  static const uint32_t kMaxBatchValLen =
+      kMaxUDMessageSize - sizeof(BatchResponse) - sizeof(Response);
+  const auto& info = tablet_->info();
+  auto master = info.is_backup ? info.master : info.id;
+  auto r = br->First();
+  for (uint16_t i = 0; i < br->num; ++i, r = br->Next(r)) {
+    assert(r->type == br->GetItemType());
+    // Responses to PUT and DEL always fit, as they are shorter than requests
+    auto room = kMaxUDMessageSize - resp->Len() - sizeof(Response);
+    auto item = Response::New(resp->End(), r->type, Status::OK);
+    if (server_->index_manager_.GetTabletId(r->key_hash) != master) {
+      item->status = Status::ERROR;
+    } else if (r->type != Request::Type::GET &&
+               r->key_hash % config.num_workers_per_tablet != idx_) {
+      // The batch is dispatched by its first key, while modifications of
+      // a key keep their order by being served by one worker
+      item->status = Status::RETRY;
+    } else if (r->type == Request::Type::GET) {
+      item->status = tablet_->Get(item, r, room, modifications);
+      if (item->status == Status::OK && item->val_len > room) {
+        if (item->val_len <= kMaxBatchValLen) {
+          // The rest are left to the client to retry
+          break;
+        }
+        item->status = Status::TOO_LARGE;
+        item->val_len = 0;
+      }
+    } else {
+      Execute(r, item, modifications);
+    }
+    resp->Append(item);
+  }
+}
+
+uint32_t Server::Worker::WriteFragment(const Fragment* f,
+                                       const Infiniband::Address& peer,
+                                       Infiniband::Buffer* sb,
+                                       ModificationList& modifications) {
+  static const uint32_t kMaxRequestLen =
+      sizeof(Request) + kMaxItemSize + kMaxValueSize;
+  if (f->total < sizeof(Request) || f->total > kMaxRequestLen ||
+      f->len > kMaxFragmentLen ||
+      f->offset + f->len > f->total || f->offset % kMaxFragmentLen != 0) {
+    return Response::New(sb, f->type, Status::ERROR)->Len();
+  }
+
+  std::vector<char> whole;
+  {
+    std::lock_guard<Spinlock> _(server_->transfers_lock_);
+    auto now = std::chrono::steady_clock::now();
+    auto& t = server_->transfers_[GetPeerId(peer)];
+    if (t.id != f->id || t.data.size() != f->total) {
+      server_->ExpireTransfers();
+      t = {f->id, 0, std::vector<char>(f->total), now,
+           std::vector<bool>((f->total + kMaxFragmentLen - 1) /
+                             kMaxFragmentLen)};
+    }
+    // A fragment sent again is counted once
+    auto i = f->offset / kMaxFragmentLen;
+    if (!t.received[i]) {
+      memcpy(t.data.data() + f->offset, f->data, f->len);
+      t.done += f->len;
+      t.received[i] = true;
+    }
+    t.active = now;
+    if (t.done == t.data.size()) {
+      whole.swap(t.data);
+      server_->transfers_.erase(GetPeerId(peer));
+    }
+  }
+  if (whole.empty()) {
+    return Response::New(sb, f->type, Status::OK)->Len();
+  }
+
+  auto r = reinterpret_cast<const Request*>(whole.data());
+  if (whole.size() < sizeof(Request) || r->Len() != whole.size() ||
+      (r->type != Request::Type::PUT && r->type != Request::Type::ADD &&
+       r->type != Request::Type::CAS && r->type != Request::Type::APPEND)) {
+    return Response::New(sb, f->type, Status::ERROR)->Len();
+  }
+  auto resp = Response::New(sb, r->type, Status::OK);
+  Execute(r, resp, modifications);
+  return resp->Len();
+}
+
+uint32_t Server::Worker::ReadFragment(const Fragment* f,
+                                      const Infiniband::Address& peer,
+                                      Infiniband::Buffer* sb) {
+  std::lock_guard<Spinlock> _(server_->transfers_lock_);
+  auto it = server_->transfers_.find(GetPeerId(peer));
+  if (it == server_->transfers_.end() || it->second.id != f->id ||
+      f->offset >= it->second.data.size()) {
+    // The peer gets no payload
+    return Fragment::New(sb, f->type, f->key_hash, f->id,
+                         0, f->offset, nullptr, 0)->Len();
+  }
+  auto& t = it->second;
+  uint32_t len = std::min({static_cast<uint32_t>(f->len), kMaxFragmentLen,
+      static_cast<uint32_t>(t.data.size()) - f->offset});
+  auto frag = Fragment::New(sb, f->type, f->key_hash, f->id, t.data.size(),
+                            f->offset, t.data.data() + f->offset, len);
+  t.done += len;
+  t.active = std::chrono::steady_clock::now();
+  if (t.done >= t.data.size()) {
+    server_->transfers_.erase(it);
+  }
+  return frag->Len();
+}
+
+uint32_t Server::Worker::StageResponse(std::vector<char>& resp,
+                                       KeyHash key_hash,
+                                       const Infiniband::Address& peer,
+                                       Infiniband::Buffer* sb) {
+  std::lock_guard<Spinlock> _(server_->transfers_lock_);
+  auto id = server_->num_transfers_++;
+  // The value may have shrunk since it was found too long for a message
+  uint32_t len = std::min<size_t>(resp.size(), kMaxFragmentLen);
+  auto frag = Fragment::New(sb, Request::Type::FRAG_READ, key_hash, id,
+                            resp.size(), 0, resp.data(), len);
+  if (len < resp.size()) {
+    server_->ExpireTransfers();
+    server_->transfers_[GetPeerId(peer)] = {id, len, std::move(resp),
+                                            std::chrono::steady_clock::now()};
+  }
+  return frag->Len();
+}
+
+void Server::ExpireTransfers() {
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = transfers_.begin(); it != transfers_.end();) {
+    if (now - it->second.active > std::chrono::seconds(kTransferTimeout)) {
+      it = transfers_.erase(it);
+    } else {
+      ++it;
+    }
   }
 }
 
@@ -7,14 +7,19 @@
 #include "infiniband.h"
 #include "measurement.h"
 #include "message.h"
+#include "persist.h"
 #include "spinlock.h"
 #include "tablet.h"
 
 #include <boost/asio.hpp>
 #include <boost/function.hpp>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define ENABLE_MEASUREMENT
 
@@ -24,9 +29,18 @@ namespace nvds {
  * The abstraction of NVM device. No instantiation is allowed.
  * For each server, there is only one NVMDevice object which is
  * mapped to the address passed when the server is started.
+ *
+ * The header is written after all tablets are formatted. A device whose
+ * header is valid, e.g. mapped from the same file after restart, has its
+ * tablets reattached without formatting them.
  */
 struct NVMDevice {
+  static const uint64_t kMagic = 0x5344564e; // "NVDS"
 
+  // Equals to `kMagic` if the device is formatted
+  uint64_t magic;
+  // Layout of the device, it is not reattached if changed
+  uint64_t tablet_size;
   // The server id of the machine.
   ServerId server_id;
   // The size in byte of the NVM device
@@ -36,13 +50,33 @@ struct NVMDevice {
   KeyHash key_end;
   // The number of tablets
   uint32_t tablet_num;
+  // Checksum of the header fields above
+  uint64_t checksum;
   // The begin of tablets
   NVMTablet tablets[0];
   NVMDevice() = delete;
-};
 
-static const uint64_t kNVMDeviceSize = sizeof(NVMDevice) +
-                                       kNVMTabletSize * kNumTabletAndBackupsPerServer;
+  // Size of the device, with tablets of the configuration.
+  static uint64_t GetSize() {
+    return sizeof(NVMDevice) + NVMTablet::GetSize(config.tablet_size) *
+        config.num_tablet_and_backups_per_server();
+  }
+  // Return if the header is valid, and matches the layout of `size` bytes.
+  bool IsValid(uint64_t size) const;
+  // Write the header, after tablets have been formatted.
+  void Format(uint64_t size);
+  // Update the checksum and persist the header, after it is modified.
+  void Seal() {
+    checksum = ComputeChecksum();
+    Persist(this, offsetof(NVMDevice, tablets));
+  }
+
+ private:
+  uint64_t ComputeChecksum() const {
+    return Hash(reinterpret_cast<const char*>(this),
+                offsetof(NVMDevice, checksum));
+  }
+};
 
 class Server : public BasicServer {
  // For convenience
@@ -65,6 +99,7 @@ class Server : public BasicServer {
   bool active() const { return active_; }  
   uint64_t nvm_size() const { return nvm_size_; }
   NVMPtr<NVMDevice> nvm() const { return nvm_; }
+  bool recovered() const { return recovered_; }
   size_t num_recv() const { return num_recv_; }
 
   void Run() override;
@@ -72,6 +107,10 @@ class Server : public BasicServer {
   void Leave();
   void Listening();
   void Poll();
+  // Redo log records replicated to the backup tablets.
+  void Apply();
+  // Print the replication lag of the master tablets.
+  void PrintReplicationStats() const;
   // Dispatch the `work` to specific `worker`, load balance considered.
   void Dispatch(Work* work);
 
@@ -134,8 +173,9 @@ class Server : public BasicServer {
 
   class Worker {
    public:
-    Worker(Server* server, Tablet* tablet)
-        : server_(server), tablet_(tablet),
+    // Worker `idx` of the tablet
+    Worker(Server* server, Tablet* tablet, uint32_t idx)
+        : server_(server), tablet_(tablet), idx_(idx),
           slave_(std::bind(&Worker::Serve, this)) {}
     void Enqueue(Work* work) {
       std::unique_lock<std::mutex> lock(mtx_);
@@ -147,10 +187,56 @@ class Server : public BasicServer {
     }
 
    private:
+    // Requests served between two sweeps of a busy worker
+    static const uint32_t kSweepInterval = 1024;
+    // A group stops taking requests once its modifications reach this,
+    // so that its record and that of the largest request fit into the log.
+    static const uint64_t kMaxGroupCommitBytes = kMaxValueSize / 2;
+    // A request served, whose response is sent once the record of its
+    // group is replicated.
+    struct Reply {
+      Work* work;
+      Infiniband::Buffer* sb;
+      uint32_t resp_len;
+      // Responses to modifications, which reflect their log record
+      Response* written;
+      BatchResponse* written_batch;
+      // Position of the log that must be replicated before it is sent
+      uint64_t lsn;
+    };
     void Serve();
+    // Execute the request of `reply->work`, build its response in `reply`.
+    void Handle(Reply* reply, ModificationList& modifications);
+    // Send the replies whose records are replicated, without waiting.
+    void Release();
+    // Reclaim expired items of a slice of the tablet, compact another
+    // slice if the arena is fragmented, and replicate them.
+    void Sweep(ModificationList& modifications);
+    void Execute(const Request* r, Response* resp,
+                 ModificationList& modifications);
+    // Execute the requests of a batch in order,
+    // modifications of them are synced together. Requests of another
+    // tablet fail, modifications of keys served by another worker of the
+    // tablet are responded Status::RETRY.
+    void ExecuteBatch(const BatchRequest* r, BatchResponse* resp,
+                      ModificationList& modifications);
+    // The functions below return length of the response built in `sb`.
+    // The request is executed once all its fragments are received.
+    uint32_t WriteFragment(const Fragment* f, const Infiniband::Address& peer,
+                           Infiniband::Buffer* sb,
+                           ModificationList& modifications);
+    uint32_t ReadFragment(const Fragment* f, const Infiniband::Address& peer,
+                          Infiniband::Buffer* sb);
+    // Stage the response for the peer to pull, build its first fragment.
+    uint32_t StageResponse(std::vector<char>& resp, KeyHash key_hash,
+                           const Infiniband::Address& peer,
+                           Infiniband::Buffer* sb);
     WorkQueue wq_;
     Server* server_;
     Tablet* tablet_;
+    uint32_t idx_;
+    // Replies whose records are in flight, in the order of the records
+    std::deque<Reply> replies_;
 
     std::mutex mtx_;
     std::condition_variable cond_var_;
@@ -162,6 +248,8 @@ class Server : public BasicServer {
   bool active_;
   uint64_t nvm_size_;  
   NVMPtr<NVMDevice> nvm_;
+  // If tablets are reattached from a formatted device
+  bool recovered_;
 
   IndexManager index_manager_;
 
@@ -173,8 +261,34 @@ class Server : public BasicServer {
   Infiniband::QueuePair* qp_;
 
   // Worker
-  std::array<Worker*, kNumTabletsPerServer> workers_;
-  std::array<Tablet*, kNumTabletAndBackupsPerServer> tablets_;
+  // Workers of tablet `i` are `workers_[i * num_workers_per_tablet + j]`,
+  // workers of backup tablets serve GETs only.
+  std::vector<Worker*> workers_;
+  std::vector<Tablet*> tablets_;
+
+  // A message longer than `kMaxUDMessageSize`, transferred by fragments
+  struct Transfer {
+    uint32_t id;
+    // Bytes received, or sent
+    uint32_t done;
+    std::vector<char> data;
+    // Time of the last fragment
+    std::chrono::steady_clock::time_point active;
+    // Fragments received, which start at multiples of `kMaxFragmentLen`
+    std::vector<bool> received;
+  };
+  static uint64_t GetPeerId(const Infiniband::Address& addr) {
+    return static_cast<uint64_t>(addr.lid) << 32 | addr.qpn;
+  }
+  // A peer transfers one long message at a time, its transfer is
+  // replaced by the next one if it gives up. Transfers of peers that
+  // are gone are freed once idle for `kTransferTimeout` seconds.
+  static const uint32_t kTransferTimeout = 10;
+  // Free idle transfers, `transfers_lock_` must be held.
+  void ExpireTransfers();
+  std::unordered_map<uint64_t, Transfer> transfers_;
+  uint32_t num_transfers_ {0};
+  Spinlock transfers_lock_;
 
   // Statistic
   size_t num_recv_ {0};
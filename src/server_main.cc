@@ -30,13 +30,18 @@ static void SigInt(int signo) {
   server->recv_measurement.Print();
   std::cout << std::endl;
 
+  server->PrintReplicationStats();
+  std::cout << std::endl;
+
   std::cout << std::flush;
   exit(0);
 }
 
 static void Usage(int argc, const char* argv[]) {
     std::cout << "Usage:" << std::endl
-              << "    " << argv[0] << " <port> <coord addr>" << std::endl;
+              << "    " << argv[0]
+              << " <port> <coord addr> [nvm file | -] [config file]"
+              << std::endl;
 }
 
 int main(int argc, const char* argv[]) {
@@ -49,16 +54,25 @@ int main(int argc, const char* argv[]) {
 
   uint16_t server_port = std::stoi(argv[1]);
   std::string coord_addr = argv[2];
+  std::string err;
+  if (argc > 4 && !config.Load(argv[4], &err)) {
+    NVDS_ERR(err.c_str());
+    return -1;
+  }
 
   // Step 0, self initialization, including formatting nvm storage.
-  // DRAM emulated NVM.
-  auto nvm = AcquireNVM<NVMDevice>(kNVMDeviceSize);
+  // DRAM emulated NVM (without the file, or with "-"), or NVM mapped from
+  // the file, which is reattached if it was formatted by the last run.
+  auto nvm_size = NVMDevice::GetSize();
+  bool mapped = argc > 3 && std::string(argv[3]) != "-";
+  auto nvm = mapped ? MapNVM<NVMDevice>(argv[3], nvm_size)
+                    : AcquireNVM<NVMDevice>(nvm_size);
   if (nvm == nullptr) {
-    NVDS_ERR("acquire nvm failed: size = %PRIu64", kNVMDeviceSize);
+    NVDS_ERR("acquire nvm failed: size = %" PRIu64, nvm_size);
     return -1;
   }
   try {
-    Server s(server_port, nvm, kNVMDeviceSize);
+    Server s(server_port, nvm, nvm_size);
     server = &s;
     // Step 1: request to the coordinator for joining in.
     if (!s.Join(coord_addr)) {
@@ -7,6 +7,13 @@ namespace nvds {
 
   enum class Status : uint8_t {
     OK, ERROR, NO_MEM,
+    // The value does not fit into a batch response
+    TOO_LARGE,
+    // The version does not match that expected by a CAS
+    MISMATCH,
+    // The key of a batched modification is served by another worker, it
+    // is to be sent again in a batch of its own worker
+    RETRY,
   };
 
 } // namespace nvds
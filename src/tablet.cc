@@ -1,32 +1,105 @@
 #include "tablet.h"
 
 #include "index.h"
+#include "persist.h"
 #include "request.h"
 #include "status.h"
 
-#define OFFSETOF_NVMOBJECT(obj, member) \
-    offsetof(NVMObject, member) + obj
+#include <algorithm>
+#include <mutex>
+#include <thread>
 
 namespace nvds {
 
+thread_local Tablet::UndoLogRef Tablet::undo_ref_ = {nullptr, 0, false};
+
 Tablet::Tablet(const IndexManager& index_manager,
-               NVMPtr<NVMTablet> nvm_tablet, bool is_backup)
-    : index_manager_(index_manager),
-      nvm_tablet_(nvm_tablet), allocator_(&nvm_tablet->data) {
+               NVMPtr<NVMTablet> nvm_tablet, bool is_backup, bool recover,
+               uint32_t num_recovery_threads)
+    : index_manager_(index_manager), nvm_tablet_(nvm_tablet),
+      allocator_(reinterpret_cast<uintptr_t>(&nvm_tablet->data),
+                 config.tablet_size),
+      hash_table_(allocator_,
+                  NVMTablet::GetHashTableOffset(config.tablet_size),
+                  NVMTablet::GetMaxNumBuckets(config.tablet_size)),
+      log_offset_(NVMTablet::GetLogOffset(config.tablet_size)),
+      undo_log_offset_(NVMTablet::GetUndoLogOffset(config.tablet_size)),
+      qps_(config.num_replicas), unposted_(config.num_replicas),
+      replicated_(config.num_replicas, 0),
+      num_inflight_(config.num_replicas, 0),
+      backup_heads_(config.num_replicas + 1, 0) {
   info_.is_backup = is_backup;
-  
+  // Writes of formatting and recovery are not saved
+  allocator_.set_undo(nullptr);
+  undo_hook_ = [this](uint32_t offset, uint32_t len) {
+    SaveUndo(offset, len);
+  };
+  // Reported again by the children
+  memset(log().acks, 0, sizeof(log().acks));
+  if (recover) {
+    // Operations committed by the log are redone, and the writes in place
+    // of those that are not are rolled back. Recovery is not replicated,
+    // backups are reattached as well. Operation records are stored by a
+    // backup through the index, which is rebuilt first.
+    if (kOpLogReplication && is_backup) {
+      RollBack();
+      Recover(num_recovery_threads);
+      recovery_stats_.num_redone_records = Apply();
+    } else {
+      recovery_stats_.num_redone_records = Apply();
+      RollBack();
+      Recover(num_recovery_threads);
+    }
+  } else {
+    allocator_.Format(static_cast<Allocator::Engine>(kAllocatorEngine));
+    hash_table_.Format();
+    // Records left on the device must not be taken as valid
+    memset(&log(), 0, sizeof(NVMLog));
+    Persist(&log(), sizeof(NVMLog));
+    for (uint32_t i = 0; i < kNumUndoLogs; ++i) {
+      undo_log(i).pos = NVMUndoLog::kNoRecord;
+      undo_log(i).len = 0;
+      Persist(&undo_log(i), offsetof(NVMUndoLog, images));
+    }
+  }
+  if (kCacheMode) {
+    auto n = allocator_.size() / kMinObjectAlign / 64;
+    access_bits_.reset(new std::atomic<uint64_t>[n]);
+    for (uint32_t i = 0; i < n; ++i) {
+      access_bits_[i] = 0;
+    }
+  }
+  if (qps_.empty()) {
+    return;
+  }
+  ib_.reset(new Infiniband());
+
   // Memory region
   // FIXME(wgtdkp): how to simulate latency of RDMA read/write to NVM?
-  mr_ = ibv_reg_mr(ib_.pd(), nvm_tablet_.ptr(), kNVMTabletSize,
-                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+  mr_ = ibv_reg_mr(ib_->pd(), nvm_tablet_.ptr(),
+                   NVMTablet::GetSize(allocator_.size()),
+                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                   IBV_ACCESS_REMOTE_READ);
   assert(mr_ != nullptr);
+  heads_mr_ = ibv_reg_mr(ib_->pd(), backup_heads_.data(),
+                         backup_heads_.size() * sizeof(uint64_t),
+                         IBV_ACCESS_LOCAL_WRITE);
+  assert(heads_mr_ != nullptr);
+  if (kOpLogReplication && !is_backup) {
+    // The log of the master is not of the positions that backups know
+    lsn_.store(0, std::memory_order_release);
+    op_ring_.reset(new char[NVMLog::kSize]);
+    op_ring_mr_ = ibv_reg_mr(ib_->pd(), op_ring_.get(), NVMLog::kSize, 0);
+    assert(op_ring_mr_ != nullptr);
+  }
 
-  for (size_t i = 0; i < kNumReplicas; ++i) {
-    qps_[i] = new Infiniband::QueuePair(ib_, IBV_QPT_RC,
+  info_.qpis.resize(qps_.size());
+  for (size_t i = 0; i < qps_.size(); ++i) {
+    qps_[i] = new Infiniband::QueuePair(*ib_, IBV_QPT_RC,
         kMaxIBQueueDepth, kMaxIBQueueDepth);
     //qps_[i]->Plumb();
     info_.qpis[i] = {
-      ib_.GetLid(Infiniband::kPort),
+      ib_->GetLid(Infiniband::kPort),
       qps_[i]->GetLocalQPNum(),
       Infiniband::QueuePair::kDefaultPsn,
       mr_->rkey,
@@ -35,201 +108,1332 @@ Tablet::Tablet(const IndexManager& index_manager,
   }
 }
 
+/*
+ * Buckets of the index are split into ranges scanned concurrently, which
+ * mark blocks of the objects, their chunks and overflow buckets live in a
+ * bitmap. Then the arena is walked by the allocator, which has to follow
+ * the sizes of blocks one by one, to free the blocks not marked.
+ */
+void Tablet::Recover(uint32_t num_threads) {
+  ModificationList modifications;
+  allocator_.set_modifications(&modifications);
+  allocator_.set_undo(nullptr);
+  hash_table_.Reload();
+
+  // Bit `i` for the block at `i * 16`, as the bitmap of `Touch`
+  auto n = allocator_.size() / kMinObjectAlign / 64;
+  std::unique_ptr<std::atomic<uint64_t>[]> live(new std::atomic<uint64_t>[n]);
+  for (uint32_t i = 0; i < n; ++i) {
+    live[i] = 0;
+  }
+  auto mark = [&live](uint32_t ptr) {
+    live[ptr / kMinObjectAlign / 64].fetch_or(
+        static_cast<uint64_t>(1) << (ptr / kMinObjectAlign % 64),
+        std::memory_order_relaxed);
+  };
+  std::atomic<uint32_t> num_objects {0};
+  std::atomic<uint64_t> num_bytes {0};
+  auto scan = [&](uint32_t begin, uint32_t end) {
+    uint32_t objects = 0;
+    uint64_t bytes = 0;
+    hash_table_.Scan(begin, end, [&](uint32_t obj) {
+      mark(obj);
+      auto chunk = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(obj, next));
+      for (uint32_t i = 0; chunk != 0 && chunk < allocator_.size() &&
+           i <= kMaxValueSize / kMaxChunkDataLen; ++i) {
+        mark(chunk);
+        chunk = allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, next));
+      }
+      auto key_len = allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(obj, key_len));
+      ++objects;
+      bytes += key_len + ReadValue(obj, key_len, nullptr, 0);
+    }, mark);
+    num_objects += objects;
+    num_bytes += bytes;
+  };
+
+  num_threads = std::max(num_threads, static_cast<uint32_t>(1));
+  auto num_buckets = hash_table_.num_buckets();
+  auto step = (num_buckets + num_threads - 1) / num_threads;
+  std::vector<std::thread> scanners;
+  for (uint32_t begin = step; begin < num_buckets; begin += step) {
+    scanners.emplace_back(scan, begin, std::min(begin + step, num_buckets));
+  }
+  scan(0, std::min(step, num_buckets));
+  for (auto& scanner : scanners) {
+    scanner.join();
+  }
+
+  recovery_stats_.num_objects = num_objects;
+  recovery_stats_.num_bytes = num_bytes;
+  auto is_live = [&live](uint32_t ptr) {
+    return (live[ptr / kMinObjectAlign / 64].load(std::memory_order_relaxed) >>
+            (ptr / kMinObjectAlign % 64) & 1) != 0;
+  };
+  if (!allocator_.Recover(is_live, &recovery_stats_.num_leaked_blocks)) {
+    NVDS_ERR("corrupted arena of tablet, the free lists are not rebuilt");
+  }
+  Persist(modifications);
+  allocator_.set_modifications(nullptr);
+}
+
 Tablet::~Tablet() {
-  for (ssize_t i = kNumReplicas - 1; i >= 0; --i) {
+  if (undo_ref_.tablet == this) {
+    undo_ref_.tablet = nullptr;
+  }
+  allocator_.set_undo(nullptr);
+  for (ssize_t i = qps_.size() - 1; i >= 0; --i) {
     delete qps_[i];
   }
-  int err = ibv_dereg_mr(mr_);
-  assert(err == 0);
+  for (auto mr : {heads_mr_, mr_, op_ring_mr_}) {
+    if (mr != nullptr) {
+      int err = ibv_dereg_mr(mr);
+      assert(err == 0);
+    }
+  }
 }
 
 Status Tablet::Put(const Request* r, ModificationList& modifications) {
-  allocator_.set_modifications(&modifications);
+  Begin(modifications);
 
   assert(r->type == Request::Type::PUT);
-  auto idx = r->key_hash % kHashTableSize;
-  uint32_t slot = offsetof(NVMTablet, hash_table) + sizeof(uint32_t) * idx;
-  auto head = allocator_.Read<uint32_t>(slot);
-  auto q = slot, p = head;
-  while (p) {
-    if (r->key_len != allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, key_len)) ||
-        allocator_.Memcmp(OFFSETOF_NVMOBJECT(p, data), r->Key(), r->key_len)) {
-      q = p;
-      p = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next));
-      continue;
+  Status status;
+  {
+    HashTable::BucketGuard guard(hash_table_, r->key_hash);
+    auto c = Find(r);
+    status = Store(c, r->Key(), r->key_len, r->key_hash, r->Val(),
+                   r->val_len, NextVersion(c), ToExpire(r->ttl));
+  }
+  hash_table_.Resize();
+  return status;
+}
+
+Status Tablet::Add(const Request* r, ModificationList& modifications) {
+  Begin(modifications);
+
+  assert(r->type == Request::Type::ADD);
+  Status status;
+  {
+    HashTable::BucketGuard guard(hash_table_, r->key_hash);
+    auto c = Find(r);
+    if (c.obj != 0) {
+      // There is already the same key, return Status::ERROR.
+      return Status::ERROR;
     }
-    // There is already the same key, overwrite it.
-    if (r->val_len < allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, val_len))) {
-      // The new value is shorter than the older, store data at its original place.
-      allocator_.Write(OFFSETOF_NVMOBJECT(p, val_len), r->val_len);
-      allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data) + r->key_len, r->Val(), r->val_len);
-    } else {
-      auto next = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next));
-      allocator_.Free(p);
-      auto size = sizeof(NVMObject) + r->key_len + r->val_len;
-      p = allocator_.Alloc(size);
-      // TODO(wgtdkp): handle the situation: `no space`.
-      assert(p != 0);
-      allocator_.Write<NVMObject>(p, {next, r->key_len, r->val_len, r->key_hash});
-      allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data), r->data, r->key_len + r->val_len);
-      allocator_.Write(OFFSETOF_NVMOBJECT(q, next), p);
+    status = Store(c, r->Key(), r->key_len, r->key_hash, r->Val(),
+                   r->val_len, NextVersion(c), ToExpire(r->ttl));
+  }
+  hash_table_.Resize();
+  return status;
+}
+
+// Get does not hold the bucket, it could be served by any number of
+// workers concurrently with modifications of the same tablet.
+Status Tablet::Get(Response* resp, const Request* r, uint32_t max_val_len,
+                   ModificationList& modifications) {
+  allocator_.set_modifications(&modifications);
+
+  assert(r->type == Request::Type::GET);
+  return ReadApplied([this, resp, r, max_val_len](uint64_t lsn) {
+    // An expired object is hidden, and reclaimed by writers or `Sweep`
+    bool expired = false;
+    bool found = hash_table_.Lookup(r->key_hash, r->Key(), r->key_len,
+        [this, resp, r, max_val_len, &expired](uint32_t p) {
+      // The object may be modified concurrently, the lookup will be retried.
+      expired = IsExpired(p);
+      if (expired) {
+        return;
+      }
+      resp->val_len = ReadValue(p, r->key_len, resp->val, max_val_len);
+      Touch(p);
+      resp->version = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, version));
+    });
+    resp->lsn = lsn;
+    return found && !expired ? Status::OK : Status::ERROR;
+  });
+}
+
+Status Tablet::Get(std::vector<char>& resp, const Request* r) {
+  assert(r->type == Request::Type::GET);
+  return ReadApplied([this, &resp, r](uint64_t lsn) {
+    bool expired = false;
+    bool found = hash_table_.Lookup(r->key_hash, r->Key(), r->key_len,
+        [this, &resp, r, &expired](uint32_t p) {
+      expired = IsExpired(p);
+      if (expired) {
+        return;
+      }
+      auto len = ReadValue(p, r->key_len, nullptr, 0);
+      resp.resize(sizeof(Response) + len);
+      auto head = Response::New(resp.data(), Request::Type::GET, Status::OK);
+      head->val_len = std::min(ReadValue(p, r->key_len, head->val, len), len);
+      head->version = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, version));
+    });
+    if (!found || expired) {
+      return Status::ERROR;
     }
+    reinterpret_cast<Response*>(resp.data())->lsn = lsn;
     return Status::OK;
-  }
+  });
+}
 
-  auto size = sizeof(NVMObject) + r->key_len + r->val_len;
-  p = allocator_.Alloc(size);
-  // TODO(wgtdkp): handle the situation: `no space`.
-  assert(p != 0);
-  // TODO(wgtdkp): use single `memcpy`
-  allocator_.Write<NVMObject>(p, {head, r->key_len, r->val_len, r->key_hash});
-  allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data), r->data, r->key_len + r->val_len);
-  // Insert the new item to head of the bucket list
-  allocator_.Write(slot, p);
+Status Tablet::Del(const Request* r, ModificationList& modifications) {
+  Begin(modifications);
+
+  assert(r->type == Request::Type::DEL);
+  {
+    HashTable::BucketGuard guard(hash_table_, r->key_hash);
+    auto c = Find(r);
+    if (c.obj == 0) {
+      return Status::ERROR;
+    }
+    Erase(c);
+  }
+  hash_table_.Resize();
   return Status::OK;
 }
 
-Status Tablet::Add(const Request* r, ModificationList& modifications) {
-  allocator_.set_modifications(&modifications);
+// The longest decimal number of `uint64_t` has 20 digits
+static const uint32_t kMaxNumberLen = 20;
 
-  assert(r->type == Request::Type::ADD);
-  auto idx = r->key_hash % kHashTableSize;
-  uint32_t slot = offsetof(NVMTablet, hash_table) + sizeof(uint32_t) * idx;
-  auto head = allocator_.Read<uint32_t>(slot);
-  auto p = head;
-  while (p) {
-    if (r->key_len != allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, key_len)) ||
-        allocator_.Memcmp(OFFSETOF_NVMOBJECT(p, data), r->Key(), r->key_len)) {
-      p = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next));
-      continue;
+static bool ParseNumber(const char* str, uint32_t len, uint64_t* num) {
+  if (len == 0 || len > kMaxNumberLen) {
+    return false;
+  }
+  uint64_t ans = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    if (str[i] < '0' || str[i] > '9') {
+      return false;
+    }
+    uint64_t digit = str[i] - '0';
+    if (ans > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    ans = ans * 10 + digit;
+  }
+  *num = ans;
+  return true;
+}
+
+Status Tablet::Incr(Response* resp, const Request* r,
+                    ModificationList& modifications) {
+  Begin(modifications);
+
+  assert(r->type == Request::Type::INCR || r->type == Request::Type::DECR);
+  if (r->val_len != sizeof(uint64_t)) {
+    return Status::ERROR;
+  }
+  uint64_t delta;
+  memcpy(&delta, r->Val(), sizeof(delta));
+  Status status;
+  {
+    HashTable::BucketGuard guard(hash_table_, r->key_hash);
+    auto c = Find(r);
+    uint64_t num = 0;
+    if (c.obj != 0) {
+      char buf[kMaxNumberLen];
+      auto len = ReadValue(c.obj, r->key_len, buf, sizeof(buf));
+      if (!ParseNumber(buf, len, &num)) {
+        return Status::ERROR;
+      }
     }
-    // There is already the same key, return Status::ERROR.    
+    if (r->type == Request::Type::INCR) {
+      num += delta;
+    } else {
+      num = num > delta ? num - delta : 0;
+    }
+    auto val = std::to_string(num);
+    auto version = NextVersion(c);
+    status = Store(c, r->Key(), r->key_len, r->key_hash,
+                   val.c_str(), val.size(), version, GetExpire(c));
+    if (status == Status::OK) {
+      memcpy(resp->val, val.c_str(), val.size());
+      resp->val_len = val.size();
+      resp->version = version;
+    }
+  }
+  hash_table_.Resize();
+  return status;
+}
+
+Status Tablet::Cas(Response* resp, const Request* r,
+                   ModificationList& modifications) {
+  Begin(modifications);
+
+  assert(r->type == Request::Type::CAS);
+  if (r->val_len < sizeof(uint32_t)) {
     return Status::ERROR;
   }
+  uint32_t expected;
+  memcpy(&expected, r->Val(), sizeof(expected));
 
-  auto size = sizeof(NVMObject) + r->key_len + r->val_len;
-  p = allocator_.Alloc(size);
-  // TODO(wgtdkp): handle the situation: `no space`.
+  HashTable::BucketGuard guard(hash_table_, r->key_hash);
+  auto c = Find(r);
+  if (c.obj == 0) {
+    return Status::ERROR;
+  }
+  resp->version = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(c.obj, version));
+  if (resp->version != expected) {
+    return Status::MISMATCH;
+  }
+  auto version = NextVersion(c);
+  auto status = Overwrite(c, r->Key(), r->key_len, r->key_hash,
+                          r->Val() + sizeof(uint32_t),
+                          r->val_len - sizeof(uint32_t),
+                          version, GetExpire(c));
+  if (status == Status::OK) {
+    resp->version = version;
+  }
+  return status;
+}
+
+Status Tablet::Append(Response* resp, const Request* r,
+                      ModificationList& modifications) {
+  Begin(modifications);
+
+  assert(r->type == Request::Type::APPEND);
+  Status status;
+  {
+    HashTable::BucketGuard guard(hash_table_, r->key_hash);
+    auto c = Find(r);
+    uint32_t len = 0;
+    if (c.obj != 0) {
+      len = ReadValue(c.obj, r->key_len, nullptr, 0);
+    }
+    if (len + r->val_len > kMaxValueSize) {
+      return Status::ERROR;
+    }
+    // The value is rebuilt as a whole, so that it is
+    // replaced all at once if it moves to a new object.
+    std::vector<char> val(len + r->val_len);
+    if (len > 0) {
+      ReadValue(c.obj, r->key_len, val.data(), len);
+    }
+    memcpy(val.data() + len, r->Val(), r->val_len);
+    auto version = NextVersion(c);
+    status = Store(c, r->Key(), r->key_len, r->key_hash,
+                   val.data(), val.size(), version, GetExpire(c));
+    if (status == Status::OK) {
+      resp->version = version;
+    }
+  }
+  hash_table_.Resize();
+  return status;
+}
+
+HashTable::Cursor Tablet::Find(const Request* r) {
+  auto c = hash_table_.Find(r->key_hash, r->Key(), r->key_len);
+  if (c.obj != 0 && IsExpired(c.obj)) {
+    Erase(c);
+    return {0, 0, 0};
+  }
+  return c;
+}
+
+Status Tablet::Overwrite(const HashTable::Cursor& c, const char* key,
+                         uint16_t key_len, KeyHash key_hash,
+                         const char* val, uint32_t val_len,
+                         uint32_t version, uint32_t expire) {
+  auto p = c.obj;
   assert(p != 0);
-  // TODO(wgtdkp): use single `memcpy`
-  allocator_.Write<NVMObject>(p, {head, r->key_len, r->val_len, r->key_hash});
-  allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data), r->data, r->key_len + r->val_len);
-  // Insert the new item to head of the bucket list
-  allocator_.Write(slot, p);
+  if (key_len + val_len <= kMaxItemSize &&
+      allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next)) == 0 &&
+      val_len <= allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, val_len))) {
+    // The new value is not longer than the older, store data at its original place.
+    allocator_.Write(OFFSETOF_NVMOBJECT(p, val_len),
+                     static_cast<uint16_t>(val_len));
+    allocator_.Write(OFFSETOF_NVMOBJECT(p, version), version);
+    if (expire != GetExpire(c)) {
+      allocator_.Write(OFFSETOF_NVMOBJECT(p, expire), expire);
+    }
+    allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data) + key_len, val, val_len);
+    Touch(p);
+    RecordSet(key, key_len, key_hash, val, val_len, version, expire);
+    return Status::OK;
+  }
+  // The older is freed after the new one is referenced,
+  // so that a large value is replaced all at once.
+  auto q = NewObject(key, key_len, key_hash, val, val_len, version, expire);
+  if (q == 0) {
+    return Status::NO_MEM;
+  }
+  hash_table_.Replace(c, q);
+  FreeObject(p);
+  RecordSet(key, key_len, key_hash, val, val_len, version, expire);
   return Status::OK;
 }
 
-Status Tablet::Get(Response* resp, const Request* r,
-                   ModificationList& modifications) {
-  allocator_.set_modifications(&modifications);
+Status Tablet::Store(const HashTable::Cursor& c, const char* key,
+                     uint16_t key_len, KeyHash key_hash,
+                     const char* val, uint32_t val_len,
+                     uint32_t version, uint32_t expire) {
+  if (c.obj != 0) {
+    // There is already the same key, overwrite it.
+    return Overwrite(c, key, key_len, key_hash, val, val_len,
+                     version, expire);
+  }
+  auto p = NewObject(key, key_len, key_hash, val, val_len, version, expire);
+  if (p == 0) {
+    return Status::NO_MEM;
+  }
+  // There may be no space for an overflow bucket
+  while (!hash_table_.Insert(key_hash, p)) {
+    if (!kCacheMode || !Evict()) {
+      FreeObject(p);
+      return Status::NO_MEM;
+    }
+  }
+  RecordSet(key, key_len, key_hash, val, val_len, version, expire);
+  return Status::OK;
+}
 
-  assert(r->type == Request::Type::GET);
-  auto idx = r->key_hash % kHashTableSize;
-  auto p = offsetof(NVMTablet, hash_table) + sizeof(uint32_t) * idx;
-  p = allocator_.Read<uint32_t>(p);
-  while (p) {
-    // TODO(wgtdkp): use a different hash to speedup searching
-    if (r->key_len == allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, key_len)) &&
-        allocator_.Memcmp(OFFSETOF_NVMOBJECT(p, data), r->Key(), r->key_len) == 0) {
-      auto len = allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, val_len));
-      allocator_.Memcpy(resp->val, OFFSETOF_NVMOBJECT(p, data) + r->key_len, len);
-      resp->val_len = len;
-      return Status::OK;
+uint32_t Tablet::NewObject(const char* key, uint16_t key_len,
+                           KeyHash key_hash, const char* val,
+                           uint32_t val_len, uint32_t version,
+                           uint32_t expire) {
+  uint32_t chunks = 0;
+  if (key_len + val_len > kMaxItemSize) {
+    chunks = NewChunks(val, val_len);
+    if (chunks == 0) {
+      return 0;
     }
-    p = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next));
+    val_len = 0;
+  }
+  auto p = Alloc(sizeof(NVMObject) + key_len + val_len);
+  if (p == 0) {
+    FreeChunks(chunks);
+    return 0;
+  }
+  allocator_.Write<NVMObject>(p, {chunks, key_len,
+      static_cast<uint16_t>(val_len), key_hash, version, expire});
+  allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data), key, key_len);
+  if (val_len > 0) {
+    allocator_.Memcpy(OFFSETOF_NVMOBJECT(p, data) + key_len, val, val_len);
   }
-  return Status::ERROR;
+  Touch(p);
+  return p;
 }
 
-Status Tablet::Del(const Request* r, ModificationList& modifications) {
-  allocator_.set_modifications(&modifications);
+// Chunks are written from the tail, each is linked to the chain once written.
+uint32_t Tablet::NewChunks(const char* val, uint32_t len) {
+  uint32_t head = 0;
+  auto num_chunks = (len + kMaxChunkDataLen - 1) / kMaxChunkDataLen;
+  for (uint32_t i = num_chunks; i > 0; --i) {
+    auto begin = (i - 1) * kMaxChunkDataLen;
+    auto n = std::min(len - begin, kMaxChunkDataLen);
+    auto chunk = Alloc(sizeof(NVMChunk) + n);
+    if (chunk == 0) {
+      FreeChunks(head);
+      return 0;
+    }
+    allocator_.Write<NVMChunk>(chunk, {head, n});
+    allocator_.Memcpy(chunk + offsetof(NVMChunk, data), val + begin, n);
+    head = chunk;
+  }
+  return head;
+}
 
-  assert(r->type == Request::Type::DEL);
-  auto idx = r->key_hash % kHashTableSize;
-  auto q = offsetof(NVMTablet, hash_table) + sizeof(uint32_t) * idx;
-  auto p = allocator_.Read<uint32_t>(q);
-  while (p) {
-    if (r->key_len == allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(p, key_len)) &&
-        allocator_.Memcmp(OFFSETOF_NVMOBJECT(p, data), r->Key(), r->key_len) == 0) {
-      auto next = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(p, next));
-      allocator_.Write(OFFSETOF_NVMOBJECT(q, next), next);
-      allocator_.Free(p);
-      return Status::OK;
+uint32_t Tablet::Alloc(uint32_t size) {
+  auto p = allocator_.Alloc(size);
+  // Freed blocks may not merge into one large enough at once
+  while (p == 0 && kCacheMode && Evict()) {
+    p = allocator_.Alloc(size);
+  }
+  return p;
+}
+
+/*
+ * The CLOCK hand sweeps the buckets of the index. An object accessed since
+ * the last sweep gets a second chance, its access bit is cleared; otherwise
+ * it is erased. Buckets held by others (including the one held by the
+ * caller) are skipped. Evictions are replicated as other modifications.
+ * The caller holds its bucket meanwhile, so the hand moves at most
+ * `kMaxEvictBuckets` at a time; objects given a second chance are
+ * evicted by the calls that follow, if they are not accessed again. The
+ * tablet is taken as empty once the hand passes two rounds of buckets
+ * without finding an object.
+ */
+bool Tablet::Evict() {
+  std::lock_guard<Spinlock> _(evict_lock_);
+  uint32_t num_evicts = 0;
+  uint32_t num_spared = 0;
+  auto num_buckets = hash_table_.num_buckets();
+  for (uint32_t i = 0; i < kMaxEvictBuckets &&
+                       num_evicts < kMaxEvictsPerRound; ++i) {
+    auto idx = clock_hand_++ % num_buckets;
+    hash_table_.VisitBucket(idx,
+        [this, &num_evicts, &num_spared](const HashTable::Cursor& c) {
+      if (!Untouch(c.obj) || IsExpired(c.obj)) {
+        Erase(c);
+        ++num_evicts;
+      } else {
+        ++num_spared;
+      }
+    });
+  }
+  if (num_evicts > 0 || num_spared > 0) {
+    num_idle_buckets_ = 0;
+  } else {
+    num_idle_buckets_ += kMaxEvictBuckets;
+  }
+  return num_evicts > 0 || num_idle_buckets_ < 2 * num_buckets;
+}
+
+uint32_t Tablet::Sweep(ModificationList& modifications) {
+  Begin(modifications);
+
+  uint32_t num_reclaimed = 0;
+  auto num_buckets = hash_table_.num_buckets();
+  for (uint32_t i = 0; i < kNumSweepBuckets; ++i) {
+    auto idx = sweep_hand_.fetch_add(1, std::memory_order_relaxed) %
+               num_buckets;
+    hash_table_.VisitBucket(idx,
+        [this, &num_reclaimed](const HashTable::Cursor& c) {
+      if (IsExpired(c.obj)) {
+        Erase(c);
+        ++num_reclaimed;
+      }
+    });
+  }
+  if (num_reclaimed > 0) {
+    hash_table_.Resize();
+  }
+  return num_reclaimed;
+}
+
+/*
+ * An object is relocated by copying it to a new block, and patching the
+ * slot of its bucket, which is the only reference to it; a chunk, by
+ * patching the object or chunk before it in the chain. Both are recorded
+ * writes, so the relocation is committed by the log atomically, and
+ * replicated as other modifications. The first pass over the index, and
+ * one of each `kNumPassesPerLog` after it, is logged with the
+ * fragmentation of the arena. For the log engine, this is the
+ * cleaner of segments.
+ */
+uint32_t Tablet::Compact(ModificationList& modifications) {
+  if (!allocator_.Fragmented()) {
+    return 0;
+  }
+  Begin(modifications);
+
+  uint32_t num_moved = 0;
+  auto num_buckets = hash_table_.num_buckets();
+  for (uint32_t i = 0; i < kNumCompactBuckets; ++i) {
+    auto idx = compact_hand_.fetch_add(1, std::memory_order_relaxed) %
+               num_buckets;
+    hash_table_.VisitBucket(idx,
+        [this, &num_moved](const HashTable::Cursor& c) {
+      num_moved += Move(c);
+    });
+    if (idx == num_buckets - 1) {
+      auto passes = num_compaction_passes_.fetch_add(1) + 1;
+      // The arena is walked for the stats, under the lock of the allocator
+      if ((passes - 1) % kNumPassesPerLog != 0) {
+        continue;
+      }
+      auto stats = allocator_.GetStats();
+      NVDS_LOG("tablet %" PRIu32 ": compaction pass %" PRIu64 ", %" PRIu64
+               " objects moved, %" PRIu32 " free blocks, fragmentation %.2f",
+               info_.id, passes, num_moved_objects_.load(),
+               stats.num_free_blocks, stats.fragmentation());
+    }
+  }
+  return num_moved;
+}
+
+bool Tablet::Move(const HashTable::Cursor& c) {
+  bool moved = false;
+  // `pred` is the word that refers to `chunk`
+  uint32_t pred = OFFSETOF_NVMOBJECT(c.obj, next);
+  auto chunk = allocator_.Read<uint32_t>(pred);
+  while (chunk != 0) {
+    auto next = allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, next));
+    uint32_t size = sizeof(NVMChunk) +
+        allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, len));
+    auto p = Relocate(chunk, size);
+    if (p != 0) {
+      allocator_.Write(pred, p);
+      chunk = p;
+      moved = true;
+    }
+    pred = chunk + offsetof(NVMChunk, next);
+    chunk = next;
+  }
+
+  uint32_t size = sizeof(NVMObject) +
+      allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(c.obj, key_len)) +
+      allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(c.obj, val_len));
+  auto p = Relocate(c.obj, size);
+  if (p == 0) {
+    return moved;
+  }
+  hash_table_.Replace(c, p);
+  if (kCacheMode && Untouch(c.obj)) {
+    Touch(p);
+  }
+  return true;
+}
+
+uint32_t Tablet::Relocate(uint32_t ptr, uint32_t size) {
+  if (!allocator_.ShouldMove(ptr, size)) {
+    return 0;
+  }
+  // Never evicts for a relocation
+  auto p = allocator_.AllocForRelocation(size);
+  if (p == 0) {
+    return 0;
+  }
+  allocator_.Memcpy(p, ptr, size);
+  allocator_.Free(ptr);
+  num_moved_objects_.fetch_add(1, std::memory_order_relaxed);
+  num_moved_bytes_.fetch_add(size, std::memory_order_relaxed);
+  return p;
+}
+
+void Tablet::Erase(const HashTable::Cursor& c) {
+  hash_table_.Erase(c);
+  if (kOpLogReplication && !info_.is_backup) {
+    auto key_len = allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(c.obj, key_len));
+    std::lock_guard<Spinlock> _(op_lock_);
+    auto op = AddOperation(Operation::Type::DEL, key_len, 0);
+    op->key_hash = allocator_.Read<KeyHash>(OFFSETOF_NVMOBJECT(c.obj, key_hash));
+    allocator_.Memcpy(const_cast<char*>(op->key()),
+                      OFFSETOF_NVMOBJECT(c.obj, data), key_len);
+  }
+  FreeObject(c.obj);
+}
+
+void Tablet::RecordSet(const char* key, uint16_t key_len, KeyHash key_hash,
+                       const char* val, uint32_t val_len,
+                       uint32_t version, uint32_t expire) {
+  if (!kOpLogReplication || info_.is_backup) {
+    return;
+  }
+  std::lock_guard<Spinlock> _(op_lock_);
+  auto op = AddOperation(Operation::Type::SET, key_len, val_len);
+  op->key_hash = key_hash;
+  op->version = version;
+  op->expire = expire;
+  memcpy(const_cast<char*>(op->key()), key, key_len);
+  memcpy(const_cast<char*>(op->val()), val, val_len);
+}
+
+Operation* Tablet::AddOperation(Operation::Type type, uint16_t key_len,
+                                uint32_t val_len) {
+  auto offset = operations_.size();
+  operations_.resize(offset + Operation::Len(key_len, val_len));
+  auto op = reinterpret_cast<Operation*>(&operations_[offset]);
+  *op = {type, 0, key_len, val_len, 0, 0, 0};
+  ++num_operations_;
+  return op;
+}
+
+void Tablet::FreeObject(uint32_t obj) {
+  FreeChunks(allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(obj, next)));
+  allocator_.Free(obj);
+}
+
+void Tablet::FreeChunks(uint32_t chunk) {
+  while (chunk != 0) {
+    auto next = allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, next));
+    allocator_.Free(chunk);
+    chunk = next;
+  }
+}
+
+uint32_t Tablet::ReadValue(uint32_t obj, uint16_t key_len,
+                           char* val, uint32_t max_len) {
+  auto chunk = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(obj, next));
+  if (chunk == 0) {
+    uint32_t len = allocator_.Read<uint16_t>(OFFSETOF_NVMOBJECT(obj, val_len));
+    len = std::min(len, kMaxItemSize);
+    if (max_len > 0) {
+      allocator_.Memcpy(val, OFFSETOF_NVMOBJECT(obj, data) + key_len,
+                        std::min(len, max_len));
     }
+    return len;
   }
-  return Status::ERROR;
+  uint32_t len = 0;
+  // A chunk may end at the end of the arena
+  while (chunk != 0 && chunk + sizeof(NVMChunk) <= allocator_.size() &&
+         len < kMaxValueSize) {
+    auto n = std::min(allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, len)),
+                      std::min<uint32_t>(kMaxChunkDataLen, allocator_.size() -
+                          chunk - sizeof(NVMChunk)));
+    if (len < max_len) {
+      allocator_.Memcpy(val + len, chunk + offsetof(NVMChunk, data),
+                        std::min(n, max_len - len));
+    }
+    len += n;
+    chunk = allocator_.Read<uint32_t>(chunk + offsetof(NVMChunk, next));
+  }
+  return len;
 }
 
 void Tablet::SettingupQPConnect(TabletId id, const IndexManager& index_manager) {
   info_ = index_manager.GetTablet(id);
+  const auto& master = info_.is_backup ?
+      index_manager.GetTablet(info_.master) : info_;
+  assert(!master.is_backup);
+  auto replica = [&master](uint32_t r) {
+    return r == 0 ? master.id : master.backups[r - 1];
+  };
+  uint32_t self = 0;
+  while (replica(self) != id) {
+    ++self;
+    assert(self <= master.backups.size());
+  }
+
+  children_.clear();
+  child_forwards_.clear();
+  uint32_t num_replicas = master.backups.size();
+  for (auto r : GetChildReplicas(info_.topology, num_replicas, self)) {
+    children_.push_back(replica(r));
+    // A child that has children of its own reports to this one
+    child_forwards_.push_back(
+        !GetChildReplicas(info_.topology, num_replicas, r).empty());
+    assert(!child_forwards_.back() || children_.size() <= kTreeFanOut);
+  }
+  // Queue pairs of a backup: to its parent, then to its children
+  assert(children_.size() + (info_.is_backup ? 1 : 0) <= qps_.size());
   if (info_.is_backup) {
-    auto master_info = index_manager.GetTablet(info_.master);
-    assert(!master_info.is_backup);
-    for (uint32_t i = 0; i < kNumReplicas; ++i) {
-      if (master_info.backups[i] == id) {
-        qps_[0]->SetStateRTR(master_info.qpis[i]);
-        break;
-      }
-      assert(i < kNumReplicas - 1);
-    }
-  } else {
-    for (uint32_t i = 0; i < kNumReplicas; ++i) {
-      auto backup_id = info_.backups[i];
-      auto backup_info = index_manager.GetTablet(backup_id);
-      assert(backup_info.is_backup);
-      qps_[i]->SetStateRTS(backup_info.qpis[0]);
-    }
+    auto parent = GetParentReplica(info_.topology, self);
+    parent_ = replica(parent);
+    parent_slot_ = GetReplicaSlot(info_.topology, self);
+    auto parent_info = index_manager.GetTablet(parent_);
+    qps_[0]->SetStateRTS(parent_info.qpis[parent == 0 ? parent_slot_
+                                                       : parent_slot_ + 1]);
+  }
+  for (size_t k = 0; k < children_.size(); ++k) {
+    auto child_info = index_manager.GetTablet(children_[k]);
+    assert(child_info.is_backup);
+    ChildQP(k)->SetStateRTS(child_info.qpis[0]);
   }
 }
 
+/*
+ * The modifications of an operation, e.g. freeing the old object,
+ * allocating the new one and relinking the bucket, are written in place
+ * first, and then committed together by a record appended to the log:
+ *   1. the record is persisted, which is the commit point;
+ *   2. the writes in place are persisted;
+ *   3. the record is replicated to the backups by one RDMA write each,
+ *      and redone by them. With a chain or tree topology, the master
+ *      writes to its children only, and each backup writes on the
+ *      records it receives before redoing them; a backup reports how far
+ *      its subtree has redone to its parent, which counts the child as
+ *      replicated up to there. With `kRemoteFlush`, each batch of writes
+ *      is followed by a read that completes once they reach the
+ *      backup's memory.
+ * Each write in place is preceded by the image of the bytes before it,
+ * persisted to the undo log of the worker, so that writes evicted from
+ * cache before the commit point are rolled back on restart: a record
+ * that is not completely persisted is discarded, and the images of its
+ * writes restored in the reverse order of all writes not committed;
+ * while a complete one is redone. Writes to blocks allocated by the
+ * operations are not saved, the blocks are freed by the recovery scan.
+ */
 int Tablet::Sync(ModificationList& modifications) {
+  auto n = modifications.size();
+  auto end = Post(modifications);
+  while (Poll() < end) {}
+  return n > 0 && modifications.empty() ? -1 : 0;
+}
+
+uint64_t Tablet::Post(ModificationList& modifications) {
+  // Workers of this tablet share the log and the queue pairs
+  std::lock_guard<Spinlock> _(sync_lock_);
+  auto record = Commit(modifications);
+  if (kOpLogReplication) {
+    record = AppendOperations();
+  }
+  if (record == nullptr) {
+    return kOpLogReplication ? op_tail_ : log_tail_;
+  }
+
+  auto end = record->pos + record->len;
+  if (children_.empty()) {
+    lsn_.store(end, std::memory_order_release);
+    return end;
+  }
+  for (size_t k = 0; k < children_.size(); ++k) {
+    Forward(k, record);
+  }
+  tail_.store(end, std::memory_order_relaxed);
+  auto lsn = this->lsn();
+  if (end > lsn && end - lsn > max_lag_.load(std::memory_order_relaxed)) {
+    max_lag_.store(end - lsn, std::memory_order_relaxed);
+  }
+  return end;
+}
+
+void Tablet::Forward(uint32_t k, const ModificationLog* record) {
+  WaitForBackupLog(k, record->pos + record->len);
+  // Records that follow each other in the ring are written together
+  auto& ranges = unposted_[k];
+  if (!ranges.empty() && ranges.back().end() == record->pos &&
+      record->pos % NVMLog::kSize != 0) {
+    ranges.back().len += record->len;
+  } else {
+    ranges.push_back({record->pos, record->len});
+  }
+  PostRecords(k);
+}
+
+const ModificationLog* Tablet::Commit(ModificationList& modifications) {
   if (modifications.size() == 0) {
-    return 0;
+    return nullptr;
   }
   MergeModifications(modifications);
 
-  for (size_t k = 0; k < info_.backups.size(); ++k) {
-    auto backup = index_manager_.GetTablet(info_.backups[k]);
-    assert(backup.is_backup);
-    size_t i = 0;
-    for (const auto& m : modifications) {
-      sges[i] = {m.src, m.len, mr_->lkey};
-      
-      wrs[i].wr.rdma.remote_addr = backup.qpis[0].vaddr + m.des;
-      wrs[i].wr.rdma.rkey        = backup.qpis[0].rkey;
-      // TODO(wgtdkp): use unique id
-      wrs[i].wr_id               = 1;
-      wrs[i].sg_list             = &sges[i];
-      wrs[i].num_sge             = 1;
-      wrs[i].opcode              = IBV_WR_RDMA_WRITE;
-      // TODO(wgtdkp): do we really need to signal each send?
-      wrs[i].send_flags          = IBV_SEND_INLINE;
-      wrs[i].next                = &wrs[i+1];
-      ++i;
-      // DEBUG
-      break;
+  auto record = AppendLog(modifications);
+  if (record == nullptr) {
+    NVDS_ERR("too many modifications for the log: %zu", modifications.size());
+    Persist(modifications);
+    ReleaseUndoLog();
+    modifications.clear();
+    return nullptr;
+  }
+  Persist(record, record->len);
+  Persist(modifications);
+  // The writes are complete, they are not rolled back any more
+  ReleaseUndoLog();
+  return record;
+}
+
+const ModificationLog* Tablet::AppendOperations() {
+  // Taken by the record, so that workers are not held while it waits
+  uint32_t cnt;
+  {
+    std::lock_guard<Spinlock> _(op_lock_);
+    op_batch_.clear();
+    op_batch_.swap(operations_);
+    cnt = num_operations_;
+    num_operations_ = 0;
+  }
+  if (cnt == 0 || children_.empty()) {
+    return nullptr;
+  }
+  if (!op_tail_synced_) {
+    // Continue from where the backups are, after restart
+    for (size_t k = 0; k < children_.size(); ++k) {
+      ReadBackupHead(k);
+      op_tail_ = std::max(op_tail_, backup_heads_[k]);
     }
-    wrs[i-1].next = nullptr;
-    wrs[i-1].send_flags |= IBV_SEND_SIGNALED;
+    std::fill(replicated_.begin(), replicated_.end(), op_tail_);
+    lsn_.store(op_tail_, std::memory_order_release);
+    op_tail_synced_ = true;
+  }
 
-    struct ibv_send_wr* bad_wr;
-    int err = ibv_post_send(qps_[k]->qp, &wrs[0], &bad_wr);
-    if (err != 0) {
-      throw TransportException(HERE, "ibv_post_send failed", err);
+  uint64_t len = sizeof(ModificationLog) + op_batch_.size();
+  if (len > NVMLog::kSize) {
+    NVDS_ERR("too many operations for the log: %u", cnt);
+    return nullptr;
+  }
+  auto pos = AlignLog(op_tail_, len);
+  WaitForLog(pos + len);
+  auto record = reinterpret_cast<ModificationLog*>(
+      &op_ring_[pos % NVMLog::kSize]);
+  memcpy(record->positions, op_batch_.data(), op_batch_.size());
+  record->pos = pos;
+  record->len = len;
+  record->cnt = cnt;
+  record->checksum = Checksum(record);
+  op_tail_ = pos + len;
+  return record;
+}
+
+bool Tablet::PostRecords(uint32_t k) {
+  auto& ranges = unposted_[k];
+  if (ranges.empty()) {
+    return true;
+  }
+  if (num_inflight_[k] >= kMaxInflightRecords) {
+    return false;
+  }
+  auto backup = index_manager_.GetTablet(children_[k]);
+  assert(backup.is_backup);
+  auto qp = ChildQP(k);
+  auto n = std::min(ranges.size(),
+                    static_cast<size_t>(kMaxChainLen - (kRemoteFlush ? 1 : 0)));
+  for (size_t i = 0; i < n; ++i) {
+    auto offset = log_offset_ + offsetof(NVMLog, ring) +
+                  ranges[i].pos % NVMLog::kSize;
+    // A backup writes on the records in its log
+    if (kOpLogReplication && !info_.is_backup) {
+      sges_[i] = {reinterpret_cast<uint64_t>(
+                      &op_ring_[ranges[i].pos % NVMLog::kSize]),
+                  ranges[i].len, op_ring_mr_->lkey};
+    } else {
+      sges_[i] = {reinterpret_cast<uint64_t>(nvm_tablet_->data + offset),
+                  ranges[i].len, mr_->lkey};
+    }
+    wrs_[i] = {};
+    wrs_[i].wr.rdma.remote_addr = backup.qpis[0].vaddr + offset;
+    wrs_[i].wr.rdma.rkey        = backup.qpis[0].rkey;
+    wrs_[i].sg_list             = &sges_[i];
+    wrs_[i].num_sge             = 1;
+    wrs_[i].opcode              = IBV_WR_RDMA_WRITE;
+    // The HCA copies inline data when it is posted, instead of reading it
+    if (ranges[i].len <= qp->max_inline_data) {
+      wrs_[i].send_flags        = IBV_SEND_INLINE;
     }
+    wrs_[i].next                = i + 1 < n ? &wrs_[i + 1] : nullptr;
+  }
+  auto last = &wrs_[n - 1];
+  if (kRemoteFlush) {
+    // The read of the last bytes written is responded after the writes
+    // before it are placed in the backup's memory
+    sges_[n] = {reinterpret_cast<uint64_t>(&backup_heads_.back()),
+                sizeof(uint64_t), heads_mr_->lkey};
+    wrs_[n] = {};
+    wrs_[n].wr.rdma.remote_addr = last->wr.rdma.remote_addr +
+                                  sges_[n - 1].length - sizeof(uint64_t);
+    wrs_[n].wr.rdma.rkey        = backup.qpis[0].rkey;
+    wrs_[n].sg_list             = &sges_[n];
+    wrs_[n].num_sge             = 1;
+    wrs_[n].opcode              = IBV_WR_RDMA_READ;
+    last->next = &wrs_[n];
+    last = &wrs_[n];
+  }
+  // Only the last one of the chain is signaled. Completions of a queue
+  // pair are in order, the last one polled tells the end of the records
+  // replicated to the backup.
+  last->wr_id = ranges[n - 1].end();
+  last->send_flags |= IBV_SEND_SIGNALED;
+
+  struct ibv_send_wr* bad_wr;
+  int err = ibv_post_send(qp->qp, &wrs_[0], &bad_wr);
+  if (err != 0) {
+    throw TransportException(HERE, "ibv_post_send failed", err);
+  }
+  ++num_inflight_[k];
+  ranges.erase(ranges.begin(), ranges.begin() + n);
+  return ranges.empty();
+}
+
+uint64_t Tablet::Poll() {
+  // Another worker is polling, or posting
+  std::unique_lock<Spinlock> lock(sync_lock_, std::try_to_lock);
+  if (!lock.owns_lock() || children_.empty()) {
+    return lsn();
+  }
+  auto tail = kOpLogReplication ? op_tail_ : log_tail_;
+  auto end = tail;
+  uint64_t first = 0;
+  for (size_t k = 0; k < children_.size(); ++k) {
+    PollBackup(k);
+    PostRecords(k);
+    end = std::min(end, std::min(tail, GetAcked(k)));
+    // A child that writes records on has them once they are written to it
+    first = std::max(first, std::min(tail, GetUnwritten(k)));
   }
+  if (end > lsn()) {
+    lsn_.store(end, std::memory_order_release);
+  }
+  if (first > first_lsn_.load(std::memory_order_relaxed)) {
+    first_lsn_.store(first, std::memory_order_release);
+  }
+  return lsn();
+}
+
+uint64_t Tablet::GetReleasable() const {
+  if (children_.empty()) {
+    return lsn();
+  }
+  switch (info_.durability) {
+  case Durability::ONE:
+    return std::max(lsn(), first_lsn_.load(std::memory_order_acquire));
+  case Durability::LOCAL:
+    return lsn() + config.max_replication_lag;
+  default:
+    return lsn();
+  }
+}
 
-  for (auto& qp : qps_) {
-    ibv_wc wc;
-    int r;
-    while ((r = ibv_poll_cq(qp->scq, 1, &wc)) != 1) {}
-    if (wc.status != IBV_WC_SUCCESS) {
-      throw TransportException(HERE, wc.status);
+bool Tablet::PollBackup(uint32_t k) {
+  ibv_wc wcs[kMaxInflightRecords];
+  int n = ibv_poll_cq(ChildQP(k)->scq, kMaxInflightRecords, wcs);
+  if (n < 0) {
+    throw TransportException(HERE, "ibv_poll_cq failed", n);
+  }
+  bool head_read = false;
+  for (int i = 0; i < n; ++i) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      throw TransportException(HERE, wcs[i].status);
+    }
+    if (wcs[i].wr_id == kReadHeadId) {
+      head_read = true;
     } else {
-      // std::clog << "success" << std::endl << std::flush;
+      replicated_[k] = wcs[i].wr_id;
+      --num_inflight_[k];
+    }
+  }
+  return head_read;
+}
+
+void Tablet::Report() {
+  std::lock_guard<Spinlock> _(sync_lock_);
+  auto pos = log().head;
+  for (size_t k = 0; k < children_.size(); ++k) {
+    PollBackup(k);
+    PostRecords(k);
+    pos = std::min(pos, GetAcked(k));
+  }
+  ibv_wc wcs[kMaxInflightRecords];
+  int n = ibv_poll_cq(qps_[0]->scq, kMaxInflightRecords, wcs);
+  if (n < 0) {
+    throw TransportException(HERE, "ibv_poll_cq failed", n);
+  }
+  for (int i = 0; i < n; ++i) {
+    if (wcs[i].status != IBV_WC_SUCCESS) {
+      throw TransportException(HERE, wcs[i].status);
     }
   }
-  return 0;
+  num_reports_ -= n;
+  // A later report carries the position anyway
+  if (pos <= reported_ || num_reports_ >= kMaxInflightRecords) {
+    return;
+  }
+  reported_ = pos;
+
+  auto parent = index_manager_.GetTablet(parent_);
+  // Inline, the position is copied when it is posted
+  assert(qps_[0]->max_inline_data >= sizeof(reported_));
+  struct ibv_sge sge = {
+    reinterpret_cast<uint64_t>(&reported_), sizeof(reported_), 0
+  };
+  struct ibv_send_wr wr {};
+  wr.wr.rdma.remote_addr = parent.qpis[0].vaddr + log_offset_ +
+      offsetof(NVMLog, acks) + parent_slot_ * sizeof(uint64_t);
+  wr.wr.rdma.rkey = parent.qpis[0].rkey;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+
+  struct ibv_send_wr* bad_wr;
+  int err = ibv_post_send(qps_[0]->qp, &wr, &bad_wr);
+  if (err != 0) {
+    throw TransportException(HERE, "ibv_post_send failed", err);
+  }
+  ++num_reports_;
+}
+
+const ModificationLog* Tablet::AppendLog(
+    const ModificationList& modifications) {
+  uint64_t len = sizeof(ModificationLog);
+  for (const auto& m : modifications) {
+    len += Position::Len(m.len);
+  }
+  if (len > NVMLog::kSize) {
+    return nullptr;
+  }
+
+  auto& log = this->log();
+  auto pos = AlignLog(log_tail_, len);
+  // The ring of the master is what is written to the children
+  if (!kOpLogReplication) {
+    WaitForLog(pos + len);
+  }
+  // The persisted head must not be overwritten, or records after it
+  // would not be redone on restart. It is moved to the tail, as records
+  // before it are persisted with their writes in place, once half of the
+  // ring is behind it; redoing a record twice is harmless.
+  if (pos + len - persisted_head_ > NVMLog::kSize / 2) {
+    log.head = log_tail_;
+    Persist(&log.head, sizeof(log.head));
+    persisted_head_ = log_tail_;
+  }
+  // Before the record may be complete, which commits the writes saved
+  if (undo_ref_.tablet == this && undo_ref_.idx < kNumUndoLogs) {
+    auto& undo = undo_log(undo_ref_.idx);
+    undo.pos = pos;
+    Persist(&undo.pos, sizeof(undo.pos));
+  }
+
+  auto record = LogAt(pos);
+  auto p = record->positions;
+  for (const auto& m : modifications) {
+    p->offset = m.des;
+    p->len = m.len;
+    memcpy(p->data(), reinterpret_cast<const char*>(m.src), m.len);
+    p = reinterpret_cast<Position*>(
+        reinterpret_cast<char*>(p) + Position::Len(m.len));
+  }
+  record->pos = pos;
+  record->len = len;
+  record->cnt = modifications.size();
+  record->checksum = Checksum(record);
+  log_tail_ = pos + len;
+  return record;
+}
+
+const ModificationLog* Tablet::GetLog(uint64_t pos) {
+  for (auto p : {pos, pos - pos % NVMLog::kSize + NVMLog::kSize}) {
+    auto offset = p % NVMLog::kSize;
+    if (offset + sizeof(ModificationLog) > NVMLog::kSize) {
+      continue;
+    }
+    auto record = LogAt(p);
+    if (record->pos == p && record->len >= sizeof(ModificationLog) &&
+        offset + record->len <= NVMLog::kSize &&
+        record->checksum == Checksum(record)) {
+      return record;
+    }
+  }
+  return nullptr;
+}
+
+void Tablet::Redo(const ModificationLog* record) {
+  auto p = record->positions;
+  for (uint32_t i = 0; i < record->cnt; ++i) {
+    if (p->offset + p->len <= log_offset_) {
+      auto des = reinterpret_cast<char*>(nvm_tablet_.ptr()) + p->offset;
+      memcpy(des, p->data(), p->len);
+      Flush(des, p->len);
+    } else {
+      NVDS_ERR("invalid log entry: offset = %u, len = %u", p->offset, p->len);
+    }
+    p = reinterpret_cast<const Position*>(
+        reinterpret_cast<const char*>(p) + Position::Len(p->len));
+  }
+  Fence();
+}
+
+void Tablet::SaveUndo(uint32_t offset, uint32_t len) {
+  auto undo = GetUndoLog();
+  if (undo == nullptr) {
+    return;
+  }
+  auto n = UndoImage::Len(len);
+  if (undo->len + n > NVMUndoLog::kSize) {
+    if (!undo_ref_.full) {
+      NVDS_ERR("too many writes for the undo log: %" PRIu64 " bytes",
+               undo->len);
+      undo_ref_.full = true;
+    }
+    return;
+  }
+  auto image = reinterpret_cast<UndoImage*>(&undo->images[undo->len]);
+  image->seq = undo_seq_.fetch_add(1, std::memory_order_relaxed);
+  image->offset = offset;
+  image->len = len;
+  memcpy(image->data(), allocator_.OffsetToPtr<char>(offset), len);
+  // The image is persisted before it is counted, which is before the write
+  Persist(image, n);
+  undo->len += n;
+  Persist(&undo->len, sizeof(undo->len));
+}
+
+NVMUndoLog* Tablet::GetUndoLog() {
+  if (undo_ref_.tablet == this) {
+    return undo_ref_.idx < kNumUndoLogs ? &undo_log(undo_ref_.idx) : nullptr;
+  }
+  std::lock_guard<Spinlock> _(undo_lock_);
+  undo_ref_ = {this, 0, false};
+  while (undo_ref_.idx < kNumUndoLogs && undo_taken_[undo_ref_.idx]) {
+    ++undo_ref_.idx;
+  }
+  if (undo_ref_.idx == kNumUndoLogs) {
+    NVDS_ERR("no free undo log, writes are not saved until committed");
+    return nullptr;
+  }
+  undo_taken_[undo_ref_.idx] = true;
+  auto& undo = undo_log(undo_ref_.idx);
+  undo.pos = NVMUndoLog::kNoRecord;
+  Persist(&undo.pos, sizeof(undo.pos));
+  return &undo;
+}
+
+void Tablet::ReleaseUndoLog() {
+  allocator_.ForgetBlocks();
+  if (undo_ref_.tablet != this) {
+    return;
+  }
+  if (undo_ref_.idx < kNumUndoLogs) {
+    auto& undo = undo_log(undo_ref_.idx);
+    undo.len = 0;
+    Persist(&undo.len, sizeof(undo.len));
+    std::lock_guard<Spinlock> _(undo_lock_);
+    undo_taken_[undo_ref_.idx] = false;
+  }
+  undo_ref_.tablet = nullptr;
+}
+
+void Tablet::RollBack() {
+  std::vector<const UndoImage*> images;
+  for (uint32_t i = 0; i < kNumUndoLogs; ++i) {
+    auto& undo = undo_log(i);
+    auto record = undo.pos == NVMUndoLog::kNoRecord ? nullptr :
+                  GetLog(undo.pos);
+    if (record != nullptr && record->pos == undo.pos) {
+      // Committed, and redone
+      continue;
+    }
+    auto len = std::min(undo.len, static_cast<uint64_t>(NVMUndoLog::kSize));
+    for (uint64_t p = 0; p + sizeof(UndoImage) <= len; ) {
+      auto image = reinterpret_cast<const UndoImage*>(&undo.images[p]);
+      p += UndoImage::Len(image->len);
+      if (p > len || image->offset + image->len > log_offset_) {
+        NVDS_ERR("invalid undo image: offset = %u, len = %u",
+                 image->offset, image->len);
+        break;
+      }
+      images.push_back(image);
+    }
+  }
+  std::sort(images.begin(), images.end(),
+            [](const UndoImage* lhs, const UndoImage* rhs) {
+    return lhs->seq > rhs->seq;
+  });
+  for (auto image : images) {
+    auto des = allocator_.OffsetToPtr<char>(image->offset);
+    memcpy(des, image->data(), image->len);
+    Flush(des, image->len);
+  }
+  Fence();
+  recovery_stats_.num_undone_writes = images.size();
+  for (uint32_t i = 0; i < kNumUndoLogs; ++i) {
+    undo_log(i).pos = NVMUndoLog::kNoRecord;
+    undo_log(i).len = 0;
+    Persist(&undo_log(i), offsetof(NVMUndoLog, images));
+  }
+}
+
+uint32_t Tablet::Apply() {
+  auto& log = this->log();
+  uint32_t n = 0;
+  const ModificationLog* record;
+  while ((record = GetLog(log.head)) != nullptr) {
+    if (!children_.empty()) {
+      std::lock_guard<Spinlock> _(sync_lock_);
+      for (size_t k = 0; k < children_.size(); ++k) {
+        Forward(k, record);
+      }
+    }
+    // Readers of a backup are not blocked, but retry
+    apply_seq_.fetch_add(1, std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (kOpLogReplication && info_.is_backup) {
+      StoreOperations(record);
+    } else {
+      Redo(record);
+      hash_table_.Refresh();
+    }
+    // The master overwrites records before the head read from a backup,
+    // which is thus persisted for each record.
+    log.head = record->pos + record->len;
+    Persist(&log.head, sizeof(log.head));
+    lsn_.store(log.head, std::memory_order_release);
+    apply_seq_.fetch_add(1, std::memory_order_release);
+    ++n;
+  }
+  {
+    // Read by `AppendLog` of the workers
+    std::lock_guard<Spinlock> _(sync_lock_);
+    log_tail_ = log.head;
+    persisted_head_ = log.head;
+  }
+  lsn_.store(log.head, std::memory_order_release);
+  if (info_.is_backup && !children_.empty()) {
+    Report();
+  }
+  return n;
+}
+
+void Tablet::WaitForLog(uint64_t end) {
+  for (size_t k = 0; k < children_.size(); ++k) {
+    // Writes in flight complete, then those not yet posted are posted
+    while (end > GetUnwritten(k) && end - GetUnwritten(k) > NVMLog::kSize) {
+      PollBackup(k);
+      PostRecords(k);
+    }
+  }
+}
+
+void Tablet::WaitForBackupLog(uint32_t k, uint64_t end) {
+  // A child that writes records on must keep them until its children
+  // have them, it reports how far its log may be overwritten.
+  while (end - (child_forwards_[k] ? GetAcked(k) : backup_heads_[k]) >
+         NVMLog::kSize) {
+    // The head moves past records posted only
+    while (!PostRecords(k)) {
+      PollBackup(k);
+    }
+    if (!child_forwards_[k]) {
+      ReadBackupHead(k);
+    }
+  }
+}
+
+void Tablet::ReadBackupHead(uint32_t k) {
+  auto backup = index_manager_.GetTablet(children_[k]);
+  struct ibv_sge sge = {
+    reinterpret_cast<uint64_t>(&backup_heads_[k]),
+    sizeof(uint64_t),
+    heads_mr_->lkey
+  };
+  struct ibv_send_wr wr {};
+  wr.wr.rdma.remote_addr = backup.qpis[0].vaddr +
+      log_offset_ + offsetof(NVMLog, head);
+  wr.wr.rdma.rkey = backup.qpis[0].rkey;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr_id = kReadHeadId;
+
+  struct ibv_send_wr* bad_wr;
+  int err = ibv_post_send(ChildQP(k)->qp, &wr, &bad_wr);
+  if (err != 0) {
+    throw TransportException(HERE, "ibv_post_send failed", err);
+  }
+  // Records in flight before the read are completed first
+  while (!PollBackup(k)) {}
+}
+
+/*
+ * A backup stores the state of each key of an operation record through
+ * its index and allocator, as the master does; their writes are not
+ * logged, but persisted together before the head passes the record. A
+ * record redone after a crash sets the same states again, and blocks
+ * leaked by it are freed by the recovery scan.
+ */
+void Tablet::StoreOperations(const ModificationLog* record) {
+  ModificationList modifications;
+  Begin(modifications);
+  auto end = reinterpret_cast<const char*>(record) + record->len;
+  auto op = reinterpret_cast<const Operation*>(record->positions);
+  for (uint32_t i = 0; i < record->cnt; ++i) {
+    auto next = reinterpret_cast<const char*>(op) +
+                Operation::Len(op->key_len, op->val_len);
+    if (next > end) {
+      NVDS_ERR("invalid operation: key_len = %u, val_len = %u",
+               op->key_len, op->val_len);
+      break;
+    }
+    {
+      HashTable::BucketGuard guard(hash_table_, op->key_hash);
+      auto c = hash_table_.Find(op->key_hash, op->key(), op->key_len);
+      if (op->type == Operation::Type::SET) {
+        auto status = Store(c, op->key(), op->key_len, op->key_hash,
+                            op->val(), op->val_len, op->version, op->expire);
+        if (status != Status::OK) {
+          NVDS_ERR("backup tablet is full, operation is dropped");
+        }
+      } else if (c.obj != 0) {
+        Erase(c);
+      }
+    }
+    hash_table_.Resize();
+    op = reinterpret_cast<const Operation*>(next);
+  }
+  Persist(modifications);
+  ReleaseUndoLog();
+  allocator_.set_modifications(nullptr);
+  allocator_.set_undo(nullptr);
 }
 
 /*
@@ -248,14 +1452,8 @@ void Tablet::MergeModifications(ModificationList& modifications) {
 
   //PrintModifications(modifications);
 
-  // Baby, don't worry, n <= 12.
-  // This simple algorithm should be faster than `union-find`;
-  for (size_t i = 0; i < n; ++i) {
-    for (size_t j = i + 1; j < n; ++j) {
-      if (modifications[j] < modifications[i])
-        std::swap(modifications[j], modifications[i]);
-    }
-  }
+  // A batch of requests makes hundreds of modifications
+  std::sort(modifications.begin(), modifications.end());
 
   //PrintModifications(modifications);
 
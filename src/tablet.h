@@ -4,73 +4,554 @@
 #include "allocator.h"
 #include "common.h"
 #include "hash.h"
+#include "hash_table.h"
 #include "message.h"
 #include "modification.h"
 #include "response.h"
+#include "spinlock.h"
+
+#include <ctime>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 namespace nvds {
 
 struct Request;
 class IndexManager;
 
-// A reasonable prime number
-static const uint32_t kHashTableSize = 1000003;
+// The redo log of a tablet, a ring of `ModificationLog` records. A record
+// never wraps around, it starts over from the beginning of the ring.
+struct NVMLog {
+  static const uint32_t kSize = kLogSize;
+  // Records before `head` have been redone
+  uint64_t head;
+  // Positions reported by the replicas this one writes to, of those
+  // that write records on: before which their subtrees have redone
+  // records. See `Topology`.
+  uint64_t acks[kTreeFanOut];
+  char ring[kSize];
+  NVMLog() = delete;
+};
 
-struct NVMObject {
-  uint32_t next;
-  uint16_t key_len;
-  uint16_t val_len;
-  KeyHash key_hash;    
-  char data[0];
+// An entry of `NVMUndoLog`: the `len` bytes at `offset` of the tablet
+// before a write in place, followed by the bytes and padded to
+// `Position::kAlign`. Writes are ordered by `seq` across the undo logs.
+struct UndoImage {
+  uint64_t seq;
+  uint32_t offset;
+  uint32_t len;
+  UndoImage() = delete;
+  char* data() { return reinterpret_cast<char*>(this + 1); }
+  const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+  static uint32_t Len(uint32_t len) {
+    return (sizeof(UndoImage) + len + Position::kAlign - 1) /
+           Position::kAlign * Position::kAlign;
+  }
 };
 
+// Images saved by a worker for the writes in place of its operations
+// since its last commit, each persisted before its write. Those of
+// operations without a complete record are rolled back on restart.
+struct NVMUndoLog {
+  // For writes other than those to blocks allocated by the operations,
+  // which are free before them: indices, headers and values overwritten
+  static const uint32_t kSize = 512 * 1024;
+  // Position of the record that commits the writes, it is set before the
+  // record is appended; `kNoRecord` until then.
+  static const uint64_t kNoRecord = UINT64_MAX;
+  uint64_t pos;
+  // Bytes of the images
+  uint64_t len;
+  char images[kSize];
+  NVMUndoLog() = delete;
+};
+// Workers of a tablet, and the thread that redoes records, at most
+static const uint32_t kNumUndoLogs = 16;
+
+// The arena of `Config::tablet_size` bytes, followed by the index, the
+// log and the undo logs. Buckets of the index scale with the arena, one for each 128
+// bytes, as the default 64MB arena has `NVMHashTable::kMaxNumBuckets`.
 struct NVMTablet {
-  char data[Allocator::kSize];
-  std::array<uint32_t, kHashTableSize> hash_table;
-  NVMTablet() {
-    hash_table.fill(0);
+  char data[0];
+  NVMTablet() = delete;
+
+  static constexpr uint32_t GetMaxNumBuckets(uint32_t arena_size) {
+    return arena_size / 128;
+  }
+  static constexpr uint64_t GetHashTableOffset(uint32_t arena_size) {
+    return arena_size;
+  }
+  static constexpr uint64_t GetLogOffset(uint32_t arena_size) {
+    return GetHashTableOffset(arena_size) + offsetof(NVMHashTable, buckets) +
+        sizeof(NVMBucket) * static_cast<uint64_t>(GetMaxNumBuckets(arena_size));
   }
+  static constexpr uint64_t GetUndoLogOffset(uint32_t arena_size) {
+    return GetLogOffset(arena_size) + sizeof(NVMLog);
+  }
+  static constexpr uint64_t GetSize(uint32_t arena_size) {
+    return GetUndoLogOffset(arena_size) + kNumUndoLogs * sizeof(NVMUndoLog);
+  }
+};
+// Computed in 64 bits, so that an oversized `kMaxTabletSize` fails here
+static_assert(NVMTablet::GetSize(kMaxTabletSize) <= UINT32_MAX,
+              "offsets into a tablet must be 32 bits");
+
+// A value longer than `kMaxItemSize` is not stored in its object, but in
+// a chain of chunks; each chunk fills up the largest block.
+struct NVMChunk {
+  uint32_t next;
+  uint32_t len;
+  char data[0];
+  NVMChunk() = delete;
 };
-static const uint32_t kNVMTabletSize = sizeof(NVMTablet);
+static const uint32_t kMaxChunkDataLen =
+    Allocator::kMaxBlockSize - sizeof(uint32_t) - sizeof(NVMChunk);
 
 class Tablet {
  public:
   //Tablet(const TabletInfo& info, NVMPtr<NVMTablet> nvm_tablet);
+  // Statistics of the recovery scan
+  struct RecoveryStats {
+    uint32_t num_objects;
+    // Bytes of keys and values
+    uint64_t num_bytes;
+    // Blocks leaked by a crash, which are freed
+    uint32_t num_leaked_blocks;
+    // Writes in place of operations that are not committed, undone
+    uint32_t num_undone_writes;
+    // Records of the log after its persisted head, redone
+    uint32_t num_redone_records;
+  };
+  // Statistics of the compaction since the tablet is constructed
+  struct CompactionStats {
+    // Objects and chunks
+    uint64_t num_moved_objects;
+    uint64_t num_moved_bytes;
+    // Passes over the whole index
+    uint64_t num_passes;
+  };
+
+  // Replication of the log of a master, in bytes
+  struct ReplicationStats {
+    // Appended but not yet replicated to all backups
+    uint64_t lag;
+    uint64_t max_lag;
+  };
+
+  // The tablet of `Config::tablet_size` is reattached if `recover`,
+  // otherwise it is formatted.
+  // The index is scanned by `num_recovery_threads` threads.
+  // With `Config::num_replicas` 0, as in tests, it is not replicated
+  // and opens no Infiniband device.
   Tablet(const IndexManager& index_manager,
          NVMPtr<NVMTablet> nvm_tablet,
-         bool is_backup=false);
+         bool is_backup=false, bool recover=false,
+         uint32_t num_recovery_threads=1);
   ~Tablet();
   DISALLOW_COPY_AND_ASSIGN(Tablet);
 
   const TabletInfo& info() const { return info_; }
-  Status Get(Response* resp, const Request* r,
-                       ModificationList& modifications);
+  const RecoveryStats& recovery_stats() const { return recovery_stats_; }
+  CompactionStats compaction_stats() const {
+    return {num_moved_objects_.load(std::memory_order_relaxed),
+            num_moved_bytes_.load(std::memory_order_relaxed),
+            num_compaction_passes_.load(std::memory_order_relaxed)};
+  }
+  ReplicationStats replication_stats() const {
+    auto lsn = this->lsn();
+    auto tail = tail_.load(std::memory_order_relaxed);
+    return {tail > lsn ? tail - lsn : 0,
+            max_lag_.load(std::memory_order_relaxed)};
+  }
+  // Fragmentation metrics of the arena, by walking it.
+  Allocator::Stats allocator_stats() { return allocator_.GetStats(); }
+  // Position of the log before which writes are visible: the end of the
+  // last record replicated by a master, or redone by a backup.
+  uint64_t lsn() const { return lsn_.load(std::memory_order_acquire); }
+  // Copy at most `max_val_len` bytes of the value, `resp->val_len` is
+  // set to length of the value, which may be longer. GETs are served by
+  // backups as well.
+  Status Get(Response* resp, const Request* r, uint32_t max_val_len,
+             ModificationList& modifications);
+  // Build the whole response in `resp`, for a value
+  // that does not fit into one message.
+  Status Get(std::vector<char>& resp, const Request* r);
   Status Del(const Request* r, ModificationList& modifications);
   Status Put(const Request* r, ModificationList& modifications);
   // Return: Status::ERROR, if there is already the same key; else, Status::OK;
   Status Add(const Request* r, ModificationList& modifications);
+  // Add (INCR) or subtract (DECR) the delta to the value, which is a
+  // decimal number; the new value is responded. A key not found is taken
+  // as value 0. Subtraction stops at 0, addition wraps around.
+  // Return: Status::ERROR, if the value is not a number.
+  Status Incr(Response* resp, const Request* r,
+              ModificationList& modifications);
+  // Replace the value only if its version equals the expected one.
+  // Return: Status::MISMATCH, with the current version in `resp`.
+  Status Cas(Response* resp, const Request* r,
+             ModificationList& modifications);
+  // Append to the value, a key not found is taken as an empty value.
+  Status Append(Response* resp, const Request* r,
+                ModificationList& modifications);
+  // Reclaim expired objects in the next `kNumSweepBuckets` buckets of
+  // the index, return the number of objects reclaimed.
+  uint32_t Sweep(ModificationList& modifications);
+  // Relocate objects of the next `kNumCompactBuckets` buckets of the
+  // index into dense regions if the arena is fragmented, return the
+  // number of objects relocated.
+  uint32_t Compact(ModificationList& modifications);
   void SettingupQPConnect(TabletId id, const IndexManager& index_manager);
+  // Commit the modifications of an operation, or of a group of them, by
+  // one log record, and replicate the record to the backups, through the
+  // topology of the tablet.
   int Sync(ModificationList& modifications);
+  // Commit the modifications as `Sync`, but return once the record is
+  // posted to the backups. Return the position of the log after the
+  // record, or after the last one if there is no modification; the
+  // record is replicated once `lsn()` reaches it.
+  uint64_t Post(ModificationList& modifications);
+  // Poll completions of the backups without waiting, return `lsn()`.
+  // It is skipped if another worker is polling or posting.
+  uint64_t Poll();
+  // Position of the log before which responses to writes can be sent,
+  // by the durability of the tablet, as of the last `Poll`.
+  uint64_t GetReleasable() const;
+  // Redo records of the log that have not been redone, which are
+  // replicated by the master for a backup. Return the number of records.
+  uint32_t Apply();
 
  private:
   static void MergeModifications(ModificationList& modifications);
+  // Record the writes of the calling thread to `modifications`, and save
+  // the bytes before them to an undo log, see `Commit`.
+  void Begin(ModificationList& modifications) {
+    allocator_.set_modifications(&modifications);
+    allocator_.set_undo(&undo_hook_);
+  }
+  void SaveUndo(uint32_t offset, uint32_t len);
+  // The undo log of the calling thread, which is taken on its first write
+  // and released once the writes are committed.
+  NVMUndoLog* GetUndoLog();
+  void ReleaseUndoLog();
+  // Roll back the writes of undo logs whose records are not complete,
+  // after the records that are have been redone.
+  void RollBack();
+  // Rebuild the DRAM state after restart, and free blocks that are not
+  // reachable from the index.
+  void Recover(uint32_t num_threads);
+  // Position of the record of `len` bytes that is appended at `pos`
+  static uint64_t AlignLog(uint64_t pos, uint32_t len) {
+    auto offset = pos % NVMLog::kSize;
+    return offset + len > NVMLog::kSize ? pos - offset + NVMLog::kSize : pos;
+  }
+  NVMLog& log() { return *allocator_.OffsetToPtr<NVMLog>(log_offset_); }
+  NVMUndoLog& undo_log(uint32_t i) {
+    return allocator_.OffsetToPtr<NVMUndoLog>(undo_log_offset_)[i];
+  }
+  ModificationLog* LogAt(uint64_t pos) {
+    return reinterpret_cast<ModificationLog*>(
+        &log().ring[pos % NVMLog::kSize]);
+  }
+  static uint64_t Checksum(const ModificationLog* record) {
+    return Hash(reinterpret_cast<const char*>(&record->pos),
+                record->len - offsetof(ModificationLog, pos));
+  }
+  // Write the record of the modifications at the tail of the log.
+  // Return nullptr if it is too large for the log.
+  const ModificationLog* AppendLog(const ModificationList& modifications);
+  // Return the complete record at `pos`, or at the beginning of the ring
+  // if it is wrapped around; nullptr if there is none.
+  const ModificationLog* GetLog(uint64_t pos);
+  // Write the entries of the record to the tablet, and persist them.
+  void Redo(const ModificationLog* record);
+  // Store the operations of the record replicated to a backup.
+  void StoreOperations(const ModificationLog* record);
+  // Commit the modifications by a record of the log, and persist them.
+  // Return nullptr if there is no modification, or too many.
+  const ModificationLog* Commit(ModificationList& modifications);
+  // Move operations recorded by the workers into a record of the ring
+  // that is replicated to backups. Return nullptr if there is none.
+  const ModificationLog* AppendOperations();
+  // Call `read` with the position of the log it reflects. It is retried
+  // if the tablet is modified by `Apply` meanwhile, which does not hold
+  // the buckets.
+  template<typename Reader>
+  Status ReadApplied(Reader read) {
+    while (true) {
+      uint32_t seq;
+      while ((seq = apply_seq_.load(std::memory_order_acquire)) & 1) {}
+      auto status = read(lsn());
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (apply_seq_.load(std::memory_order_relaxed) == seq) {
+        return status;
+      }
+    }
+  }
+  // Backups that this replica writes records to are its children; those
+  // below are of child `k`, and `sync_lock_` must be held.
+  Infiniband::QueuePair* ChildQP(uint32_t k) {
+    return qps_[info_.is_backup ? k + 1 : k];
+  }
+  // Position before which records are replicated to child `k`, and
+  // redone by its subtree if it writes them on.
+  uint64_t GetAcked(uint32_t k) {
+    if (child_forwards_[k]) {
+      return *reinterpret_cast<volatile uint64_t*>(&log().acks[k]);
+    }
+    // All posted are replicated
+    if (num_inflight_[k] == 0 && unposted_[k].empty()) {
+      return UINT64_MAX;
+    }
+    return replicated_[k];
+  }
+  // Position of the oldest record still to be written to child `k`, which
+  // the ring must keep; records not yet posted are of it as well. Records
+  // before it are written to the child, though not necessarily on.
+  uint64_t GetUnwritten(uint32_t k) {
+    if (num_inflight_[k] > 0) {
+      return replicated_[k];
+    }
+    return unposted_[k].empty() ? UINT64_MAX : unposted_[k].front().pos;
+  }
+  // Wait until the ring has room for records before `end`, as those it
+  // would overwrite are written to every child.
+  void WaitForLog(uint64_t end);
+  // Queue the record to be written to the child, and post it if it can be.
+  void Forward(uint32_t k, const ModificationLog* record);
+  // Wait until the log of the child has room for records before `end`.
+  void WaitForBackupLog(uint32_t k, uint64_t end);
+  // Read the head of the log of the child into `backup_heads_[k]`.
+  void ReadBackupHead(uint32_t k);
+  // Post the writes of records not yet posted to the child, by a chain
+  // of work requests of which only the last is signaled, and which ends
+  // with a flushing read if `kRemoteFlush`. Return false if some are
+  // left, as too many writes are in flight.
+  bool PostRecords(uint32_t k);
+  // Handle completions of the child, return true if a read of its head
+  // is completed.
+  bool PollBackup(uint32_t k);
+  // Poll the children of a backup, and report to its parent the position
+  // before which records are redone by its subtree, without waiting.
+  void Report();
+  // Allocate the object (and chunks), return 0 if no space.
+  uint32_t NewObject(const char* key, uint16_t key_len, KeyHash key_hash,
+                     const char* val, uint32_t val_len,
+                     uint32_t version, uint32_t expire);
+  // Store the value to the object found by `c`, which is replaced by a
+  // new object if the value does not fit into it. The bucket must be held.
+  Status Overwrite(const HashTable::Cursor& c, const char* key,
+                   uint16_t key_len, KeyHash key_hash,
+                   const char* val, uint32_t val_len,
+                   uint32_t version, uint32_t expire);
+  // Overwrite the object found by `c`, or insert a new one if the key is
+  // not found. The bucket must be held.
+  Status Store(const HashTable::Cursor& c, const char* key,
+               uint16_t key_len, KeyHash key_hash,
+               const char* val, uint32_t val_len,
+               uint32_t version, uint32_t expire);
+  // Find the key of the request, the bucket must be held.
+  // An expired object found is reclaimed, as if it is not found.
+  HashTable::Cursor Find(const Request* r);
+  // Version of the object that replaces the one found by `c`
+  uint32_t NextVersion(const HashTable::Cursor& c) {
+    return c.obj == 0 ? 1 :
+        allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(c.obj, version)) + 1;
+  }
+  // Expiration time of the object found by `c`, 0 if not found
+  uint32_t GetExpire(const HashTable::Cursor& c) {
+    return c.obj == 0 ? 0 :
+        allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(c.obj, expire));
+  }
+  bool IsExpired(uint32_t obj) {
+    auto expire = allocator_.Read<uint32_t>(OFFSETOF_NVMOBJECT(obj, expire));
+    return expire != 0 && expire <= Now();
+  }
+  // Seconds since epoch
+  static uint32_t Now() { return time(nullptr); }
+  static uint32_t ToExpire(uint32_t ttl) { return ttl == 0 ? 0 : Now() + ttl; }
+  uint32_t NewChunks(const char* val, uint32_t len);
+  // Allocate from the arena, evicting cold objects if it is full.
+  uint32_t Alloc(uint32_t size);
+  void FreeObject(uint32_t obj);
+  // Erase the object found by `c` from the index, and free it.
+  void Erase(const HashTable::Cursor& c);
+  // Record the state left by an operation for backups, if operation
+  // records are replicated.
+  void RecordSet(const char* key, uint16_t key_len, KeyHash key_hash,
+                 const char* val, uint32_t val_len,
+                 uint32_t version, uint32_t expire);
+  // `op_lock_` must be held until the operation is filled in.
+  Operation* AddOperation(Operation::Type type, uint16_t key_len,
+                          uint32_t val_len);
+  // Relocate the object found by `c` and its chunks, those that the
+  // allocator suggests. The bucket must be held. Return false if none
+  // is relocated.
+  bool Move(const HashTable::Cursor& c);
+  // Copy the block of `size` bytes at `ptr` to a new one, and free it.
+  // Return the new block, or 0 if it is not relocated.
+  uint32_t Relocate(uint32_t ptr, uint32_t size);
+  void FreeChunks(uint32_t chunk);
+  // Erase a few objects that are not accessed since the CLOCK hand
+  // passed them last time. Return false if none is evicted, and there
+  // is none left to evict.
+  bool Evict();
+  // Mark the object accessed, no NVM write is made.
+  void Touch(uint32_t obj) {
+    if (!kCacheMode) {
+      return;
+    }
+    auto& word = access_bits_[obj / kMinObjectAlign / 64];
+    uint64_t mask = static_cast<uint64_t>(1) << (obj / kMinObjectAlign % 64);
+    if ((word.load(std::memory_order_relaxed) & mask) == 0) {
+      word.fetch_or(mask, std::memory_order_relaxed);
+    }
+  }
+  // Clear the access bit, return if it was set.
+  bool Untouch(uint32_t obj) {
+    auto& word = access_bits_[obj / kMinObjectAlign / 64];
+    uint64_t mask = static_cast<uint64_t>(1) << (obj / kMinObjectAlign % 64);
+    return (word.fetch_and(~mask, std::memory_order_relaxed) & mask) != 0;
+  }
+  // Copy at most `max_len` bytes of the value, return length of the value.
+  // The object may be modified concurrently, of which the result is
+  // garbage but the read is kept within the arena.
+  uint32_t ReadValue(uint32_t obj, uint16_t key_len,
+                     char* val, uint32_t max_len);
 
   const IndexManager& index_manager_;  
   TabletInfo info_;
   NVMPtr<NVMTablet> nvm_tablet_;
   Allocator allocator_;
+  HashTable hash_table_;
+  uint32_t log_offset_;
+  uint32_t undo_log_offset_;
+  RecoveryStats recovery_stats_ {0, 0, 0, 0, 0};
+
+  // Cache mode
+  // Objects are at least this far apart, as blocks are
+  static const uint32_t kMinObjectAlign = 16;
+  // Objects evicted, and buckets passed, by `Evict` at most
+  static const uint32_t kMaxEvictsPerRound = 8;
+  static const uint32_t kMaxEvictBuckets = 128;
+  // Access bits of objects in DRAM, bit `i` for object at `i * 16`
+  std::unique_ptr<std::atomic<uint64_t>[]> access_bits_;
+  // Index of the bucket that the CLOCK hand points to
+  uint32_t clock_hand_ {0};
+  // Buckets passed by the hand since it found an object
+  uint32_t num_idle_buckets_ {0};
+  Spinlock evict_lock_;
 
-  // Infiniband
+  // Buckets walked by `Sweep` at a time
+  static const uint32_t kNumSweepBuckets = 16;
+  // Index of the next bucket to sweep
+  std::atomic<uint32_t> sweep_hand_ {0};
+
+  // Buckets walked by `Compact` at a time
+  static const uint32_t kNumCompactBuckets = 16;
+  // Index of the next bucket to compact
+  std::atomic<uint32_t> compact_hand_ {0};
+  std::atomic<uint64_t> num_moved_objects_ {0};
+  std::atomic<uint64_t> num_moved_bytes_ {0};
+  std::atomic<uint64_t> num_compaction_passes_ {0};
+  static const uint64_t kNumPassesPerLog = 16;
+
+  // Infiniband, a tablet without replicas opens no device
   static const uint32_t kMaxIBQueueDepth = 128;
-  Infiniband ib_;
+  std::unique_ptr<Infiniband> ib_;
   //Infiniband::Address ib_addr_;
-  ibv_mr* mr_;
-  std::array<Infiniband::QueuePair*, kNumReplicas> qps_;
+  ibv_mr* mr_ {nullptr};
+  std::vector<Infiniband::QueuePair*> qps_;
   // `kNumReplica` queue pairs share this `rcq_` and `scq_`
 
-  static const uint32_t kNumScatters = 16;
-  std::array<struct ibv_sge, kNumScatters> sges;
-  std::array<struct ibv_send_wr, kNumScatters> wrs;
+  Spinlock sync_lock_;
+  // Chains posted to a backup but not yet completed, at most
+  static const uint32_t kMaxInflightRecords = 32;
+  // Work requests of a chain, at most, including the read that flushes
+  // it. A range of records is split only where the ring wraps around, a
+  // chain is of two ranges mostly.
+  static const uint32_t kMaxChainLen = 3;
+  static_assert(kMaxInflightRecords * kMaxChainLen < kMaxIBQueueDepth,
+                "the send queue of a backup must not overflow");
+  struct LogRange {
+    uint64_t pos;
+    uint32_t len;
+    uint64_t end() const { return pos + len; }
+  };
+  // Records appended but not yet posted to each backup, as ranges of the
+  // log. They are posted as the writes in flight complete.
+  std::vector<std::vector<LogRange>> unposted_;
+  struct ibv_sge sges_[kMaxChainLen];
+  struct ibv_send_wr wrs_[kMaxChainLen];
+  // `wr_id` of reads of a backup's head, records are identified by their end
+  static const uint64_t kReadHeadId = 0;
+  // Replicas this one writes records to, see `Topology`
+  std::vector<TabletId> children_;
+  // If child `k` writes records on to others
+  std::vector<bool> child_forwards_;
+  // The replica a backup receives records from, and the index of the
+  // backup among its children
+  TabletId parent_ {0};
+  uint32_t parent_slot_ {0};
+  // Position last reported to the parent, and reports in flight
+  uint64_t reported_ {0};
+  uint32_t num_reports_ {0};
+  // End of the records replicated to each child
+  std::vector<uint64_t> replicated_;
+  std::vector<uint32_t> num_inflight_;
+
+  // Undo logs taken by workers
+  Allocator::UndoHook undo_hook_;
+  Spinlock undo_lock_;
+  std::array<bool, kNumUndoLogs> undo_taken_ {};
+  std::atomic<uint64_t> undo_seq_ {0};
+  // The undo log taken by the calling thread, of `tablet`
+  // `kNumUndoLogs` if none is free, and `full` if the images overflow.
+  struct UndoLogRef {
+    const Tablet* tablet;
+    uint32_t idx;
+    bool full;
+  };
+  static thread_local UndoLogRef undo_ref_;
+
+  // Log
+  // Position of the next record, written with `sync_lock_` held
+  uint64_t log_tail_ {0};
+  // `NVMLog::head` as last persisted by the master, records after it are
+  // redone on restart and must not be overwritten
+  uint64_t persisted_head_ {0};
+  std::atomic<uint64_t> lsn_ {0};
+  // End of the records replicated to one child at least
+  std::atomic<uint64_t> first_lsn_ {0};
+  // End of the last record replicated, and the largest distance of
+  // `lsn_` from it
+  std::atomic<uint64_t> tail_ {0};
+  std::atomic<uint64_t> max_lag_ {0};
+  // Odd while `Apply` is redoing a record
+  std::atomic<uint32_t> apply_seq_ {0};
+  // Heads of the children's logs, read from them, followed by the slot
+  // that flushing reads are read into
+  std::vector<uint64_t> backup_heads_;
+  ibv_mr* heads_mr_ {nullptr};
+
+  // Operation-log replication
+  // Entries recorded by the operations of all workers, since the last
+  // record. They are recorded with the bucket held, so that operations
+  // on a key are replicated in the order they are made on the master.
+  Spinlock op_lock_;
+  std::vector<char> operations_;
+  uint32_t num_operations_ {0};
+  // Entries taken by the record being appended, `sync_lock_` is held
+  std::vector<char> op_batch_;
+  // Records sent to backups, which take them at the same positions of
+  // their logs. The ring is in DRAM, records are committed by the log.
+  std::unique_ptr<char[]> op_ring_;
+  ibv_mr* op_ring_mr_ {nullptr};
+  // Position of the next operation record
+  uint64_t op_tail_ {0};
+  // If the tail continues from the heads of the backups
+  bool op_tail_synced_ {false};
 };
 
 } // namespace nvds
@@ -3,6 +3,7 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 #include <vector>
@@ -15,7 +16,7 @@ TEST (AllocatorTest, Alloc) {
   assert(base != nullptr);
 
   Allocator a(base);
-  Allocator::ModificationList modifications;
+  ModificationList modifications;
   modifications.reserve(20);
   a.set_modifications(&modifications);
 
@@ -33,6 +34,311 @@ TEST (AllocatorTest, Alloc) {
   free(base);
 }
 
+TEST (AllocatorTest, Reattach) {
+  string path = "/tmp/nvds_test_allocator";
+  unlink(path.c_str());
+  auto nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+
+  vector<uint32_t> blks;
+  {
+    Allocator a(nvm.ptr());
+    ModificationList modifications;
+    a.set_modifications(&modifications);
+    for (size_t i = 0; i < 1000; ++i) {
+      blks.push_back(a.Alloc(40));
+      a.Write(blks.back(), static_cast<uint32_t>(i));
+    }
+  }
+  munmap(nvm.ptr(), Allocator::kSize);
+
+  // Map the file again, as after restart
+  nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+  Allocator a(reinterpret_cast<uintptr_t>(nvm.ptr()));
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  for (size_t i = 0; i < blks.size(); ++i) {
+    ASSERT_EQ(i, a.Read<uint32_t>(blks[i]));
+  }
+  // Allocated blocks are not handed out again
+  for (size_t i = 0; i < 1000; ++i) {
+    auto blk = a.Alloc(40);
+    ASSERT_TRUE(find(blks.begin(), blks.end(), blk) == blks.end());
+  }
+  munmap(nvm.ptr(), Allocator::kSize);
+  unlink(path.c_str());
+}
+
+TEST (AllocatorTest, Recover) {
+  auto base = malloc(Allocator::kSize);
+  assert(base != nullptr);
+  Allocator fresh(base);
+  ModificationList modifications;
+  fresh.set_modifications(&modifications);
+  size_t capacity = 0;
+  while (fresh.Alloc(40) != 0) {
+    ++capacity;
+  }
+
+  Allocator a(base);
+  vector<uint32_t> live;
+  size_t num_leaked = 0;
+  for (size_t i = 0; i < 1000; ++i) {
+    auto blk = a.Alloc(40);
+    if (i % 3 == 0) {
+      a.Free(blk);
+    } else if (i % 3 == 1) {
+      live.push_back(blk);
+      a.Write(blk, static_cast<uint32_t>(i));
+    } else {
+      // Allocated but not linked, as if crashed
+      ++num_leaked;
+    }
+  }
+
+  uint32_t leaked;
+  ASSERT_TRUE(a.Recover([&live](uint32_t ptr) {
+    return find(live.begin(), live.end(), ptr) != live.end();
+  }, &leaked));
+  ASSERT_EQ(num_leaked, leaked);
+  for (size_t i = 0; i < live.size(); ++i) {
+    ASSERT_EQ(i * 3 + 1, a.Read<uint32_t>(live[i]));
+  }
+  // Only live blocks are not handed out again
+  size_t cnt = 0;
+  uint32_t blk;
+  while ((blk = a.Alloc(40)) != 0) {
+    ASSERT_TRUE(find(live.begin(), live.end(), blk) == live.end());
+    ++cnt;
+  }
+  ASSERT_EQ(capacity, cnt + live.size());
+  free(base);
+}
+
+TEST (AllocatorTest, Slab) {
+  string path = "/tmp/nvds_test_allocator";
+  unlink(path.c_str());
+  auto nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+
+  vector<uint32_t> blks;
+  {
+    Allocator a(nvm.ptr(), Allocator::Engine::SLAB);
+    ModificationList modifications;
+    a.set_modifications(&modifications);
+    uint32_t blk;
+    while ((blk = a.Alloc(40)) != 0) {
+      blks.push_back(blk);
+    }
+    ASSERT_GT(blks.size(), Allocator::kSize / 48 * 9 / 10);
+    for (auto blk : blks) {
+      ASSERT_EQ(0, blk % 16);
+    }
+    // Freeing a slot writes a single word
+    for (size_t i = 0; i < blks.size(); i += 2) {
+      modifications.clear();
+      a.Free(blks[i]);
+      ASSERT_LE(modifications.size(), 2);
+    }
+    // Slots of a larger class are handed out when there is no free page
+    ASSERT_EQ(0, a.Alloc(100));
+    ASSERT_NE(0, a.Alloc(20));
+    a.Free(blks[1]);
+    modifications.clear();
+    ASSERT_EQ(blks[1], a.Alloc(40));
+    ASSERT_EQ(1, modifications.size());
+  }
+  munmap(nvm.ptr(), Allocator::kSize);
+
+  // Reattached, free slots are found again
+  nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+  Allocator a(reinterpret_cast<uintptr_t>(nvm.ptr()));
+  ASSERT_EQ(Allocator::Engine::SLAB, a.engine());
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  uint32_t leaked;
+  ASSERT_TRUE(a.Recover([&blks](uint32_t ptr) {
+    return ptr != blks[3];
+  }, &leaked));
+  ASSERT_EQ(1, leaked);
+  size_t cnt = 0;
+  while (a.Alloc(40) != 0) {
+    ++cnt;
+  }
+  // Slots freed, except the one taken by 20 bytes, and the leaked one
+  ASSERT_EQ((blks.size() + 1) / 2, cnt);
+  munmap(nvm.ptr(), Allocator::kSize);
+  unlink(path.c_str());
+}
+
+TEST (AllocatorTest, DRAMFreeList) {
+  string path = "/tmp/nvds_test_allocator";
+  unlink(path.c_str());
+  auto nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+
+  vector<uint32_t> blks;
+  {
+    Allocator a(nvm.ptr(), Allocator::Engine::DRAM_FREE_LIST);
+    ModificationList modifications;
+    a.set_modifications(&modifications);
+    // Only headers of blocks are written
+    for (size_t i = 0; i < 1000; ++i) {
+      modifications.clear();
+      blks.push_back(a.Alloc(40));
+      ASSERT_LE(modifications.size(), 3);
+    }
+    for (size_t i = 0; i < blks.size(); i += 2) {
+      modifications.clear();
+      a.Free(blks[i]);
+      ASSERT_LE(modifications.size(), 3);
+    }
+  }
+  munmap(nvm.ptr(), Allocator::kSize);
+
+  // Free lists are rebuilt from the headers
+  nvm = MapNVM<char>(path, Allocator::kSize);
+  ASSERT_TRUE(nvm != nullptr);
+  Allocator a(reinterpret_cast<uintptr_t>(nvm.ptr()));
+  ASSERT_EQ(Allocator::Engine::DRAM_FREE_LIST, a.engine());
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  size_t reused = 0;
+  for (size_t i = 0; i < blks.size(); ++i) {
+    auto blk = a.Alloc(40);
+    auto it = find(blks.begin(), blks.end(), blk);
+    ASSERT_TRUE(it == blks.end() || (it - blks.begin()) % 2 == 0);
+    reused += it != blks.end();
+  }
+  ASSERT_EQ(blks.size() / 2, reused);
+  munmap(nvm.ptr(), Allocator::kSize);
+  unlink(path.c_str());
+}
+
+TEST (AllocatorTest, Compact) {
+  auto base = malloc(Allocator::kSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  vector<uint32_t> blks;
+  for (uint32_t blk; (blk = a.Alloc(40)) != 0; ) {
+    blks.push_back(blk);
+    modifications.clear();
+  }
+  ASSERT_FALSE(a.Fragmented());
+  // Free every other block, no two free blocks coalesce
+  vector<uint32_t> live;
+  for (size_t i = 0; i < blks.size(); ++i) {
+    if (i % 2 == 0) {
+      a.Free(blks[i]);
+    } else {
+      live.push_back(blks[i]);
+    }
+    modifications.clear();
+  }
+  auto before = a.GetStats();
+  ASSERT_EQ(a.free_bytes(), before.free_bytes);
+  ASSERT_EQ((blks.size() + 1) / 2, before.num_free_blocks);
+  ASSERT_TRUE(a.Fragmented());
+
+  // Relocate blocks as the tablet does
+  size_t num_moved = 0;
+  for (auto blk : live) {
+    if (!a.ShouldMove(blk, 40)) {
+      continue;
+    }
+    auto moved = a.Alloc(40);
+    ASSERT_NE(0, moved);
+    a.Free(blk);
+    ++num_moved;
+    modifications.clear();
+  }
+  auto after = a.GetStats();
+  ASSERT_GT(num_moved, 0);
+  ASSERT_EQ(before.free_bytes, after.free_bytes);
+  ASSERT_EQ(a.free_bytes(), after.free_bytes);
+  ASSERT_LT(after.num_free_blocks, before.num_free_blocks);
+  ASSERT_LT(after.fragmentation(), before.fragmentation());
+  ASSERT_FALSE(a.Fragmented());
+  free(base);
+}
+
+TEST (AllocatorTest, Log) {
+  auto base = malloc(Allocator::kSize);
+  assert(base != nullptr);
+  Allocator a(base, Allocator::Engine::LOG);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  // An allocation is a single contiguous write
+  auto first = a.Alloc(40);
+  ASSERT_EQ(0, first % 16);
+  auto second = a.Alloc(40);
+  ASSERT_EQ(first + 48, second);
+  // The header of the second block overwrites the 0 header
+  ASSERT_EQ(4, modifications.size());
+  ASSERT_EQ(modifications[1].des, modifications[2].des);
+  ASSERT_EQ(second + 44, modifications[3].des);
+
+  vector<uint32_t> blks {first, second};
+  for (uint32_t blk; (blk = a.Alloc(40)) != 0; ) {
+    blks.push_back(blk);
+    modifications.clear();
+  }
+  // A segment is reserved for the cleaner
+  ASSERT_GE(a.free_bytes(), 1024 * 1024 - 16);
+
+  // Keep one block of every four
+  vector<uint32_t> live;
+  for (size_t i = 0; i < blks.size(); ++i) {
+    if (i % 4 == 0) {
+      live.push_back(blks[i]);
+    } else {
+      a.Free(blks[i]);
+    }
+  }
+  ASSERT_TRUE(a.Fragmented());
+  auto before = a.GetStats();
+  ASSERT_EQ(a.free_bytes(), before.free_bytes);
+
+  // Clean as the tablet does
+  size_t num_moved = 0;
+  for (auto& blk : live) {
+    if (!a.Fragmented() || !a.ShouldMove(blk, 40)) {
+      continue;
+    }
+    auto moved = a.AllocForRelocation(40);
+    ASSERT_NE(0, moved);
+    a.Free(blk);
+    blk = moved;
+    ++num_moved;
+    modifications.clear();
+  }
+  ASSERT_GT(num_moved, 0);
+  ASSERT_FALSE(a.Fragmented());
+  auto after = a.GetStats();
+  ASSERT_EQ(before.free_bytes, after.free_bytes);
+  ASSERT_LT(after.fragmentation(), before.fragmentation());
+  ASSERT_NE(0, a.Alloc(40));
+  modifications.clear();
+
+  // Reattach, blocks not live are dead
+  sort(live.begin(), live.end());
+  Allocator b(reinterpret_cast<uintptr_t>(base));
+  ASSERT_EQ(Allocator::Engine::LOG, b.engine());
+  uint32_t num_leaked;
+  ASSERT_TRUE(b.Recover([&live](uint32_t ptr) {
+    return binary_search(live.begin(), live.end(), ptr);
+  }, &num_leaked));
+  ASSERT_EQ(a.free_bytes() + 48, b.free_bytes());
+  auto blk = b.Alloc(40);
+  ASSERT_NE(0, blk);
+  ASSERT_FALSE(binary_search(live.begin(), live.end(), blk));
+  free(base);
+}
+
 /*
 TEST (AllocatorTest, Init) {
   auto mem = malloc(Allocator::kSize);
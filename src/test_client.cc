@@ -6,6 +6,7 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
 
 int main() {
   try {
@@ -17,6 +18,63 @@ int main() {
     assert(c.Add("hello", "world"));
     c.Del("hello");
     assert(c.Get("hello").size() == 0);
+
+    uint64_t cnt;
+    c.Del("counter");
+    assert(c.Incr("counter", 10, &cnt) && cnt == 10);
+    assert(c.Decr("counter", 3, &cnt) && cnt == 7);
+    assert(c.Decr("counter", 100, &cnt) && cnt == 0);
+    assert(c.Get("counter") == "0");
+    assert(c.Append("counter", "1") && c.Get("counter") == "01");
+    assert(c.Incr("counter", 1, &cnt) && cnt == 2);
+    assert(c.Append("counter", "x") && !c.Incr("counter", 1));
+    uint32_t version;
+    c.Gets("counter", &version);
+    assert(c.Cas("counter", "cas", version));
+    assert(!c.Cas("counter", "stale", version));
+    assert(c.Get("counter") == "cas");
+    c.Del("counter");
+
+    assert(c.Put("ttl", "expiring", 1));
+    assert(c.Get("ttl") == "expiring");
+    sleep(2);
+    assert(c.Get("ttl").size() == 0);
+    assert(c.Add("ttl", "again"));
+    c.Del("ttl");
+
+    std::string large(4 * 1024 * 1024, 'x');
+    assert(c.Put("large", large));
+    assert(c.Get("large") == large);
+    assert(c.MultiGet({"hello", "large"})[1] == large);
+    c.Del("large");
+
+    std::vector<std::string> keys, vals;
+    for (int i = 0; i < 1000; ++i) {
+      keys.push_back("key-" + std::to_string(i));
+      vals.push_back("val-" + std::to_string(i));
+    }
+    for (auto ok : c.MultiPut(keys, vals)) {
+      assert(ok);
+    }
+    assert(c.MultiGet(keys) == vals);
+    c.MultiDel(keys);
+    for (const auto& val : c.MultiGet(keys)) {
+      assert(val.size() == 0);
+    }
+
+    // Writes of the client are visible to its GETs served by backups
+    c.set_read_from_backups(true);
+    for (int i = 0; i < 10; ++i) {
+      assert(c.Put("replica", std::to_string(i)));
+      assert(c.Get("replica") == std::to_string(i));
+      assert(c.Get("replica") == std::to_string(i));
+    }
+    assert(c.Put("large", large));
+    assert(c.Get("large") == large && c.Get("large") == large);
+    c.Del("large");
+    c.Del("replica");
+    assert(c.Get("replica").size() == 0 && c.Get("replica").size() == 0);
+    c.set_read_from_backups(false);
   } catch (boost::system::system_error& e) {
     NVDS_ERR(e.what());
   } catch (nvds::TransportException& e) {
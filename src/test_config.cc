@@ -0,0 +1,95 @@
+#include "common.h"
+#include "index.h"
+#include "json.hpp"
+#include "message.h"
+
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+#include <vector>
+
+using namespace std;
+using namespace nvds;
+using namespace nlohmann;
+
+TEST (ConfigTest, ParentReplica) {
+  for (uint32_t r = 1; r <= 3; ++r) {
+    EXPECT_EQ(0, GetParentReplica(Topology::FAN_OUT, r));
+    EXPECT_EQ(r - 1, GetParentReplica(Topology::CHAIN, r));
+  }
+  EXPECT_EQ(0, GetParentReplica(Topology::TREE, 1));
+  EXPECT_EQ(0, GetParentReplica(Topology::TREE, 2));
+  EXPECT_EQ(1, GetParentReplica(Topology::TREE, 3));
+}
+
+TEST (ConfigTest, ChildReplicas) {
+  using Replicas = vector<uint32_t>;
+  EXPECT_EQ(Replicas({1, 2, 3}), GetChildReplicas(Topology::FAN_OUT, 3, 0));
+  EXPECT_EQ(Replicas(), GetChildReplicas(Topology::FAN_OUT, 3, 1));
+  for (uint32_t r = 1; r <= 3; ++r) {
+    EXPECT_EQ(r - 1, GetReplicaSlot(Topology::FAN_OUT, r));
+  }
+
+  EXPECT_EQ(Replicas({1}), GetChildReplicas(Topology::CHAIN, 3, 0));
+  EXPECT_EQ(Replicas({2}), GetChildReplicas(Topology::CHAIN, 3, 1));
+  EXPECT_EQ(Replicas({3}), GetChildReplicas(Topology::CHAIN, 3, 2));
+  EXPECT_EQ(Replicas(), GetChildReplicas(Topology::CHAIN, 3, 3));
+  for (uint32_t r = 1; r <= 3; ++r) {
+    EXPECT_EQ(0, GetReplicaSlot(Topology::CHAIN, r));
+  }
+
+  EXPECT_EQ(Replicas({1, 2}), GetChildReplicas(Topology::TREE, 3, 0));
+  EXPECT_EQ(Replicas({3}), GetChildReplicas(Topology::TREE, 3, 1));
+  EXPECT_EQ(Replicas(), GetChildReplicas(Topology::TREE, 3, 2));
+  EXPECT_EQ(0, GetReplicaSlot(Topology::TREE, 1));
+  EXPECT_EQ(1, GetReplicaSlot(Topology::TREE, 2));
+  EXPECT_EQ(0, GetReplicaSlot(Topology::TREE, 3));
+}
+
+TEST (ConfigTest, UnknownName) {
+  EXPECT_THROW(json("ring").get<Topology>(), invalid_argument);
+  EXPECT_THROW(json("most").get<Durability>(), invalid_argument);
+}
+
+TEST (ConfigTest, Topologies) {
+  Config c;
+  c.topology = Topology::TREE;
+  c.tablet_topologies = {Topology::CHAIN, Topology::FAN_OUT};
+  c.durability = Durability::ONE;
+  json j = c;
+  EXPECT_EQ("tree", j["topology"]);
+  EXPECT_EQ("chain", j["tablet_topologies"][0]);
+  EXPECT_EQ("fan-out", j["tablet_topologies"][1]);
+  Config d = j;
+  EXPECT_EQ(c, d);
+  EXPECT_EQ(Topology::CHAIN, d.GetTopology(0));
+  EXPECT_EQ(Topology::FAN_OUT, d.GetTopology(1));
+  EXPECT_EQ(Topology::TREE, d.GetTopology(2));
+
+  TabletInfo t {};
+  t.topology = Topology::CHAIN;
+  t.durability = Durability::LOCAL;
+  j = t;
+  TabletInfo u = j;
+  EXPECT_EQ(Topology::CHAIN, u.topology);
+  EXPECT_EQ(Durability::LOCAL, u.durability);
+}
+
+TEST (ConfigTest, WorkersOfIndex) {
+  json j = IndexManager();
+  j["num_workers_per_tablet"] = 3;
+  IndexManager im = j;
+  EXPECT_EQ(3, im.num_workers_per_tablet());
+}
+
+TEST (ConfigTest, ReplicationLag) {
+  Config c;
+  EXPECT_EQ("", c.Validate());
+  c.max_replication_lag = kLogSize;
+  EXPECT_NE("", c.Validate());
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
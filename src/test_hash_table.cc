@@ -0,0 +1,230 @@
+#include "hash_table.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace nvds;
+
+static const size_t kTableSize = Allocator::kSize + sizeof(NVMHashTable);
+
+static uint32_t NewObject(Allocator& a, const string& key, KeyHash hash) {
+  auto p = a.Alloc(sizeof(NVMObject) + key.size());
+  assert(p != 0);
+  a.Write<NVMObject>(p, {0, static_cast<uint16_t>(key.size()), 0, hash});
+  a.Memcpy(OFFSETOF_NVMOBJECT(p, data), key.c_str(), key.size());
+  return p;
+}
+
+TEST (HashTableTest, InsertFindErase) {
+  auto base = malloc(kTableSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  HashTable ht(a, Allocator::kSize);
+  ht.Format();
+
+  vector<string> keys;
+  vector<uint32_t> objs;
+  for (size_t i = 0; i < 100 * 1000; ++i) {
+    keys.push_back("key-" + to_string(i));
+    objs.push_back(NewObject(a, keys.back(), Hash(keys.back())));
+    ht.Insert(Hash(keys.back()), objs.back());
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto c = ht.Find(Hash(keys[i]), keys[i].c_str(), keys[i].size());
+    ASSERT_EQ(objs[i], c.obj);
+  }
+  string absent = "absent";
+  EXPECT_EQ(0, ht.Find(Hash(absent), absent.c_str(), absent.size()).obj);
+
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    auto c = ht.Find(Hash(keys[i]), keys[i].c_str(), keys[i].size());
+    ht.Erase(c);
+    a.Free(c.obj);
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto c = ht.Find(Hash(keys[i]), keys[i].c_str(), keys[i].size());
+    ASSERT_EQ(i % 2 == 0 ? 0 : objs[i], c.obj);
+  }
+  free(base);
+}
+
+TEST (HashTableTest, Overflow) {
+  auto base = malloc(kTableSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  HashTable ht(a, Allocator::kSize);
+  ht.Format();
+
+  // Fake hashes that fall into the same bucket
+  vector<string> keys;
+  vector<uint32_t> objs;
+  for (size_t i = 0; i < 3 * NVMBucket::kNumSlots; ++i) {
+    keys.push_back("key-" + to_string(i));
+    objs.push_back(NewObject(a, keys.back(), i << 48));
+    ht.Insert(i << 48, objs.back());
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto c = ht.Find(i << 48, keys[i].c_str(), keys[i].size());
+    ASSERT_EQ(objs[i], c.obj);
+    ht.Erase(c);
+    ASSERT_EQ(0, ht.Find(i << 48, keys[i].c_str(), keys[i].size()).obj);
+  }
+  free(base);
+}
+
+TEST (HashTableTest, VisitBucket) {
+  auto base = malloc(kTableSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  HashTable ht(a, Allocator::kSize);
+  ht.Format();
+
+  // Fake hashes that fall into bucket 0
+  vector<string> keys;
+  for (size_t i = 0; i < 3 * NVMBucket::kNumSlots; ++i) {
+    keys.push_back("key-" + to_string(i));
+    ht.Insert(i << 48, NewObject(a, keys.back(), i << 48));
+  }
+  {
+    HashTable::BucketGuard guard(ht, 0);
+    EXPECT_FALSE(ht.VisitBucket(0, [](const HashTable::Cursor& c) {}));
+  }
+  size_t num_visited = 0;
+  EXPECT_TRUE(ht.VisitBucket(0, [&ht, &num_visited](
+      const HashTable::Cursor& c) {
+    if (num_visited++ % 2 == 0) {
+      ht.Erase(c);
+    }
+  }));
+  EXPECT_EQ(keys.size(), num_visited);
+  EXPECT_EQ(keys.size() / 2, ht.num_items());
+  EXPECT_FALSE(ht.VisitBucket(ht.num_buckets(),
+                              [](const HashTable::Cursor& c) {}));
+  free(base);
+}
+
+TEST (HashTableTest, Resize) {
+  auto base = malloc(kTableSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  HashTable ht(a, Allocator::kSize);
+  ht.Format();
+
+  vector<string> keys;
+  vector<uint32_t> objs;
+  for (size_t i = 0; i < 200 * 1000; ++i) {
+    keys.push_back("key-" + to_string(i));
+    objs.push_back(NewObject(a, keys.back(), Hash(keys.back())));
+    ASSERT_TRUE(ht.Insert(Hash(keys.back()), objs.back()));
+    ht.Resize();
+  }
+  uint32_t min_num_buckets = NVMHashTable::kMinNumBuckets;
+  EXPECT_GT(ht.num_buckets(), min_num_buckets);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto c = ht.Find(Hash(keys[i]), keys[i].c_str(), keys[i].size());
+    ASSERT_EQ(objs[i], c.obj);
+  }
+
+  // Reattach to the same table
+  HashTable recovered(a, Allocator::kSize);
+  recovered.Recover();
+  EXPECT_EQ(ht.num_buckets(), recovered.num_buckets());
+  EXPECT_EQ(ht.num_items(), recovered.num_items());
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto c = ht.Find(Hash(keys[i]), keys[i].c_str(), keys[i].size());
+    ASSERT_EQ(objs[i], c.obj);
+    ht.Erase(c);
+    ht.Resize();
+  }
+  EXPECT_EQ(0, ht.num_items());
+  EXPECT_EQ(min_num_buckets, ht.num_buckets());
+  free(base);
+}
+
+TEST (HashTableTest, ConcurrentLookup) {
+  auto base = malloc(kTableSize);
+  assert(base != nullptr);
+  Allocator a(base);
+  ModificationList modifications;
+  a.set_modifications(&modifications);
+  HashTable ht(a, Allocator::kSize);
+  ht.Format();
+
+  vector<string> keys;
+  vector<uint32_t> objs;
+  for (size_t i = 0; i < 10 * 1000; ++i) {
+    keys.push_back("stable-" + to_string(i));
+    objs.push_back(NewObject(a, keys.back(), Hash(keys.back())));
+    ht.Insert(Hash(keys.back()), objs.back());
+  }
+
+  // Writers keep splitting and merging buckets
+  std::atomic<bool> stop {false};
+  vector<thread> writers;
+  for (size_t w = 0; w < 2; ++w) {
+    writers.emplace_back([&a, &ht, &stop, w]() {
+      ModificationList modifications;
+      a.set_modifications(&modifications);
+      for (size_t round = 0; !stop; ++round) {
+        vector<string> churn;
+        for (size_t i = 0; i < 50 * 1000; ++i) {
+          churn.push_back(to_string(w) + "-" + to_string(i));
+          auto hash = Hash(churn.back());
+          auto obj = NewObject(a, churn.back(), hash);
+          {
+            HashTable::BucketGuard guard(ht, hash);
+            ht.Insert(hash, obj);
+          }
+          ht.Resize();
+        }
+        for (auto& key : churn) {
+          auto hash = Hash(key);
+          uint32_t obj;
+          {
+            HashTable::BucketGuard guard(ht, hash);
+            auto c = ht.Find(hash, key.c_str(), key.size());
+            ht.Erase(c);
+            obj = c.obj;
+          }
+          a.Free(obj);
+          ht.Resize();
+        }
+        modifications.clear();
+      }
+    });
+  }
+
+  for (size_t round = 0; round < 20; ++round) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      uint32_t found = 0;
+      ASSERT_TRUE(ht.Lookup(Hash(keys[i]), keys[i].c_str(), keys[i].size(),
+                            [&found](uint32_t obj) { found = obj; }));
+      ASSERT_EQ(objs[i], found);
+    }
+  }
+  stop = true;
+  for (auto& w : writers) {
+    w.join();
+  }
+  free(base);
+}
+
+int main(int argc, char* argv[]) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
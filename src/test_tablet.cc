@@ -0,0 +1,260 @@
+#include "hash.h"
+#include "index.h"
+#include "request.h"
+#include "tablet.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace nvds;
+
+// A tablet in DRAM, without replicas unless of `index_manager`
+class TestTablet {
+ public:
+  explicit TestTablet(bool recover=false, char* mem=nullptr,
+                      const IndexManager* index_manager=nullptr,
+                      bool is_backup=false)
+      : mem_(mem != nullptr ? nullptr :
+             new char[NVMTablet::GetSize(config.tablet_size)]),
+        tablet_(index_manager != nullptr ? *index_manager : index_manager_,
+                NVMPtr<NVMTablet>(reinterpret_cast<NVMTablet*>(
+                    mem != nullptr ? mem : mem_.get())),
+                is_backup, recover) {}
+
+  Tablet* operator->() { return &tablet_; }
+  char* mem() { return mem_.get(); }
+  Status Put(const string& key, const string& val) {
+    auto r = MakeRequest(Request::Type::PUT, key, val);
+    ModificationList modifications;
+    auto status = tablet_.Put(r, modifications);
+    tablet_.Sync(modifications);
+    return status;
+  }
+  // Return once the record is posted, with the position after it
+  uint64_t PutWithoutWaiting(const string& key, const string& val) {
+    auto r = MakeRequest(Request::Type::PUT, key, val);
+    ModificationList modifications;
+    EXPECT_EQ(Status::OK, tablet_.Put(r, modifications));
+    return tablet_.Post(modifications);
+  }
+  // The writes are left in place, as if the server crashed before commit
+  Status PutWithoutSync(const string& key, const string& val) {
+    auto r = MakeRequest(Request::Type::PUT, key, val);
+    ModificationList modifications;
+    return tablet_.Put(r, modifications);
+  }
+  // Return false if the key is not found. The object is marked accessed.
+  bool Get(const string& key, string* val=nullptr) {
+    auto r = MakeRequest(Request::Type::GET, key, "");
+    vector<char> buf(sizeof(Response) + kMaxItemSize);
+    auto resp = Response::New(buf.data(), Request::Type::GET, Status::OK);
+    ModificationList modifications;
+    if (tablet_.Get(resp, r, kMaxItemSize, modifications) != Status::OK) {
+      return false;
+    }
+    if (val != nullptr) {
+      val->assign(resp->val, resp->val_len);
+    }
+    return true;
+  }
+  // The whole value, which may be stored in chunks
+  bool GetLong(const string& key, string* val) {
+    auto r = MakeRequest(Request::Type::GET, key, "");
+    vector<char> resp;
+    if (tablet_.Get(resp, r) != Status::OK) {
+      return false;
+    }
+    auto head = reinterpret_cast<const Response*>(resp.data());
+    val->assign(head->val, head->val_len);
+    return true;
+  }
+  Status Del(const string& key) {
+    auto r = MakeRequest(Request::Type::DEL, key, "");
+    ModificationList modifications;
+    auto status = tablet_.Del(r, modifications);
+    tablet_.Sync(modifications);
+    return status;
+  }
+
+ private:
+  const Request* MakeRequest(Request::Type type, const string& key,
+                             const string& val) {
+    req_.resize(sizeof(Request) + key.size() + val.size());
+    return Request::New(req_.data(), type, key.c_str(), key.size(),
+                        val.c_str(), val.size(), Hash(key));
+  }
+
+  IndexManager index_manager_;
+  unique_ptr<char[]> mem_;
+  Tablet tablet_;
+  vector<char> req_;
+};
+
+TEST (TabletTest, Evict) {
+  ASSERT_TRUE(kCacheMode);
+  TestTablet t;
+  string val(500, 'v');
+  ASSERT_EQ(Status::OK, t.Put("cold", val));
+  ASSERT_EQ(Status::OK, t.Put("hot", val));
+  // Items of five times the arena, while one is kept accessed
+  for (uint32_t i = 0; i < 5 * config.tablet_size / val.size(); ++i) {
+    ASSERT_EQ(Status::OK, t.Put("key" + to_string(i), val));
+    ASSERT_TRUE(t.Get("hot"));
+  }
+  ASSERT_FALSE(t.Get("cold"));
+  string hot;
+  ASSERT_TRUE(t.Get("hot", &hot));
+  ASSERT_EQ(val, hot);
+}
+
+TEST (TabletTest, RollBack) {
+  TestTablet t;
+  string a(100, 'a'), b(100, 'b');
+  ASSERT_EQ(Status::OK, t.Put("a", a));
+  ASSERT_EQ(Status::OK, t.Put("b", b));
+  // Overwritten in place, moved to a new object, and inserted
+  ASSERT_EQ(Status::OK, t.PutWithoutSync("a", string(100, 'x')));
+  ASSERT_EQ(Status::OK, t.PutWithoutSync("b", string(500, 'y')));
+  ASSERT_EQ(Status::OK, t.PutWithoutSync("c", "c"));
+
+  TestTablet r(true, t.mem());
+  ASSERT_LT(0, r->recovery_stats().num_undone_writes);
+  string val;
+  ASSERT_TRUE(r.Get("a", &val));
+  ASSERT_EQ(a, val);
+  ASSERT_TRUE(r.Get("b", &val));
+  ASSERT_EQ(b, val);
+  ASSERT_FALSE(r.Get("c"));
+  ASSERT_EQ(Status::OK, r.Put("c", "c"));
+  ASSERT_TRUE(r.Get("c", &val));
+  ASSERT_EQ("c", val);
+}
+
+// The ring of the log wraps around several times before the restart,
+// records after the persisted head are redone.
+TEST (TabletTest, RecoverAfterWrap) {
+  TestTablet t;
+  auto key = [](uint32_t i) { return "key" + to_string(i % 8); };
+  auto val = [](uint32_t i) { return string(16 * 1024, 'a' + i % 26); };
+  uint32_t n = 4 * NVMLog::kSize / (16 * 1024);
+  for (uint32_t i = 0; i < n; ++i) {
+    ASSERT_EQ(Status::OK, t.Put(key(i), val(i)));
+  }
+
+  TestTablet r(true, t.mem());
+  ASSERT_LT(0, r->recovery_stats().num_redone_records);
+  ASSERT_EQ(0, r->recovery_stats().num_undone_writes);
+  for (uint32_t i = n - 8; i < n; ++i) {
+    string got;
+    ASSERT_TRUE(r.GetLong(key(i), &got));
+    ASSERT_EQ(val(i), got);
+  }
+  ASSERT_EQ(Status::OK, r.Put(key(0), "v"));
+  string got;
+  ASSERT_TRUE(r.Get(key(0), &got));
+  ASSERT_EQ("v", got);
+}
+
+TEST (TabletTest, Compact) {
+  TestTablet t;
+  auto val = [](uint32_t i) { return string(100 + i % 64, 'a' + i % 26); };
+  // Up to the last large free block, then every other item is deleted
+  uint32_t n = 0;
+  while (t->allocator_stats().largest_free_block > Allocator::kMaxBlockSize) {
+    ASSERT_EQ(Status::OK, t.Put("key" + to_string(n), val(n)));
+    ++n;
+  }
+  for (uint32_t i = 0; i < n; i += 2) {
+    ASSERT_EQ(Status::OK, t.Del("key" + to_string(i)));
+  }
+  auto before = t->allocator_stats();
+  ASSERT_LT(0, before.fragmentation());
+
+  // Two passes over the index, while the arena is fragmented
+  uint32_t num_moved = 0;
+  for (uint32_t i = 0; i < 1024 * 1024 &&
+                       t->compaction_stats().num_passes < 2; ++i) {
+    ModificationList modifications;
+    num_moved += t->Compact(modifications);
+    t->Sync(modifications);
+  }
+  ASSERT_LT(0, num_moved);
+  ASSERT_GT(before.fragmentation(), t->allocator_stats().fragmentation());
+  for (uint32_t i = 0; i < n; ++i) {
+    string got;
+    if (i % 2 == 0) {
+      ASSERT_FALSE(t.Get("key" + to_string(i)));
+    } else {
+      ASSERT_TRUE(t.Get("key" + to_string(i), &got));
+      ASSERT_EQ(val(i), got);
+    }
+  }
+}
+
+// Records are appended faster than they are posted, as the writes in
+// flight to the backup are at the most, until the ring of the master wraps
+// around twice. Those not yet posted must not be overwritten.
+TEST (TabletTest, FillLogWhilePostingIsBlocked) {
+  int num_devices = 0;
+  auto devices = ibv_get_device_list(&num_devices);
+  if (devices != nullptr) {
+    ibv_free_device_list(devices);
+  }
+  if (num_devices == 0) {
+    GTEST_SKIP() << "no RDMA device";
+  }
+  auto saved = config;
+  config.num_servers = 1;
+  config.num_tablets_per_server = 1;
+  config.num_replicas = 1;
+  IndexManager index_manager(config);
+  {
+    TestTablet master(false, nullptr, &index_manager, false);
+    TestTablet backup(false, nullptr, &index_manager, true);
+    nlohmann::json msg {
+      {"ib_addr", Infiniband::Address {Infiniband::kPort, 0, 0}},
+      {"tablet_qpis", {master->info().qpis[0], backup->info().qpis[0]}}
+    };
+    index_manager.AddServer("localhost", msg);
+    master->SettingupQPConnect(0, index_manager);
+    backup->SettingupQPConnect(1, index_manager);
+
+    atomic<bool> done {false};
+    thread apply([&] {
+      while (!done) {
+        backup->Apply();
+      }
+    });
+    auto key = [](uint32_t i) { return "key" + to_string(i % 64); };
+    auto val = [](uint32_t i) { return string(4000, 'a' + i % 26); };
+    uint32_t n = 2 * NVMLog::kSize / 4000;
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      end = master.PutWithoutWaiting(key(i), val(i));
+    }
+    while (master->Poll() < end) {}
+    done = true;
+    apply.join();
+    backup->Apply();
+    for (uint32_t i = n - 64; i < n; ++i) {
+      string got;
+      ASSERT_TRUE(backup.Get(key(i), &got));
+      ASSERT_EQ(val(i), got);
+    }
+  }
+  config = saved;
+}
+
+int main(int argc, char* argv[]) {
+  config.num_replicas = 0;
+  config.tablet_size = 1024 * 1024;
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}